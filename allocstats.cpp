@@ -0,0 +1,79 @@
+/*
+  Process-wide allocation counter for the benchmarks
+ */
+
+#include "allocstats.h"
+
+#include <stdlib.h>
+
+#include <QAtomicInt>
+#include <QtGlobal>
+
+// Plain static initialisation: allocations start before main()
+static QBasicAtomicInt sAllocations = Q_BASIC_ATOMIC_INITIALIZER(0);
+
+#if defined(KLAATU_ALLOC_STATS)
+
+#if defined(__GLIBC__)
+
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    sAllocations.ref();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    sAllocations.ref();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    sAllocations.ref();
+    return __libc_realloc(ptr, size);
+}
+
+} // extern "C"
+
+#else // !__GLIBC__
+
+static void *countedNew(size_t size)
+{
+    sAllocations.ref();
+    void *ptr = malloc(size ? size : 1);
+    Q_CHECK_PTR(ptr);
+    return ptr;
+}
+
+void *operator new(size_t size)   { return countedNew(size); }
+void *operator new[](size_t size) { return countedNew(size); }
+void operator delete(void *ptr)   { free(ptr); }
+void operator delete[](void *ptr) { free(ptr); }
+
+#endif // __GLIBC__
+
+bool AllocStats::isEnabled()
+{
+    return true;
+}
+
+#else // !KLAATU_ALLOC_STATS
+
+bool AllocStats::isEnabled()
+{
+    return false;
+}
+
+#endif // KLAATU_ALLOC_STATS
+
+int AllocStats::count()
+{
+    return sAllocations.load();
+}
@@ -0,0 +1,24 @@
+/*
+  Process-wide allocation counter for the benchmarks
+ */
+
+#ifndef _ALLOC_STATS_H
+#define _ALLOC_STATS_H
+
+/*
+  Counts heap allocations from every thread.  The counting hooks are
+  only built with CONFIG += KLAATU_ALLOC_STATS; otherwise isEnabled()
+  is false and count() stays at zero.
+
+  With glibc malloc(), calloc() and realloc() are wrapped, which also
+  catches the Qt containers.  Elsewhere only operator new is counted.
+ */
+
+class AllocStats
+{
+public:
+    static bool isEnabled();
+    static int  count();
+};
+
+#endif // _ALLOC_STATS_H
@@ -3,6 +3,7 @@
 
 #include "audiocontrol.h"
 #include "callmodel.h"
+#include "mediaworker.h"
 
 #include <stdio.h>
 #include <sys/types.h>
@@ -21,6 +22,8 @@
 #include <QMutex>
 #include <QDebug>
 #include <QDir>
+#include <QRunnable>
+#include <QThreadPool>
 #include <QUrl>
 
 using namespace android;
@@ -46,61 +49,6 @@ static android::ToneGenerator *toneGenerator() {
 
 // -------------------------------------------------------------------
 
-class MyMediaPlayer : public RefBase {
-public:
-    static const sp<MyMediaPlayer>& instance() {
-	static sp<MyMediaPlayer> _sMediaPlayer;
-	if (_sMediaPlayer.get() == 0)
-	    _sMediaPlayer = new MyMediaPlayer;
-	return _sMediaPlayer;
-    }
-       
-    bool playSong(const char *filename, int looping, audio_stream_type_t stream_type) {
-	Mutex::Autolock _l(mServiceLock);
-
-	int fd = ::open(filename, O_RDONLY);
-	if (fd < 0) {
-	    perror("Unable to open file!");
-	    return false;
-	}
-	struct stat stat_buf;
-	int ret = ::fstat(fd, &stat_buf);
-	if (ret < 0) {
-	    perror("Unable to stat file");
-	    ::close(fd);
-	    return false;
-	}
-
-	mMediaPlayer->reset();
-	mMediaPlayer->setAudioStreamType(stream_type);
-	mMediaPlayer->setDataSource(fd, 0, stat_buf.st_size);
-	mMediaPlayer->setLooping(looping);
-	mMediaPlayer->prepare();   // This is a bad idea...should use async method
-	close(fd);
-	mMediaPlayer->start();
-	return true;
-    }
-
-    void stopSong() {
-	Mutex::Autolock _l(mServiceLock);
-	mMediaPlayer->stop();
-    }
-
-    virtual void notify(int msg, int ext1, int ext2, const Parcel *obj) {
-	UNUSED(obj);
-	printf("notify %d %d %d\n", msg, ext1, ext2);
-    }
-
-private:
-    MyMediaPlayer() {
-	mMediaPlayer = new MediaPlayer;
-    }
-
-    mutable Mutex   mServiceLock;
-    sp<MediaPlayer> mMediaPlayer;
-};
-
-
 float getMasterVolume() 
 {
     float value = 0;
@@ -301,7 +249,20 @@ protected:
 
 AudioFile::AudioFile(QObject *object)
     : QObject(object)
+    , mStreamType(MusicStream)
+    , mPreload(false)
+    , mPreloaded(false)
+    , mState(Stopped)
+    , mSerial(0)
+{
+    connect(MediaWorker::instance(), SIGNAL(voiceStateChanged(QObject *, int, int)),
+	    SLOT(voiceStateChanged(QObject *, int, int)), Qt::QueuedConnection);
+}
+
+AudioFile::~AudioFile()
 {
+    stop();
+    updatePreload(false);
 }
 
 void AudioFile::setSource(const QUrl& url)
@@ -309,25 +270,84 @@ void AudioFile::setSource(const QUrl& url)
     if ((url.isEmpty() == mUrl.isEmpty()) && url == mUrl)
         return;
 
+    updatePreload(false);
     mUrl = url;
+    updatePreload(mPreload);
     emit sourceChanged();
 }
 
+void AudioFile::setStreamType(StreamType streamType)
+{
+    if (streamType == mStreamType)
+	return;
+
+    updatePreload(false);
+    mStreamType = streamType;
+    updatePreload(mPreload);
+    emit streamTypeChanged();
+}
+
+void AudioFile::setPreload(bool preload)
+{
+    if (preload == mPreload)
+	return;
+
+    mPreload = preload;
+    updatePreload(preload);
+    emit preloadChanged();
+}
+
+void AudioFile::updatePreload(bool preload)
+{
+    preload = preload && mUrl.isLocalFile();
+    if (preload == mPreloaded)
+	return;
+    mPreloaded = preload;
+    if (preload)
+	MediaWorker::instance()->preload(mUrl.toLocalFile(), mStreamType);
+    else
+	MediaWorker::instance()->unload(mUrl.toLocalFile(), mStreamType);
+}
+
 bool AudioFile::play(int looping)
 {
-    QString filename = mUrl.toLocalFile();
-    return MyMediaPlayer::instance()->playSong(filename.toLocal8Bit(), looping, AUDIO_STREAM_MUSIC);
+    return startVoice(mStreamType, looping);
 }
 
 bool AudioFile::ring()
 {
-    QString filename = mUrl.toLocalFile();
-    return MyMediaPlayer::instance()->playSong(filename.toLocal8Bit(), 1, AUDIO_STREAM_RING);
+    return startVoice(RingStream, true);
+}
+
+bool AudioFile::startVoice(int streamType, bool looping)
+{
+    if (!mUrl.isLocalFile())
+	return false;
+    MediaWorker::instance()->play(this, ++mSerial, mUrl.toLocalFile(), streamType, looping);
+    setState(Preparing);
+    return true;
 }
 
 void AudioFile::stop()
 {
-    MyMediaPlayer::instance()->stopSong();
+    mSerial++;   // Ignore reports about the voice being stopped
+    MediaWorker::instance()->stop(this);
+    setState(Stopped);
+}
+
+// Every AudioFile sees every report; only the latest voice of this one counts
+void AudioFile::voiceStateChanged(QObject *owner, int serial, int state)
+{
+    if (owner == this && serial == mSerial)
+	setState(static_cast<State>(state));
+}
+
+void AudioFile::setState(State state)
+{
+    if (state != mState) {
+	mState = state;
+	emit stateChanged();
+    }
 }
 
 
@@ -345,13 +365,43 @@ AudioControl *AudioControl::instance()
     return _s_audio_control;
 }
 
+// Stream and index range for each VolumeSlot.  The ranges are the
+// Android defaults; the media server has no call to report them.
+static const struct {
+    audio_stream_type_t stream;
+    int                 min, max;
+} kVolumeStreams[] = {
+    { AUDIO_STREAM_RING,         0,  7 },
+    { AUDIO_STREAM_NOTIFICATION, 0,  7 },
+    { AUDIO_STREAM_VOICE_CALL,   1,  5 },
+    { AUDIO_STREAM_DTMF,         0, 15 },
+    { AUDIO_STREAM_MUSIC,        0, 15 },
+};
+
+static void audioErrorCallback(status_t err)
+{
+    // The media server restarted and may have reset the volumes
+    if (err == DEAD_OBJECT)
+	AudioControl::instance()->resyncVolumes();
+}
+
 AudioControl::AudioControl()
     : mSIMPresent(false)
     , mRssi(0)
     , mState(STATE_IDLE)
+    , mVolumeResync(false)
+    , mVolumeTaskPosted(false)
 {
     mCallModel = new CallModel(this);
 
+    // Fill the volume cache before anything can adjust a volume
+    // relative to it; later changes are read back in a VolumeTask
+    for (int i = 0 ; i < kVolumeSlots ; i++) {
+	mVolume[i].store(getStreamVolumeIndex(kVolumeStreams[i].stream));
+	mPendingVolume[i] = -1;
+    }
+    AudioSystem::setErrorCallback(audioErrorCallback);
+
     // For now, we'll assume that only Maguro devices have a radio
     char devicename[PROPERTY_VALUE_MAX];
 
@@ -471,6 +521,11 @@ void AudioControl::setCalls(const QList<Call>& callList)
 
     printf("#### AudioControl::setCalls old_state=%d new_state=%d\n", mState, s);
     if (s != mState) {
+	// Start and stop the ringer from here, on the radio thread
+	if (s == STATE_INCOMING && mRingtone.isLocalFile())
+	    MediaWorker::instance()->play(this, 0, mRingtone.toLocalFile(), AUDIO_STREAM_RING, true);
+	else if (mState == STATE_INCOMING)
+	    MediaWorker::instance()->stop(this);
 	mState = s;
 	emit stateChanged();
     }
@@ -515,6 +570,25 @@ int AudioControl::callState() const
     return mCallState;
 }
 
+QUrl AudioControl::ringtone() const
+{
+    QMutexLocker locker(&sAudioMutex);
+    return mRingtone;
+}
+
+void AudioControl::setRingtone(const QUrl& url)
+{
+    QMutexLocker locker(&sAudioMutex);
+    if (url == mRingtone)
+	return;
+    if (mRingtone.isLocalFile())
+	MediaWorker::instance()->unload(mRingtone.toLocalFile(), AUDIO_STREAM_RING);
+    mRingtone = url;
+    if (mRingtone.isLocalFile())
+	MediaWorker::instance()->preload(mRingtone.toLocalFile(), AUDIO_STREAM_RING);
+    emit ringtoneChanged();
+}
+
 // --------------------------------------------------------------
 
 void AudioControl::startTone(int tone, int duration)
@@ -560,30 +634,126 @@ void AudioControl::reject()
 }
 
 /*
-  Pass in a value from +15 to -15 (depending on channel)
+  Pass in a value from +15 to -15 (depending on channel).  This only
+  touches the volume cache; the binder calls happen in a VolumeTask.
+  sAudioMutex is held just long enough to read the call state.
  */
 
 int AudioControl::adjustVolumeForCurrentState(int delta)
 {
-    QMutexLocker locker(&sAudioMutex);
-
-    int volume = getStreamVolumeIndex(mState == STATE_ACTIVE ? 
-				      AUDIO_STREAM_VOICE_CALL : AUDIO_STREAM_RING);
-    volume += delta;
+    int state;
+    {
+	QMutexLocker locker(&sAudioMutex);
+	state = mState;
+    }
 
-    switch (mState) {
+    int volume;
+    switch (state) {
+    case STATE_ACTIVE:
+	volume = mVolume[VOLUME_CALL].load() + delta;
+	setVolume(VOLUME_CALL, volume);
+	setVolume(VOLUME_DTMF, volume);
+	return mVolume[VOLUME_CALL].load();
     case STATE_IDLE:
     case STATE_INCOMING:
-	setStreamVolumeIndex(AUDIO_STREAM_RING, volume);
-	setStreamVolumeIndex(AUDIO_STREAM_NOTIFICATION, volume);
-	break;
-    case STATE_ACTIVE:
-	setStreamVolumeIndex(AUDIO_STREAM_VOICE_CALL, volume);
-	setStreamVolumeIndex(AUDIO_STREAM_DTMF, volume);
-	break;
+    default:
+	volume = mVolume[VOLUME_RING].load() + delta;
+	setVolume(VOLUME_RING, volume);
+	setVolume(VOLUME_NOTIFICATION, volume);
+	return mVolume[VOLUME_RING].load();
+    }
+}
+
+// --------------------------------------------------------------
+
+class VolumeTask : public QRunnable
+{
+public:
+    VolumeTask(AudioControl *control) : mControl(control) {}
+    void run() { mControl->applyVolumes(); }
+
+private:
+    AudioControl *mControl;
+};
+
+void AudioControl::setVolume(int slot, int index)
+{
+    index = qBound(kVolumeStreams[slot].min, index, kVolumeStreams[slot].max);
+    storeVolume(slot, index);
+
+    QMutexLocker locker(&mVolumeLock);
+    mPendingVolume[slot] = index;
+    postVolumeTaskLocked();
+}
+
+void AudioControl::storeVolume(int slot, int index)
+{
+    if (mVolume[slot].fetchAndStoreOrdered(index) == index)
+	return;
+    switch (slot) {
+    case VOLUME_RING:         emit ringVolumeChanged(); break;
+    case VOLUME_NOTIFICATION: emit notificationVolumeChanged(); break;
+    case VOLUME_CALL:         emit callVolumeChanged(); break;
+    case VOLUME_MUSIC:        emit musicVolumeChanged(); break;
+    }
+}
+
+void AudioControl::resyncVolumes()
+{
+    QMutexLocker locker(&mVolumeLock);
+    mVolumeResync = true;
+    postVolumeTaskLocked();
+}
+
+// At most one VolumeTask is queued or running at a time
+void AudioControl::postVolumeTaskLocked()
+{
+    if (!mVolumeTaskPosted) {
+	mVolumeTaskPosted = true;
+	QThreadPool::globalInstance()->start(new VolumeTask(this));
     }
+}
+
+/*
+  Apply the latest pending index of each stream, then read the streams
+  back so the cache matches what the media server accepted.  A stream
+  that was changed again meanwhile is not read back; its next round
+  will be.  Repeats until nothing is pending.
+ */
 
-    volume = getStreamVolumeIndex(mState == STATE_ACTIVE ? 
-				  AUDIO_STREAM_VOICE_CALL : AUDIO_STREAM_RING);
-    return volume;
+void AudioControl::applyVolumes()
+{
+    while (true) {
+	int pending[kVolumeSlots];
+	mVolumeLock.lock();
+	bool resync = mVolumeResync;
+	bool any = resync;
+	mVolumeResync = false;
+	for (int i = 0 ; i < kVolumeSlots ; i++) {
+	    pending[i] = mPendingVolume[i];
+	    mPendingVolume[i] = -1;
+	    any = any || pending[i] >= 0;
+	}
+	if (!any) {
+	    mVolumeTaskPosted = false;
+	    mVolumeLock.unlock();
+	    return;
+	}
+	mVolumeLock.unlock();
+
+	for (int i = 0 ; i < kVolumeSlots ; i++)
+	    if (pending[i] >= 0)
+		setStreamVolumeIndex(kVolumeStreams[i].stream, pending[i]);
+
+	for (int i = 0 ; i < kVolumeSlots ; i++) {
+	    if (!resync && pending[i] < 0)
+		continue;
+	    int index = getStreamVolumeIndex(kVolumeStreams[i].stream);
+	    mVolumeLock.lock();
+	    bool superseded = (mPendingVolume[i] >= 0);
+	    mVolumeLock.unlock();
+	    if (!superseded)
+		storeVolume(i, index);
+	}
+    }
 }
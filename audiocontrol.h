@@ -6,20 +6,49 @@
 #define _AUDIOCONTROL_H
 
 #include <QObject>
+#include <QAtomicInt>
 #include <QMutex>
 #include <QUrl>
 #include "callmodel.h"
 
+/*
+  A sound file.  Playback happens on the media thread (see MediaWorker),
+  so play() and ring() return as soon as the request is queued.  Set
+  'preload' for sounds that must start without delay; the file is then
+  kept prepared on 'streamType', which play() uses.  ring() always uses
+  the ring stream.
+
+  Each AudioFile plays at most one voice at a time, and 'state' follows
+  it.  A voice is stopped when the AudioFile is destroyed; it can also
+  be preempted by a higher priority sound when the voice pool is full.
+ */
+
 class AudioFile : public QObject
 {
     Q_OBJECT
+    Q_ENUMS(StreamType)
+    Q_ENUMS(State)
     Q_PROPERTY(QUrl source READ source WRITE setSource NOTIFY sourceChanged)
+    Q_PROPERTY(StreamType streamType READ streamType WRITE setStreamType NOTIFY streamTypeChanged)
+    Q_PROPERTY(bool preload READ preload WRITE setPreload NOTIFY preloadChanged)
+    Q_PROPERTY(State state READ state NOTIFY stateChanged)
 
 public:
+    // Keep in sync with audio_stream_type_t
+    enum StreamType { SystemStream = 1, RingStream = 2, MusicStream = 3, NotificationStream = 5 };
+    // Keep in sync with MediaWorker::VoiceState
+    enum State { Stopped, Preparing, Playing, Preempted, Error };
+
     AudioFile(QObject *parent=0);
+    ~AudioFile();
     
     QUrl source() const { return mUrl; }
     void setSource(const QUrl& url);
+    StreamType streamType() const { return mStreamType; }
+    void setStreamType(StreamType streamType);
+    bool preload() const { return mPreload; }
+    void setPreload(bool preload);
+    State state() const { return mState; }
 
     Q_INVOKABLE bool play(int looping);
     Q_INVOKABLE bool ring();
@@ -27,9 +56,24 @@ public:
 
 signals:
     void sourceChanged();
+    void streamTypeChanged();
+    void preloadChanged();
+    void stateChanged();
+
+private slots:
+    void voiceStateChanged(QObject *owner, int serial, int state);
 
 private:
+    void updatePreload(bool preload);
+    bool startVoice(int streamType, bool looping);
+    void setState(State state);
+
     QUrl mUrl;
+    StreamType mStreamType;
+    bool mPreload;
+    bool mPreloaded;     // Currently holding a preload of mUrl on mStreamType
+    State mState;
+    int mSerial;         // Of the latest play() or stop()
 };
 
 class AudioControl : public QObject
@@ -46,6 +90,11 @@ class AudioControl : public QObject
     Q_PROPERTY(QString callID READ callID NOTIFY callIDChanged)
     Q_PROPERTY(int index READ index NOTIFY indexChanged)
     Q_PROPERTY(int callState READ callState NOTIFY callStateChanged)
+    Q_PROPERTY(QUrl ringtone READ ringtone WRITE setRingtone NOTIFY ringtoneChanged)
+    Q_PROPERTY(int ringVolume READ ringVolume WRITE setRingVolume NOTIFY ringVolumeChanged)
+    Q_PROPERTY(int notificationVolume READ notificationVolume WRITE setNotificationVolume NOTIFY notificationVolumeChanged)
+    Q_PROPERTY(int callVolume READ callVolume WRITE setCallVolume NOTIFY callVolumeChanged)
+    Q_PROPERTY(int musicVolume READ musicVolume WRITE setMusicVolume NOTIFY musicVolumeChanged)
 
     Q_PROPERTY(QObject *callModel READ callModel NOTIFY callModelChanged)
 
@@ -83,6 +132,24 @@ public:
     int      index() const;
     int      callState() const;
 
+    // Kept preloaded and started directly from the call state change,
+    // without a round trip through QML
+    QUrl     ringtone() const;
+    void     setRingtone(const QUrl& url);
+
+    // Volume indexes per stream.  The getters read a cache; setting one
+    // updates the cache at once and applies the change on a worker
+    // thread, where a run of changes is coalesced into one.
+    int      ringVolume() const { return mVolume[VOLUME_RING].load(); }
+    void     setRingVolume(int index) { setVolume(VOLUME_RING, index); }
+    int      notificationVolume() const { return mVolume[VOLUME_NOTIFICATION].load(); }
+    void     setNotificationVolume(int index) { setVolume(VOLUME_NOTIFICATION, index); }
+    int      callVolume() const { return mVolume[VOLUME_CALL].load(); }
+    void     setCallVolume(int index) { setVolume(VOLUME_CALL, index); }
+    int      musicVolume() const { return mVolume[VOLUME_MUSIC].load(); }
+    void     setMusicVolume(int index) { setVolume(VOLUME_MUSIC, index); }
+    void     resyncVolumes();   // Re-read every stream from the media server
+
     Q_INVOKABLE void startTone(int tone, int duration);  // duration in ms (-1=forever)
     Q_INVOKABLE void stopTone();
 
@@ -91,9 +158,8 @@ public:
     Q_INVOKABLE void hangup(int index);  // Hang up an active call
     Q_INVOKABLE void reject();           // Reject a call in the 'RINGING' state
 
-    // These are not connected to a property because we have no way of generating
-    // an accurate NOTIFY message.  They are dependent on whether or not we're in a
-    // call.
+    // Adjusts the ring and notification volumes, or the call and DTMF
+    // volumes while in a call.  Returns the new ring or call volume.
     Q_INVOKABLE int  adjustVolumeForCurrentState(int delta);
 
 signals:
@@ -105,10 +171,23 @@ signals:
     void callIDChanged();
     void indexChanged();
     void callStateChanged();
+    void ringtoneChanged();
+    void ringVolumeChanged();
+    void notificationVolumeChanged();
+    void callVolumeChanged();
+    void musicVolumeChanged();
 
 private:
     AudioControl();
 
+    enum VolumeSlot { VOLUME_RING, VOLUME_NOTIFICATION, VOLUME_CALL, VOLUME_DTMF, VOLUME_MUSIC,
+		      kVolumeSlots };
+
+    void    setVolume(int slot, int index);     // Clamp, cache and queue
+    void    storeVolume(int slot, int index);   // Cache and notify
+    void    postVolumeTaskLocked();
+    void    applyVolumes();                     // On the worker thread
+
     bool    mRadioPresent;
     bool    mSIMPresent;
     QString mShortONS;
@@ -118,12 +197,20 @@ private:
     QString mCallID;
     int     mIndex;
     int     mCallState;
+    QUrl    mRingtone;
+
+    QAtomicInt mVolume[kVolumeSlots];
+    QMutex  mVolumeLock;                 // Guards the pending state below
+    int     mPendingVolume[kVolumeSlots];   // -1 when nothing is pending
+    bool    mVolumeResync;               // Re-read every stream
+    bool    mVolumeTaskPosted;
 
     CallModel *mCallModel;
 
     static QMutex sAudioMutex;
 
     friend class CallModel;
+    friend class VolumeTask;
 };
 
 #endif // _AUDIOCONTROL_H
@@ -4,113 +4,37 @@
 
 
 #include "battery.h"
-#include <hardware_legacy/uevent.h>
-
-#if defined(SHORT_PLATFORM_VERSION) && (SHORT_PLATFORM_VERSION >= 42)
-#else
-#include <linux/netlink.h>
-#endif
-#include <sys/un.h>
-#include <sys/socket.h>
-#include <sys/queue.h>
 
 #include <QDirIterator>
 #include <QFile>
 #include <QFileInfo>
 #include <QDir>
+#include <QDateTime>
+#include <QElapsedTimer>
 #include <QDebug>
+#include <QVariantMap>
 
 // --------------------------------------------------------------------------------
 
-struct uevent {
-    const char *action;
-    const char *path;
-    const char *subsystem;
-    const char *firmware;
-    const char *partition_name;
-    int partition_num;
-    int major;
-    int minor;
-};
-
-
-static void parse_event(const char *msg, struct uevent *uevent)
+Battery *Battery::instance()
 {
-    uevent->action = "";
-    uevent->path = "";
-    uevent->subsystem = "";
-    uevent->firmware = "";
-    uevent->major = -1;
-    uevent->minor = -1;
-    uevent->partition_name = NULL;
-    uevent->partition_num = -1;
-
-        /* currently ignoring SEQNUM */
-    while(*msg) {
-        if(!strncmp(msg, "ACTION=", 7)) {
-            msg += 7;
-            uevent->action = msg;
-        } else if(!strncmp(msg, "DEVPATH=", 8)) {
-            msg += 8;
-            uevent->path = msg;
-        } else if(!strncmp(msg, "SUBSYSTEM=", 10)) {
-            msg += 10;
-            uevent->subsystem = msg;
-        } else if(!strncmp(msg, "FIRMWARE=", 9)) {
-            msg += 9;
-            uevent->firmware = msg;
-        } else if(!strncmp(msg, "MAJOR=", 6)) {
-            msg += 6;
-            uevent->major = atoi(msg);
-        } else if(!strncmp(msg, "MINOR=", 6)) {
-            msg += 6;
-            uevent->minor = atoi(msg);
-        } else if(!strncmp(msg, "PARTN=", 6)) {
-            msg += 6;
-            uevent->partition_num = atoi(msg);
-        } else if(!strncmp(msg, "PARTNAME=", 9)) {
-            msg += 9;
-            uevent->partition_name = msg;
-        }
-            /* advance to after the next \0 */
-        while(*msg++)
-            ;
-    }
-//    printf("event { '%s', '%s', '%s', '%s', %d, %d }\n",
-//	   uevent->action, uevent->path, uevent->subsystem,
-//	   uevent->firmware, uevent->major, uevent->minor);
+    static Battery *_s_battery = 0;
+    if (!_s_battery)
+        _s_battery = new Battery;
+    return _s_battery;
 }
 
-const int UEVENT_MSG_LEN = 1024;
+QString Battery::sHistoryFile;
+QString Battery::sSysfsRoot(QStringLiteral("/sys/class/power_supply"));
 
-void UEventWatcher::run()
+void Battery::setHistoryFile(const QString& path)
 {
-    if (uevent_init()) {
-	char msg[UEVENT_MSG_LEN+2];
-	int n;
-	while ((n = uevent_next_event(msg, UEVENT_MSG_LEN)) > 0) {
-	    if (n >= UEVENT_MSG_LEN)
-		continue;
-	    msg[n] = 0;
-	    msg[n+1] = 0;
-	    struct uevent uevent;
-	    parse_event(msg, &uevent);
-	    if (strcmp(uevent.subsystem,"power_supply") == 0) {
-		emit activity();
-	    }
-	}
-    }
+    sHistoryFile = path;
 }
 
-
-// --------------------------------------------------------------------------------
-
-Battery *Battery::instance()
+void Battery::setSysfsRoot(const QString& path)
 {
-    static Battery *_s_battery = 0;
-    if (!_s_battery)
-        _s_battery = new Battery;
-    return _s_battery;
+    sSysfsRoot = path;
 }
 
 static QString checkFile(const QDir& dir, const QString& name)
@@ -129,10 +53,19 @@ Battery::Battery()
     , mUSBOnline(false)
     , mCapacity(0)
     , mVoltage(0)
+    , mCurrent(0)
     , mTemperature(0)
     , mVoltageDivisor(1)
+    , mLastSample(0)
+    , mDebounceInterval(1000)
+    , mTrailingUpdate(false)
 {
-    QDirIterator it(QStringLiteral("/sys/class/power_supply"));
+    mDebounceTimer.setSingleShot(true);
+    connect(&mDebounceTimer, SIGNAL(timeout()), SLOT(debounceExpired()));
+
+    memset(&mStats, 0, sizeof(mStats));
+
+    QDirIterator it(sSysfsRoot);
     while (it.hasNext()) {
 	QString path = it.next();
 	QString name = it.fileName();
@@ -144,38 +77,40 @@ Battery::Battery()
 	    if (tfile.open(QIODevice::ReadOnly | QIODevice::Text)) {
 		QByteArray data = tfile.readLine().trimmed();
 		if (data == "Mains") {
-		    mPathACOnline = checkFile(d, QStringLiteral("online"));
+		    mACOnlineAttr.setPath(checkFile(d, QStringLiteral("online")));
 		}
 		else if (data == "USB") {
-		    mPathUSBOnline = checkFile(d, QStringLiteral("online"));
+		    mUSBOnlineAttr.setPath(checkFile(d, QStringLiteral("online")));
 		}
 		else if (data == "Battery") {
-		    mPathBatteryStatus     = checkFile(d, QStringLiteral("status"));
-		    mPathBatteryHealth     = checkFile(d, QStringLiteral("health"));
-		    mPathBatteryPresent    = checkFile(d, QStringLiteral("present"));
-		    mPathBatteryCapacity   = checkFile(d, QStringLiteral("capacity"));
-		    mPathBatteryTechnology = checkFile(d, QStringLiteral("technology"));
-
-		    mPathBatteryVoltage = checkFile(d, QStringLiteral("voltage_now"));
-		    if (!mPathBatteryVoltage.isEmpty())
+		    mStatusAttr.setPath(checkFile(d, QStringLiteral("status")));
+		    mHealthAttr.setPath(checkFile(d, QStringLiteral("health")));
+		    mPresentAttr.setPath(checkFile(d, QStringLiteral("present")));
+		    mCapacityAttr.setPath(checkFile(d, QStringLiteral("capacity")));
+		    mTechnologyAttr.setPath(checkFile(d, QStringLiteral("technology")));
+
+		    QString voltage = checkFile(d, QStringLiteral("voltage_now"));
+		    if (!voltage.isEmpty())
 			mVoltageDivisor = 1000;
 		    else
-			mPathBatteryVoltage = checkFile(d, QStringLiteral("batt_volt"));
+			voltage = checkFile(d, QStringLiteral("batt_volt"));
+		    mVoltageAttr.setPath(voltage);
+		    mCurrentAttr.setPath(checkFile(d, QStringLiteral("current_now")));
 		    
-		    mPathBatteryTemperature = checkFile(d, QStringLiteral("temp"));
-		    if (mPathBatteryTemperature.isEmpty())
-			mPathBatteryTemperature = checkFile(d, QStringLiteral("batt_temp"));
-
+		    QString temperature = checkFile(d, QStringLiteral("temp"));
+		    if (temperature.isEmpty())
+			temperature = checkFile(d, QStringLiteral("batt_temp"));
+		    mTemperatureAttr.setPath(temperature);
 		}
 	    }
 	}
     }
+    if (!sHistoryFile.isEmpty())
+	mHistory.setFile(sHistoryFile);
     update();
 
-    // Monitor UEvent
-    UEventWatcher *watcher = new UEventWatcher();
-    connect(watcher, SIGNAL(activity()), SLOT(update()));
-    watcher->start();
+    UEventDispatcher::instance()->subscribe("power_supply", QByteArray(),
+					    this, SLOT(ueventsReceived(UEventBatch)));
 }
 
 Battery::~Battery()
@@ -183,36 +118,72 @@ Battery::~Battery()
     // Could kill the event hub, but this should only run if everyone is dying
 }
 
-static QByteArray getByteArray(const QString& path)
+void Battery::setDebounceInterval(int interval)
 {
-    if (path.isEmpty())
-	return QByteArray();
-
-    QFile f(path);
-    if (f.open(QIODevice::ReadOnly | QIODevice::Text)) 
-	return f.readLine().trimmed();
-    return QByteArray();
+    if (interval < 0)
+	interval = 0;
+    if (interval != mDebounceInterval) {
+	mDebounceInterval = interval;
+	if (!mDebounceInterval && mDebounceTimer.isActive()) {
+	    mDebounceTimer.stop();
+	    debounceExpired();
+	}
+	emit debounceIntervalChanged();
+    }
 }
 
-static bool getBooleanValue(const QString& path)
+/*
+  A batch holds every power_supply uevent since the last delivery;
+  one re-read of sysfs covers all of them.
+
+  Some PMICs send several uevents a second while charging.  The first
+  event in a quiet period updates at once (leading edge) and opens a
+  window of 'debounceInterval' ms; events inside the window are folded
+  into a single update when it closes (trailing edge).  A charger being
+  plugged or unplugged, or a health change, is never held back.
+ */
+
+void Battery::ueventsReceived(const UEventBatch& batch)
 {
-    QByteArray data = getByteArray(path);
-    return (data.size() && data.data()[0] != '0');
+    mStats.uevents += batch.size();
+    mStats.batches++;
+
+    if (!mDebounceInterval) {
+	update();
+	return;
+    }
+
+    if (!mDebounceTimer.isActive() || criticalChanged()) {
+	mTrailingUpdate = false;
+	update();
+	mDebounceTimer.start(mDebounceInterval);
+    }
+    else
+	mTrailingUpdate = true;
 }
 
-static int getIntegerValue(const QString& path)
+void Battery::debounceExpired()
 {
-    QByteArray data = getByteArray(path);
-    if (data.size())
-	return data.toInt();
-    return 0;
+    if (mTrailingUpdate) {
+	mTrailingUpdate = false;
+	update();
+	// The trailing update starts a new window of its own
+	if (mDebounceInterval)
+	    mDebounceTimer.start(mDebounceInterval);
+    }
 }
 
-static Battery::BatteryStatus getStatusValue(const QString& path)
+/*
+  The sysfs attributes are kept open and re-read with pread() into
+  stack buffers, so an update does not allocate unless the technology
+  string changes.
+ */
+
+static Battery::BatteryStatus getStatusValue(SysfsAttribute& attr)
 {
-    QByteArray data = getByteArray(path);
-    if (data.size()) {
-	switch (data.data()[0]) {
+    char data[SysfsAttribute::kMaxValue];
+    if (attr.read(data, sizeof(data)) > 0) {
+	switch (data[0]) {
 	case 'C': return Battery::CHARGING;
 	case 'D': return Battery::DISCHARGING;
 	case 'F': return Battery::FULL;
@@ -224,22 +195,22 @@ static Battery::BatteryStatus getStatusValue(const QString& path)
     return Battery::STATUS_UNKNOWN;
 }
 
-static Battery::BatteryHealth getHealthValue(const QString& path)
+static Battery::BatteryHealth getHealthValue(SysfsAttribute& attr)
 {
-    QByteArray data = getByteArray(path);
-    if (data.size()) {
-	switch (data.data()[0]) {
+    char data[SysfsAttribute::kMaxValue];
+    if (attr.read(data, sizeof(data)) > 0) {
+	switch (data[0]) {
 	case 'C': return Battery::COLD;
 	case 'D': return Battery::DEAD;
 	case 'G': return Battery::GOOD;
 	case 'O': 
-	    if (data == "Overheat")
+	    if (!strcmp(data, "Overheat"))
 		return Battery::OVERHEAT;
-	    else if (data == "Over voltage")
+	    else if (!strcmp(data, "Over voltage"))
 		return Battery::OVERVOLTAGE;
 	    break;
 	case 'U':
-	    if (data == "Unspecified failure")
+	    if (!strcmp(data, "Unspecified failure"))
 		return Battery::FAILURE;
 	    break;
 	}
@@ -247,35 +218,158 @@ static Battery::BatteryHealth getHealthValue(const QString& path)
     return Battery::HEALTH_UNKNOWN;
 }
 
+/*
+  The attributes that must not wait out a debounce window.  These are
+  a few short preads; the full update is left to update().
+ */
+
+bool Battery::criticalChanged()
+{
+    return (mACOnlineAttr.readBool() != mACOnline ||
+	    mUSBOnlineAttr.readBool() != mUSBOnline ||
+	    mPresentAttr.readBool() != mPresent ||
+	    getHealthValue(mHealthAttr) != mHealth);
+}
 
 void Battery::update()
 {
-    BatteryStatus status      = getStatusValue(mPathBatteryStatus);
-    BatteryHealth health      = getHealthValue(mPathBatteryHealth);
-    bool          ac_online   = getBooleanValue(mPathACOnline);
-    bool          usb_online  = getBooleanValue(mPathUSBOnline);
-    bool          present     = getBooleanValue(mPathBatteryPresent);
-    int           capacity    = getIntegerValue(mPathBatteryCapacity);
-    int           voltage     = getIntegerValue(mPathBatteryVoltage) / mVoltageDivisor;
-    int           temperature = getIntegerValue(mPathBatteryTemperature);
-    QString       technology  = getByteArray(mPathBatteryTechnology);
-
-    bool changed = (status != mStatus || health != mHealth ||
-		    ac_online != mACOnline || usb_online != mUSBOnline ||
-		    present != mPresent || capacity != mCapacity ||
-		    voltage != mVoltage || temperature != mTemperature ||
-		    technology != mTechnology );
-
-    if (changed) {
-	mStatus      = status;
-	mHealth      = health;
-	mACOnline    = ac_online;
-	mUSBOnline   = usb_online;
-	mPresent     = present;
-	mCapacity    = capacity;
-	mVoltage     = voltage;
-	mTemperature = temperature;
-	mTechnology  = technology;
-	emit dataChanged();
+    QElapsedTimer timer;
+    timer.start();
+    mStats.updates++;
+
+    BatteryStatus status      = getStatusValue(mStatusAttr);
+    BatteryHealth health      = getHealthValue(mHealthAttr);
+    bool          ac_online   = mACOnlineAttr.readBool();
+    bool          usb_online  = mUSBOnlineAttr.readBool();
+    bool          present     = mPresentAttr.readBool();
+    int           capacity    = mCapacityAttr.readInt();
+    int           voltage     = mVoltageAttr.readInt() / mVoltageDivisor;
+    int           current     = mCurrentAttr.readInt() / 1000;
+    int           temperature = mTemperatureAttr.readInt();
+
+    char technology[SysfsAttribute::kMaxValue];
+    if (mTechnologyAttr.read(technology, sizeof(technology)) < 0)
+	technology[0] = 0;
+
+    // Store every field before emitting anything, so a handler for one
+    // signal sees a consistent object.
+    enum { STATUS = 0x001, HEALTH = 0x002, PRESENT = 0x004, AC_ONLINE = 0x008,
+	   USB_ONLINE = 0x010, CAPACITY = 0x020, VOLTAGE = 0x040,
+	   TEMPERATURE = 0x080, TECHNOLOGY = 0x100, CURRENT = 0x200 };
+    int changed = 0;
+
+#define UPDATE_FIELD(member, value, bit) \
+    if (member != value) { member = value; changed |= bit; }
+
+    UPDATE_FIELD(mStatus, status, STATUS);
+    UPDATE_FIELD(mHealth, health, HEALTH);
+    UPDATE_FIELD(mPresent, present, PRESENT);
+    UPDATE_FIELD(mACOnline, ac_online, AC_ONLINE);
+    UPDATE_FIELD(mUSBOnline, usb_online, USB_ONLINE);
+    UPDATE_FIELD(mCapacity, capacity, CAPACITY);
+    UPDATE_FIELD(mVoltage, voltage, VOLTAGE);
+    UPDATE_FIELD(mCurrent, current, CURRENT);
+    UPDATE_FIELD(mTemperature, temperature, TEMPERATURE);
+#undef UPDATE_FIELD
+
+    if (mTechnology != QLatin1String(technology)) {
+	mTechnology = QString::fromLatin1(technology);
+	changed |= TECHNOLOGY;
+    }
+
+    if (changed)
+	mStats.changes++;
+    qint64 elapsed = timer.nsecsElapsed();
+    mStats.totalNs += elapsed;
+    if (elapsed > mStats.maxNs)
+	mStats.maxNs = elapsed;
+
+    if (!changed)
+	return;
+
+    if (changed & STATUS)      emit statusChanged();
+    if (changed & HEALTH)      emit healthChanged();
+    if (changed & PRESENT)     emit presentChanged();
+    if (changed & AC_ONLINE)   emit acOnlineChanged();
+    if (changed & USB_ONLINE)  emit usbOnlineChanged();
+    if (changed & CAPACITY)    emit capacityChanged();
+    if (changed & VOLTAGE)     emit voltageChanged();
+    if (changed & CURRENT)     emit currentChanged();
+    if (changed & TEMPERATURE) emit temperatureChanged();
+    if (changed & TECHNOLOGY)  emit technologyChanged();
+    emit dataChanged();
+
+    if (changed & (STATUS | CAPACITY | VOLTAGE | CURRENT | TEMPERATURE))
+	recordSample(changed & (STATUS | CAPACITY));
+}
+
+/*
+  Voltage and current move on every uevent, so those alone are sampled
+  at most once per kMinSampleInterval.  Status and capacity changes are
+  always recorded; they are what the estimator fits.
+ */
+
+static const qint64 kMinSampleInterval = 60 * 1000;
+
+void Battery::recordSample(bool force)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (!force && now - mLastSample < kMinSampleInterval && now >= mLastSample)
+	return;
+    mLastSample = now;
+
+    BatteryHistory::Sample sample;
+    memset(&sample, 0, sizeof(sample));
+    sample.when        = now;
+    sample.voltage     = mVoltage;
+    sample.current     = mCurrent;
+    sample.capacity    = mCapacity;
+    sample.temperature = mTemperature;
+    sample.status      = mStatus;
+
+    int tte = mHistory.timeToEmpty();
+    int ttf = mHistory.timeToFull();
+    mHistory.add(sample);
+    if (tte != mHistory.timeToEmpty() || ttf != mHistory.timeToFull())
+	emit timeEstimateChanged();
+}
+
+/*
+  The update timings cover the sysfs reads and the diff, not the
+  signal handlers.
+ */
+
+QVariantMap Battery::updateStats() const
+{
+    QVariantMap result;
+    result.insert(QStringLiteral("uevents"), mStats.uevents);
+    result.insert(QStringLiteral("batches"), mStats.batches);
+    result.insert(QStringLiteral("updates"), mStats.updates);
+    result.insert(QStringLiteral("changes"), mStats.changes);
+    result.insert(QStringLiteral("meanUs"),
+		  mStats.updates ? mStats.totalNs / 1000.0 / mStats.updates : 0.0);
+    result.insert(QStringLiteral("maxUs"), mStats.maxNs / 1000.0);
+    return result;
+}
+
+void Battery::resetUpdateStats()
+{
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+QVariantList Battery::history() const
+{
+    QVariantList result;
+    for (int i = 0 ; i < mHistory.count() ; i++) {
+	const BatteryHistory::Sample& sample = mHistory.at(i);
+	QVariantMap map;
+	map.insert(QStringLiteral("time"), QDateTime::fromMSecsSinceEpoch(sample.when));
+	map.insert(QStringLiteral("capacity"), sample.capacity);
+	map.insert(QStringLiteral("voltage"), sample.voltage);
+	map.insert(QStringLiteral("current"), sample.current);
+	map.insert(QStringLiteral("temperature"), sample.temperature);
+	map.insert(QStringLiteral("status"), sample.status);
+	result << map;
     }
+    return result;
 }
@@ -7,37 +7,40 @@
 
 #include <QObject>
 #include <QString>
-#include <QThread>
+#include <QTimer>
+#include <QVariantList>
+#include <QVariantMap>
 
-class UEventWatcher : public QThread 
-{
-    Q_OBJECT
-public:
-    void run();
-signals:
-    void activity();
-};
+#include "batteryhistory.h"
+#include "sysfs.h"
+#include "uevent.h"
 
 class Battery : public QObject
 {
     Q_OBJECT
     Q_ENUMS(BatteryStatus)
     Q_ENUMS(BatteryHealth)
-    Q_PROPERTY(BatteryStatus status READ status NOTIFY dataChanged)
-    Q_PROPERTY(BatteryHealth health READ health NOTIFY dataChanged)
-    Q_PROPERTY(bool present READ present NOTIFY dataChanged)
-    Q_PROPERTY(bool ac_online READ ac_online NOTIFY dataChanged)
-    Q_PROPERTY(bool usb_online READ usb_online NOTIFY dataChanged)
-    Q_PROPERTY(int capacity READ capacity NOTIFY dataChanged)
-    Q_PROPERTY(int voltage READ voltage NOTIFY dataChanged)
-    Q_PROPERTY(int temperature READ temperature NOTIFY dataChanged)
-    Q_PROPERTY(QString technology READ technology NOTIFY dataChanged)
+    Q_PROPERTY(BatteryStatus status READ status NOTIFY statusChanged)
+    Q_PROPERTY(BatteryHealth health READ health NOTIFY healthChanged)
+    Q_PROPERTY(bool present READ present NOTIFY presentChanged)
+    Q_PROPERTY(bool ac_online READ ac_online NOTIFY acOnlineChanged)
+    Q_PROPERTY(bool usb_online READ usb_online NOTIFY usbOnlineChanged)
+    Q_PROPERTY(int capacity READ capacity NOTIFY capacityChanged)
+    Q_PROPERTY(int voltage READ voltage NOTIFY voltageChanged)
+    Q_PROPERTY(int current READ current NOTIFY currentChanged)
+    Q_PROPERTY(int temperature READ temperature NOTIFY temperatureChanged)
+    Q_PROPERTY(QString technology READ technology NOTIFY technologyChanged)
+    Q_PROPERTY(int timeToEmpty READ timeToEmpty NOTIFY timeEstimateChanged)
+    Q_PROPERTY(int timeToFull READ timeToFull NOTIFY timeEstimateChanged)
+    Q_PROPERTY(int debounceInterval READ debounceInterval WRITE setDebounceInterval NOTIFY debounceIntervalChanged)
 
 public:
     enum BatteryStatus { CHARGING, DISCHARGING, FULL, NOT_CHARGING, STATUS_UNKNOWN };
     enum BatteryHealth { COLD, DEAD, GOOD, OVERHEAT, OVERVOLTAGE, FAILURE, HEALTH_UNKNOWN };
 
     static Battery *instance();
+    static void   setHistoryFile(const QString& path);   // Call before instance()
+    static void   setSysfsRoot(const QString& path);     // Call before instance()
     ~Battery();
 
     BatteryStatus status() const { return mStatus; }
@@ -47,17 +50,46 @@ public:
     bool          usb_online() const { return mUSBOnline; }
     int           capacity() const { return mCapacity; }
     int           voltage() const { return mVoltage; }
+    int           current() const { return mCurrent; }
     int           temperature() const { return mTemperature; }
     QString       technology() const { return mTechnology; }
 
+    // Seconds, or -1 while there is no estimate
+    int           timeToEmpty() const { return mHistory.timeToEmpty(); }
+    int           timeToFull() const { return mHistory.timeToFull(); }
+    Q_INVOKABLE QVariantList history() const;
+
+    // Counts and timings of uevent deliveries and update() calls
+    Q_INVOKABLE QVariantMap  updateStats() const;
+    Q_INVOKABLE void         resetUpdateStats();
+
+    int           debounceInterval() const { return mDebounceInterval; }
+    void          setDebounceInterval(int);
+
 signals:
-    void dataChanged();
+    void statusChanged();
+    void healthChanged();
+    void presentChanged();
+    void acOnlineChanged();
+    void usbOnlineChanged();
+    void capacityChanged();
+    void voltageChanged();
+    void currentChanged();
+    void temperatureChanged();
+    void technologyChanged();
+    void dataChanged();     // Any of the above
+    void timeEstimateChanged();
+    void debounceIntervalChanged();
 
 private slots:
     void update();
+    void ueventsReceived(const UEventBatch&);
+    void debounceExpired();
 
 private:
     Battery();
+    bool criticalChanged();
+    void recordSample(bool force);
     
     BatteryStatus mStatus;
     BatteryHealth mHealth;
@@ -66,12 +98,27 @@ private:
     bool          mUSBOnline;
     int           mCapacity;
     int           mVoltage;
+    int           mCurrent;
     int           mTemperature;
     QString       mTechnology;
 
-    QString       mPathACOnline, mPathUSBOnline, mPathBatteryStatus, mPathBatteryHealth, mPathBatteryPresent;
-    QString       mPathBatteryCapacity, mPathBatteryVoltage, mPathBatteryTemperature, mPathBatteryTechnology;
+    SysfsAttribute mACOnlineAttr, mUSBOnlineAttr, mStatusAttr, mHealthAttr, mPresentAttr;
+    SysfsAttribute mCapacityAttr, mVoltageAttr, mCurrentAttr, mTemperatureAttr, mTechnologyAttr;
     int           mVoltageDivisor;
+
+    static QString sHistoryFile;
+    static QString sSysfsRoot;
+    BatteryHistory mHistory;
+    qint64        mLastSample;   // ms since the epoch
+
+    struct UpdateStats {
+	int    uevents, batches, updates, changes;
+	qint64 totalNs, maxNs;
+    } mStats;
+
+    QTimer        mDebounceTimer;
+    int           mDebounceInterval;
+    bool          mTrailingUpdate;
 };
 
 #endif  // _BATTERY_H
@@ -0,0 +1,204 @@
+/*
+  Battery history and charge rate estimation
+ */
+
+#include "batteryhistory.h"
+#include "battery.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <QDebug>
+
+// Weight halves roughly every 20 minutes
+static const double kRateTau = 30 * 60;
+
+// A gap this long (device off, or the clock moved) restarts the fit
+static const double kMaxGap = 4 * kRateTau;
+
+// Require a weighted spread of at least this many seconds before
+// trusting the slope
+static const double kMinSpread = 5 * 60;
+
+// --------------------------------------------------------------------------------
+
+RateEstimator::RateEstimator(double tau)
+    : mTau(tau)
+{
+    reset();
+}
+
+void RateEstimator::reset()
+{
+    mS0 = mSt = mSv = mStt = mStv = 0;
+    mLast = 0;
+    mCount = 0;
+}
+
+void RateEstimator::add(qint64 when, double value)
+{
+    if (mCount) {
+	double dt = (when - mLast) / 1000.0;
+	if (dt < 0 || dt > kMaxGap)
+	    reset();
+	else if (dt > 0) {
+	    // Move the origin to the new sample (t' = t - dt), then decay
+	    mStt += dt * (dt * mS0 - 2 * mSt);
+	    mStv -= dt * mSv;
+	    mSt  -= dt * mS0;
+
+	    double decay = exp(-dt / mTau);
+	    mS0 *= decay;
+	    mSt *= decay;
+	    mSv *= decay;
+	    mStt *= decay;
+	    mStv *= decay;
+	}
+    }
+
+    // The new sample sits at t = 0, so only S0 and Sv change
+    mS0 += 1;
+    mSv += value;
+    mLast = when;
+    mCount++;
+}
+
+bool RateEstimator::slope(double *perSecond) const
+{
+    if (mCount < 3)
+	return false;
+    double denom = mS0 * mStt - mSt * mSt;   // S0^2 times the weighted variance of t
+    if (denom < kMinSpread * kMinSpread * mS0 * mS0)
+	return false;
+    *perSecond = (mS0 * mStv - mSt * mSv) / denom;
+    return true;
+}
+
+// --------------------------------------------------------------------------------
+
+/*
+  File layout: a Header followed by kSize Sample records.  Fields are
+  in host byte order; the file never leaves the device.
+ */
+
+struct Header {
+    quint32 magic;
+    quint16 version;
+    quint16 size;
+    quint32 head;
+    quint32 count;
+};
+
+static const quint32 kMagic = 0x4842424b;   // "KBBH"
+static const quint16 kVersion = 1;
+
+BatteryHistory::BatteryHistory()
+    : mHead(0)
+    , mCount(0)
+    , mCharging(false)
+    , mCapacity(0)
+    , mEstimator(kRateTau)
+{
+    memset(mRing, 0, sizeof(mRing));
+}
+
+bool BatteryHistory::setFile(const QString& path)
+{
+    mFile.close();
+    mFile.setFileName(path);
+    if (!mFile.open(QIODevice::ReadWrite)) {
+	qWarning() << "Unable to open battery history" << path;
+	return false;
+    }
+
+    Header header;
+    bool valid = (mFile.size() == qint64(sizeof(header) + sizeof(mRing)) &&
+		  mFile.read((char *) &header, sizeof(header)) == sizeof(header) &&
+		  header.magic == kMagic && header.version == kVersion &&
+		  header.size == kSize && header.head < kSize && header.count <= kSize &&
+		  mFile.read((char *) mRing, sizeof(mRing)) == sizeof(mRing));
+
+    if (valid) {
+	mHead = header.head;
+	mCount = header.count;
+	mEstimator.reset();
+	for (int i = 0 ; i < mCount ; i++)
+	    feed(at(i));
+    }
+    else {
+	// Unknown or damaged: start again at the full size
+	memset(mRing, 0, sizeof(mRing));
+	mHead = mCount = 0;
+	mFile.resize(0);
+	writeHeader();
+	mFile.write((const char *) mRing, sizeof(mRing));
+    }
+    mFile.flush();
+    return true;
+}
+
+const BatteryHistory::Sample& BatteryHistory::at(int i) const
+{
+    return mRing[(mHead - mCount + i + kSize) % kSize];
+}
+
+void BatteryHistory::add(const Sample& sample)
+{
+    int slot = mHead;
+    mRing[slot] = sample;
+    mHead = (mHead + 1) % kSize;
+    if (mCount < kSize)
+	mCount++;
+    feed(sample);
+
+    if (mFile.isOpen()) {
+	mFile.seek(sizeof(Header) + slot * sizeof(Sample));
+	mFile.write((const char *) &sample, sizeof(sample));
+	writeHeader();
+	mFile.flush();
+    }
+}
+
+void BatteryHistory::writeHeader()
+{
+    Header header;
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.size = kSize;
+    header.head = mHead;
+    header.count = mCount;
+    mFile.seek(0);
+    mFile.write((const char *) &header, sizeof(header));
+}
+
+/*
+  Charging and discharging are fitted separately: the fit restarts
+  whenever the direction changes.
+ */
+
+void BatteryHistory::feed(const Sample& sample)
+{
+    bool charging = (sample.status == Battery::CHARGING);
+    if (charging != mCharging) {
+	mCharging = charging;
+	mEstimator.reset();
+    }
+    mCapacity = sample.capacity;
+    mEstimator.add(sample.when, sample.capacity);
+}
+
+int BatteryHistory::timeToEmpty() const
+{
+    double rate;
+    if (mCharging || !mEstimator.slope(&rate) || rate >= 0)
+	return -1;
+    return int(mCapacity / -rate);
+}
+
+int BatteryHistory::timeToFull() const
+{
+    double rate;
+    if (!mCharging || !mEstimator.slope(&rate) || rate <= 0)
+	return -1;
+    return int((100 - mCapacity) / rate);
+}
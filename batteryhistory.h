@@ -0,0 +1,82 @@
+/*
+  Battery history and charge rate estimation
+ */
+
+#ifndef _BATTERY_HISTORY_H
+#define _BATTERY_HISTORY_H
+
+#include <QFile>
+#include <QtGlobal>
+
+/*
+  Exponentially weighted least-squares fit of value against time.
+  Older samples decay with time constant 'tau' seconds.  The weighted
+  sums are kept relative to the newest sample so they stay small, and
+  each add() is a constant amount of arithmetic.
+ */
+
+class RateEstimator
+{
+public:
+    RateEstimator(double tau);
+
+    void         reset();
+    void         add(qint64 when, double value);   // 'when' in ms
+
+    // Slope in units per second; false until there is enough history
+    bool         slope(double *perSecond) const;
+
+private:
+    double       mTau;
+    double       mS0, mSt, mSv, mStt, mStv;   // Weighted sums of 1, t, v, t*t, t*v
+    qint64       mLast;
+    int          mCount;
+};
+
+/*
+  A fixed-size ring of battery samples.  If a file is set the ring is
+  loaded from it and every new sample is written through to its slot,
+  so the file never grows and a write is a single record.
+ */
+
+class BatteryHistory
+{
+public:
+    struct Sample {
+	qint64 when;          // ms since the epoch
+	qint32 voltage;       // mV
+	qint32 current;       // mA as reported by the driver
+	qint16 capacity;      // Percent
+	qint16 temperature;   // Tenths of a degree C
+	quint8 status;        // Battery::BatteryStatus
+	quint8 reserved[11];
+    };
+
+    enum { kSize = 512 };
+
+    BatteryHistory();
+
+    bool         setFile(const QString& path);
+
+    void         add(const Sample& sample);
+    int          count() const { return mCount; }
+    const Sample& at(int i) const;   // 0 is the oldest
+
+    // Seconds, or -1 when there is no estimate
+    int          timeToEmpty() const;
+    int          timeToFull() const;
+
+private:
+    void         feed(const Sample& sample);
+    void         writeHeader();
+
+    Sample       mRing[kSize];
+    int          mHead;          // Next slot to write
+    int          mCount;
+    bool         mCharging;
+    int          mCapacity;      // Of the newest sample
+    RateEstimator mEstimator;    // Capacity percent against time
+    QFile        mFile;
+};
+
+#endif // _BATTERY_HISTORY_H
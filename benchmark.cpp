@@ -0,0 +1,131 @@
+/*
+  Built-in benchmark drivers
+ */
+
+#include "benchmark.h"
+#include "allocstats.h"
+#include "battery.h"
+#include "fakepowersupply.h"
+#include "soundmixer.h"
+#include "uevent.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QTimer>
+
+/*
+  The dispatcher thread ends when the fake runs out of events.  Battery
+  may still hold a trailing update for one debounce window after that,
+  so the stats are read once the window has had time to close.
+ */
+
+int Benchmark::power(int count)
+{
+    if (count <= 0)
+	count = 1000;
+    FakePowerSupply *fake = new FakePowerSupply(0, count);
+    if (!fake->open()) {
+	delete fake;
+	return 1;
+    }
+    Battery::setSysfsRoot(fake->root());
+    UEventDispatcher::setSource(fake);
+
+    QElapsedTimer timer;
+    timer.start();
+    int allocations = AllocStats::count();
+
+    Battery *battery = Battery::instance();
+    UEventDispatcher *dispatcher = UEventDispatcher::instance();
+
+    QEventLoop loop;
+    QObject::connect(dispatcher, SIGNAL(finished()), &loop, SLOT(quit()));
+    if (!dispatcher->isFinished())
+	loop.exec();
+    QTimer::singleShot(battery->debounceInterval() + 100, &loop, SLOT(quit()));
+    loop.exec();
+
+    allocations = AllocStats::count() - allocations;
+    QVariantMap stats = battery->updateStats();
+    int uevents = stats.value(QStringLiteral("uevents")).toInt();
+
+    qDebug("Power benchmark: %d uevents in %d batches, %d updates (%d changed), %lld ms",
+	   uevents, stats.value(QStringLiteral("batches")).toInt(),
+	   stats.value(QStringLiteral("updates")).toInt(),
+	   stats.value(QStringLiteral("changes")).toInt(), timer.elapsed());
+    qDebug("  update() mean %.1f us, max %.1f us",
+	   stats.value(QStringLiteral("meanUs")).toDouble(),
+	   stats.value(QStringLiteral("maxUs")).toDouble());
+    if (AllocStats::isEnabled())
+	qDebug("  %d allocations, %.1f per uevent", allocations,
+	       uevents ? double(allocations) / uevents : 0.0);
+    else
+	qDebug("  Allocations not counted; build with CONFIG+=KLAATU_ALLOC_STATS");
+    return 0;
+}
+
+/*
+  The click is a 10 ms decaying tone written through a WavFileSoundSink,
+  so it loads the way a real UI sound does.  Plays are spaced a little
+  over one mixer block apart, with every tenth one in a burst of four,
+  so both an idle and a busy mixer are measured.
+ */
+
+int Benchmark::sound(int count)
+{
+    if (count <= 0)
+	count = 200;
+
+    QTemporaryDir dir;
+    if (!dir.isValid())
+	return 1;
+    QString path = dir.path() + QStringLiteral("/click.wav");
+    {
+	enum { kClickFrames = SoundMixer::kRate / 100 };
+	QVector<qint16> click(kClickFrames * 2);
+	for (int i = 0 ; i < kClickFrames ; i++) {
+	    int sample = ((i / 20) & 1 ? 12000 : -12000) * (kClickFrames - i) / kClickFrames;
+	    click[i * 2] = click[i * 2 + 1] = sample;
+	}
+	WavFileSoundSink writer(path);
+	if (!writer.open(SoundMixer::kRate, kClickFrames) ||
+	    !writer.write(click.constData(), kClickFrames))
+	    return 1;
+    }
+
+    SoundMixer::setSink(new NullSoundSink);
+    SoundMixer *mixer = SoundMixer::instance();
+    QSharedPointer<SoundClip> clip = mixer->clip(path);
+    if (!clip)
+	return 1;
+
+    const int blockUs = SoundMixer::kBlockFrames * 1000000 / SoundMixer::kRate;
+    int allocations = AllocStats::count();
+    for (int i = 0 ; i < count ; i++) {
+	mixer->play(clip, 1.0);
+	if (i % 10 >= 4 || i % 10 == 0)
+	    QThread::usleep(blockUs + blockUs / 4);
+    }
+
+    // Every voice is measured within a block or two of its play()
+    for (int wait = 0 ; wait < 100 ; wait++) {
+	if (mixer->latencyStats().value(QStringLiteral("count")).toInt() >= count)
+	    break;
+	QThread::msleep(10);
+    }
+    allocations = AllocStats::count() - allocations;
+
+    QVariantMap stats = mixer->latencyStats();
+    qDebug("Sound benchmark: %d of %d plays measured",
+	   stats.value(QStringLiteral("count")).toInt(), count);
+    qDebug("  play() to write() mean %.1f us, min %.1f us, max %.1f us (block %d us)",
+	   stats.value(QStringLiteral("meanUs")).toDouble(),
+	   stats.value(QStringLiteral("minUs")).toDouble(),
+	   stats.value(QStringLiteral("maxUs")).toDouble(), blockUs);
+    if (AllocStats::isEnabled())
+	qDebug("  %d allocations, %.1f per play", allocations, double(allocations) / count);
+    return 0;
+}
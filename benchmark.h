@@ -0,0 +1,35 @@
+/*
+  Built-in benchmark drivers
+ */
+
+#ifndef _BENCHMARK_H
+#define _BENCHMARK_H
+
+#include <QString>
+
+/*
+  Each driver sets up its fake backend, runs the event loop until the
+  run is over, prints a summary with qDebug() and returns an exit code
+  for main().  Call them instead of loading a QML scene.
+ */
+
+class Benchmark
+{
+public:
+    // A back-to-back storm of 'count' power_supply uevents into Battery
+    static int power(int count);
+
+    // 'count' plays of a short click through the SoundMixer into a
+    // NullSoundSink, with the play() to write() latency
+    static int sound(int count);
+
+    // Rounds of synthetic scans through CombinedModel at 10, 100 and
+    // 1000 stations
+    static int wifiModel(int rounds);
+
+    // Plays a FakeWifiBackend script into Wifi for 'seconds' with the
+    // QML file on screen; the file sees Wifi as 'wifi'
+    static int wifiView(const QString& script, const QString& qml, int seconds);
+};
+
+#endif // _BENCHMARK_H
@@ -1026,7 +1026,9 @@ public:
 
 	switch(args->keyCode) {
 	case AKEYCODE_POWER:
-            screen->powerKey(!args->action);
+            if (args->action == AKEY_EVENT_ACTION_DOWN)
+                screen->wakeFastPath(args->eventTime);
+            screen->powerKey(!args->action, args->eventTime);
 	    keycode = Qt::Key_PowerOff;
 	    break;
         case AKEYCODE_SHIFT_LEFT:
@@ -0,0 +1,160 @@
+/*
+  Fake power_supply sysfs tree and uevent source
+ */
+
+#include "fakepowersupply.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+
+// The AC charger is plugged in or pulled this often
+static const int kPlugPeriod = 50;
+
+// Every attribute file holds exactly this many bytes
+static const int kRecordSize = 32;
+
+// --------------------------------------------------------------------------------
+
+FakePowerSupply::FakePowerSupply(int interval, int count)
+    : mInterval(interval)
+    , mCount(count)
+    , mSent(0)
+    , mACOnline(false)
+    , mCapacity(8000)
+    , mVoltage(3900000)
+    , mTemperature(250)
+{
+    if (!mDir.isValid()) {
+	qWarning("Unable to create fake power_supply directory");
+	return;
+    }
+
+    createNode("ac", "Mains");
+    createNode("usb", "USB");
+    createNode("battery", "Battery");
+
+    write("ac", "online", 0);
+    write("usb", "online", 0);
+    write("battery", "status", "Discharging");
+    write("battery", "health", "Good");
+    write("battery", "present", 1);
+    write("battery", "technology", "Li-ion");
+    step();
+}
+
+FakePowerSupply::~FakePowerSupply()
+{
+    foreach (int fd, mFds)
+	::close(fd);
+}
+
+bool FakePowerSupply::open()
+{
+    return mDir.isValid();
+}
+
+void FakePowerSupply::createNode(const char *name, const char *type)
+{
+    QDir(mDir.path()).mkdir(QString::fromLatin1(name));
+    write(name, "type", type);
+}
+
+/*
+  Battery keeps its attribute files open and reads them with pread(),
+  so a value is replaced in place: one pwrite() of a fixed-width record
+  padded with spaces, which the reader strips.  Truncating first would
+  let a read land on an empty file, and a rename would leave the reader
+  on the old inode.
+ */
+
+void FakePowerSupply::write(const char *node, const char *attribute, const char *value)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%s/%s", node, attribute);
+
+    int fd = mFds.value(QByteArray::fromRawData(name, strlen(name)), -1);
+    if (fd < 0) {
+	QByteArray path = QFile::encodeName(mDir.path()) + '/' + name;
+	fd = ::open(path.constData(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+	    qWarning("Unable to create %s", path.constData());
+	    return;
+	}
+	mFds.insert(QByteArray(name), fd);
+    }
+
+    char record[kRecordSize];
+    int len = qMin<int>(strlen(value), kRecordSize - 1);
+    memcpy(record, value, len);
+    memset(record + len, ' ', kRecordSize - 1 - len);
+    record[kRecordSize - 1] = '\n';
+    if (::pwrite(fd, record, kRecordSize, 0) != kRecordSize)
+	qWarning("Short write to fake %s", name);
+}
+
+void FakePowerSupply::write(const char *node, const char *attribute, int value)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", value);
+    write(node, attribute, buf);
+}
+
+/*
+  Discharge or charge by a small amount, with a little voltage and
+  temperature noise so every event changes something.
+ */
+
+void FakePowerSupply::step()
+{
+    if (mSent && mSent % kPlugPeriod == 0) {
+	mACOnline = !mACOnline;
+	write("ac", "online", mACOnline);
+	write("battery", "status", mACOnline ? "Charging" : "Discharging");
+    }
+
+    mCapacity = qBound(0, mCapacity + (mACOnline ? 7 : -3), 10000);
+    mVoltage = 3400000 + mCapacity * 80 + (mSent % 7) * 1000;
+    mTemperature = 250 + (mSent % 11);
+
+    write("battery", "capacity", mCapacity / 100);
+    write("battery", "voltage_now", mVoltage);
+    write("battery", "current_now", mACOnline ? 500000 : -300000);
+    write("battery", "temp", mTemperature);
+}
+
+int FakePowerSupply::receive(char *buf, int size, bool *truncated)
+{
+    *truncated = false;
+    if (mCount && mSent >= mCount)
+	return -1;
+    if (mInterval > 0)
+	usleep(mInterval * 1000);
+
+    mSent++;
+    step();
+
+    // Built on the stack so the fake adds no allocations of its own
+    // to what a storm costs the reader.
+    char msg[512];
+    int len = 0;
+    len += snprintf(msg + len, sizeof(msg) - len, "change@/devices/fake/power_supply/battery") + 1;
+    len += snprintf(msg + len, sizeof(msg) - len, "ACTION=change") + 1;
+    len += snprintf(msg + len, sizeof(msg) - len, "DEVPATH=/devices/fake/power_supply/battery") + 1;
+    len += snprintf(msg + len, sizeof(msg) - len, "SUBSYSTEM=power_supply") + 1;
+    len += snprintf(msg + len, sizeof(msg) - len, "POWER_SUPPLY_NAME=battery") + 1;
+    len += snprintf(msg + len, sizeof(msg) - len, "POWER_SUPPLY_CAPACITY=%d", mCapacity / 100) + 1;
+    len += snprintf(msg + len, sizeof(msg) - len, "SEQNUM=%d", mSent) + 1;
+
+    if (len > size) {
+	len = size;
+	*truncated = true;
+    }
+    memcpy(buf, msg, len);
+    return len;
+}
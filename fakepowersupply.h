@@ -0,0 +1,56 @@
+/*
+  Fake power_supply sysfs tree and uevent source
+ */
+
+#ifndef _FAKE_POWER_SUPPLY_H
+#define _FAKE_POWER_SUPPLY_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QTemporaryDir>
+
+#include "uevent.h"
+
+/*
+  Builds a power_supply class directory with Mains, USB and Battery
+  nodes under a temporary directory and sends a synthetic "change"
+  uevent every 'interval' ms after moving the values along.  Point
+  Battery at root() and install this as the UEventDispatcher source to
+  exercise the battery code without hardware.
+
+  'count' events are sent (0 for no limit); an interval of 0 sends
+  them back to back to simulate a uevent storm.
+ */
+
+class FakePowerSupply : public UEventSource
+{
+public:
+    FakePowerSupply(int interval = 1000, int count = 0);
+    ~FakePowerSupply();
+
+    QString      root() const { return mDir.path(); }
+
+    bool         open();
+    int          receive(char *buf, int size, bool *truncated);
+
+private:
+    void         createNode(const char *name, const char *type);
+    void         write(const char *node, const char *attribute, const char *value);
+    void         write(const char *node, const char *attribute, int value);
+    void         step();
+
+    QTemporaryDir mDir;
+    QHash<QByteArray, int> mFds;   // "node/attribute" -> write descriptor
+    int          mInterval;
+    int          mCount;
+    int          mSent;
+
+    // Simulated state
+    bool         mACOnline;
+    int          mCapacity;     // Percent times 100
+    int          mVoltage;      // uV
+    int          mTemperature;  // Tenths of a degree C
+};
+
+#endif // _FAKE_POWER_SUPPLY_H
@@ -0,0 +1,215 @@
+/*
+  Scripted stand-in for the wifi service
+ */
+
+#include "fakewifi.h"
+
+#include <stdlib.h>
+
+#include <QDebug>
+
+// ------------------------------------------------------------
+
+static const char *kStateNames[] = { "DISABLED", "DISABLING", "ENABLED", "ENABLING", "UNKNOWN" };
+static const char *kFlags[] = { "[WPA2-PSK-CCMP][ESS]", "[WPA-PSK-TKIP][ESS]", "[WEP][ESS]", "[ESS]" };
+
+static int stateFromName(const QByteArray& name)
+{
+    for (int i = 0 ; i < (int) (sizeof(kStateNames) / sizeof(kStateNames[0])) ; i++)
+	if (name == kStateNames[i])
+	    return i;
+    return Wifi::UNKNOWN;
+}
+
+// Everything after the first 'skip' arguments, for names with spaces
+static QByteArray rest(const QList<QByteArray>& args, int skip)
+{
+    QByteArray result;
+    for (int i = skip ; i < args.size() ; i++) {
+	if (i > skip)
+	    result += ' ';
+	result += args.at(i);
+    }
+    return result;
+}
+
+FakeWifiBackend::FakeWifiBackend(const QString& filename)
+    : mFile(filename)
+    , mRate(100)
+{
+}
+
+void FakeWifiBackend::registerClient()
+{
+    if (!mFile.open(QIODevice::ReadOnly | QIODevice::Text)) {
+	qWarning() << "Unable to open wifi script" << mFile.fileName();
+	return;
+    }
+    start();
+}
+
+void FakeWifiBackend::run()
+{
+    int lineno = 0;
+    while (true) {
+	if (mFile.atEnd())
+	    break;
+	QByteArray line = mFile.readLine().trimmed();
+	lineno++;
+	if (line.isEmpty() || line.startsWith('#'))
+	    continue;
+	QList<QByteArray> args = line.simplified().split(' ');
+	if (args.at(0) == "loop") {
+	    mFile.seek(0);
+	    lineno = 0;
+	    continue;
+	}
+	if (!execute(args)) {
+	    qWarning("%s:%d: bad wifi script command '%s'", qPrintable(mFile.fileName()),
+		     lineno, line.constData());
+	    continue;
+	}
+	if (mRate > 0)
+	    msleep(mRate);
+    }
+}
+
+bool FakeWifiBackend::execute(const QList<QByteArray>& args)
+{
+    const QByteArray& cmd = args.at(0);
+
+    if (cmd == "rate" && args.size() == 2)
+	mRate = args.at(1).toInt();
+    else if (cmd == "sleep" && args.size() == 2)
+	msleep(args.at(1).toInt());
+    else if (cmd == "state" && args.size() == 2)
+	Wifi::instance()->setState(static_cast<Wifi::DriverState>(stateFromName(args.at(1))));
+    else if (cmd == "stations" && args.size() == 2) {
+	QMutexLocker locker(&mLock);
+	int count = args.at(1).toInt();
+	mStations.clear();
+	mSynthetic.clear();
+	for (int i = 0 ; i < count ; i++) {
+	    WifiScanRecord station;
+	    station.bssid = QString().sprintf("02:00:%02x:%02x:%02x:%02x", (i >> 24) & 0xff,
+					      (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+	    station.ssid = QStringLiteral("fake-%1").arg(i / 2);
+	    station.flags = QLatin1String(kFlags[i % 4]);
+	    station.key_mgmt = Wifi::keyMgmtFromFlags(kFlags[i % 4]);
+	    station.frequency = (i % 3) ? 2412 + 5 * (i % 11) : 5180 + 20 * (i % 8);
+	    station.rssi = -40 - (rand() % 50);
+	    mStations.append(station);
+	    mSynthetic.append(true);
+	}
+    }
+    else if (cmd == "station" && args.size() >= 6) {
+	QMutexLocker locker(&mLock);
+	WifiScanRecord station;
+	station.bssid = QString::fromLocal8Bit(args.at(1));
+	station.frequency = args.at(2).toInt();
+	station.rssi = args.at(3).toInt();
+	station.flags = QString::fromLocal8Bit(args.at(4));
+	station.key_mgmt = Wifi::keyMgmtFromFlags(args.at(4).constData());
+	station.ssid = QString::fromLocal8Bit(rest(args, 5));
+	mStations.append(station);
+	mSynthetic.append(false);
+    }
+    else if (cmd == "scan" && args.size() == 1)
+	sendScan();
+    else if (cmd == "network" && args.size() >= 5) {
+	QMutexLocker locker(&mLock);
+	WifiConfigRecord config;
+	config.network_id = args.at(1).toInt();
+	config.status = args.at(2).toInt();
+	config.key_mgmt = Wifi::keyMgmtFromFlags(args.at(3).constData());
+	config.ssid = QString::fromLocal8Bit(rest(args, 4));
+	mNetworks.append(config);
+    }
+    else if (cmd == "networks" && args.size() == 1)
+	sendNetworks();
+    else if (cmd == "info" && args.size() >= 7) {
+	WifiInfoRecord info;
+	info.supplicant_state = args.at(1).toInt();
+	info.network_id = args.at(2).toInt();
+	info.rssi = args.at(3).toInt();
+	info.link_speed = args.at(4).toInt();
+	if (args.at(5) != "-")
+	    info.ipaddr = QString::fromLocal8Bit(args.at(5));
+	info.macaddr = QStringLiteral("02:00:00:00:00:01");
+	info.ssid = QString::fromLocal8Bit(rest(args, 6));
+	info.bssid = QStringLiteral("02:00:00:00:00:00");
+	Wifi::instance()->setInformation(info);
+    }
+    else
+	return false;
+    return true;
+}
+
+void FakeWifiBackend::sendScan()
+{
+    WifiScanList stations;
+    {
+	QMutexLocker locker(&mLock);
+	for (int i = 0 ; i < mStations.size() ; i++) {
+	    if (mSynthetic.at(i)) {
+		WifiScanRecord& station(mStations[i]);
+		station.rssi = qBound(-95, station.rssi + (rand() % 7) - 3, -30);
+	    }
+	}
+	stations = mStations;
+    }
+    Wifi::instance()->setScanResults(stations);
+}
+
+void FakeWifiBackend::sendNetworks()
+{
+    WifiConfigList networks;
+    {
+	QMutexLocker locker(&mLock);
+	networks = mNetworks;
+    }
+    Wifi::instance()->setConfiguredStations(networks);
+}
+
+void FakeWifiBackend::setEnabled(bool enabled)
+{
+    Wifi::instance()->setState(enabled ? Wifi::ENABLED : Wifi::DISABLED);
+}
+
+void FakeWifiBackend::startScan(bool)
+{
+    sendScan();
+}
+
+void FakeWifiBackend::addOrUpdateNetwork(const WifiConfigRecord& config)
+{
+    {
+	QMutexLocker locker(&mLock);
+	WifiConfigRecord added(config);
+	added.network_id = 0;
+	for (int i = 0 ; i < mNetworks.size() ; i++) {
+	    if (mNetworks[i].ssid == config.ssid) {
+		added.network_id = mNetworks[i].network_id;
+		mNetworks.remove(i);
+		break;
+	    }
+	    added.network_id = qMax(added.network_id, mNetworks[i].network_id + 1);
+	}
+	mNetworks.append(added);
+    }
+    sendNetworks();
+}
+
+void FakeWifiBackend::removeNetwork(int network_id)
+{
+    {
+	QMutexLocker locker(&mLock);
+	for (int i = 0 ; i < mNetworks.size() ; i++) {
+	    if (mNetworks[i].network_id == network_id) {
+		mNetworks.remove(i);
+		break;
+	    }
+	}
+    }
+    sendNetworks();
+}
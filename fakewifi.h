@@ -0,0 +1,73 @@
+/*
+  Scripted stand-in for the wifi service
+ */
+
+#ifndef _FAKE_WIFI_H
+#define _FAKE_WIFI_H
+
+#include <QFile>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+
+#include "wifi.h"
+
+/*
+  Plays a script of wifi events into Wifi from its own thread, the way
+  the binder client would.  One command per line; blank lines and
+  lines starting with '#' are ignored.
+
+    rate MS              Pause MS ms after each following command (default 100)
+    sleep MS             Pause once
+    state NAME           DISABLED, DISABLING, ENABLED, ENABLING or UNKNOWN
+    stations N           Replace the station list with N synthetic stations
+    station BSSID FREQ RSSI FLAGS SSID
+			 Add one station
+    scan                 Send the station list as scan results; synthetic
+			 stations drift a few dB between scans
+    network ID STATUS KEYMGMT SSID
+			 Add a configured network (STATUS as ConfiguredStation,
+			 KEYMGMT as the supplicant's key_mgmt string)
+    networks             Send the configured networks
+    info STATE ID RSSI LINKSPEED IPADDR SSID
+			 Send connection information (IPADDR '-' for none)
+    loop                 Start again from the top
+
+  Requests from Wifi are answered directly: setEnabled() sends a state
+  change and startScan() sends the current station list.
+ */
+
+class FakeWifiBackend : public QThread, public WifiBackend
+{
+    Q_OBJECT
+public:
+    FakeWifiBackend(const QString& filename);
+
+    void registerClient();
+    void setEnabled(bool enabled);
+    void enableRssiPolling(bool) {}
+    void startScan(bool active);
+    void addOrUpdateNetwork(const WifiConfigRecord& config);
+    void removeNetwork(int network_id);
+    void selectNetwork(int) {}
+    void reconnect() {}
+    void disconnect() {}
+    void reassociate() {}
+
+protected:
+    void run();
+
+private:
+    bool execute(const QList<QByteArray>& args);
+    void sendScan();
+    void sendNetworks();
+
+    QFile   mFile;
+    int     mRate;          // ms
+    QMutex  mLock;          // Guards the lists; requests come from the GUI thread
+    WifiScanList   mStations;
+    QVector<bool>  mSynthetic;
+    WifiConfigList mNetworks;
+};
+
+#endif // _FAKE_WIFI_H
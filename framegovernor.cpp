@@ -0,0 +1,216 @@
+/*
+  Adaptive frame rate governor.
+
+  Qt Quick renders at the full vsync rate as long as anything asks
+  for a frame, even when the frame is identical to the last one (for
+  example, an animation running on a property that nothing displays).
+  Before each synchronization we look at the window's dirty item list;
+  if nothing is dirty the frame carries no damage.  After a run of
+  undamaged frames we step down 60 -> 30 -> 15 by holding the render
+  thread after each swap.  Sustained damage or any input event puts
+  us back at the full rate, or at maxFrameRate if that is lower.
+ */
+
+#include "framegovernor.h"
+
+#include <QDebug>
+#include <QEvent>
+#include <QQuickWindow>
+#include <QtQuick/private/qquickwindow_p.h>
+
+// --------------------------------------------------------------------------------
+
+static const int kFrameRates[] = { 60, 30, 15 };
+static const int kLevelCount   = sizeof(kFrameRates) / sizeof(kFrameRates[0]);
+static const int kVsyncRate    = 60;
+
+const int kDefaultIdleFrames = 30;  // Undamaged frames before stepping down one level
+const int kDamageRunToWake   = 2;   // Consecutive damaged frames that restore full rate
+
+FrameGovernor *FrameGovernor::instance()
+{
+    static FrameGovernor *_s_frame_governor = 0;
+    if (!_s_frame_governor)
+	_s_frame_governor = new FrameGovernor;
+    return _s_frame_governor;
+}
+
+FrameGovernor::FrameGovernor()
+    : mWindow(0)
+    , mEnabled(1)
+    , mLevel(0)
+    , mMinLevel(0)
+    , mIdleFrames(kDefaultIdleFrames)
+    , mIdleCount(0)
+    , mFramesRendered(0)
+    , mFramesDamaged(0)
+    , mFramesThrottled(0)
+    , mDamageRun(0)
+{
+}
+
+FrameGovernor::~FrameGovernor()
+{
+}
+
+void FrameGovernor::setWindow(QQuickWindow *window)
+{
+    if (mWindow) {
+	mWindow->removeEventFilter(this);
+	disconnect(mWindow, 0, this, 0);
+    }
+    mWindow = window;
+    if (mWindow) {
+	// The scene graph signals are emitted from the render thread
+	connect(mWindow, SIGNAL(beforeSynchronizing()), SLOT(synchronizing()), Qt::DirectConnection);
+	connect(mWindow, SIGNAL(frameSwapped()), SLOT(swapped()), Qt::DirectConnection);
+	mWindow->installEventFilter(this);
+    }
+}
+
+void FrameGovernor::setEnabled(bool enabled)
+{
+    if (enabled != this->enabled()) {
+	mEnabled.store(enabled ? 1 : 0);
+	if (!enabled)
+	    fullRate();
+	emit enabledChanged();
+    }
+}
+
+int FrameGovernor::frameRate() const
+{
+    return kFrameRates[mLevel.load()];
+}
+
+void FrameGovernor::setIdleFrames(int frames)
+{
+    if (frames < 1)
+	frames = 1;
+    if (frames != mIdleFrames.load()) {
+	mIdleFrames.store(frames);
+	emit idleFramesChanged();
+    }
+}
+
+int FrameGovernor::maxFrameRate() const
+{
+    return kFrameRates[mMinLevel.load()];
+}
+
+/*!
+  Limit the frame rate to the highest rate in the table that does not
+  exceed 'rate'.  The limit holds even when the governor is disabled.
+ */
+
+void FrameGovernor::setMaxFrameRate(int rate)
+{
+    int level = 0;
+    while (level < kLevelCount - 1 && kFrameRates[level] > rate)
+	level++;
+    if (mMinLevel.fetchAndStoreOrdered(level) != level) {
+	setLevel(mLevel.load());
+	emit maxFrameRateChanged();
+    }
+}
+
+/*!
+  Return to the full frame rate (or maxFrameRate) immediately.  Called
+  on every input event; may be called from QML before starting an
+  animation.
+ */
+
+void FrameGovernor::fullRate()
+{
+    mIdleCount.store(0);
+    setLevel(0);
+    QMutexLocker locker(&mSleepLock);
+    mSleepWait.wakeAll();
+}
+
+QVariantMap FrameGovernor::statistics() const
+{
+    QVariantMap map;
+    map.insert(QStringLiteral("frameRate"), frameRate());
+    map.insert(QStringLiteral("framesRendered"), mFramesRendered.load());
+    map.insert(QStringLiteral("framesDamaged"), mFramesDamaged.load());
+    map.insert(QStringLiteral("framesThrottled"), mFramesThrottled.load());
+    return map;
+}
+
+void FrameGovernor::setLevel(int level)
+{
+    if (level < mMinLevel.load())
+	level = mMinLevel.load();
+    if (level >= kLevelCount)
+	level = kLevelCount - 1;
+    if (mLevel.fetchAndStoreOrdered(level) != level)
+	emit frameRateChanged();  // Queued to the GUI thread when called from the renderer
+}
+
+bool FrameGovernor::eventFilter(QObject *object, QEvent *event)
+{
+    switch (event->type()) {
+    case QEvent::TouchBegin:
+    case QEvent::TouchUpdate:
+    case QEvent::MouseButtonPress:
+    case QEvent::MouseMove:
+    case QEvent::KeyPress:
+    case QEvent::Wheel:
+	if (mLevel.load() != mMinLevel.load() || mIdleCount.load() != 0)
+	    fullRate();
+	break;
+    default:
+	break;
+    }
+    return QObject::eventFilter(object, event);
+}
+
+/*
+  Called in the render thread while the GUI thread is blocked, so the
+  window's dirty item list is stable.
+ */
+
+void FrameGovernor::synchronizing()
+{
+    bool damaged = QQuickWindowPrivate::get(mWindow)->dirtyItemList != 0;
+
+    mFramesRendered.ref();
+    if (damaged)
+	mFramesDamaged.ref();
+
+    if (!mEnabled.load())
+	return;
+
+    if (damaged) {
+	mIdleCount.store(0);
+	if (++mDamageRun >= kDamageRunToWake)
+	    setLevel(0);
+	return;
+    }
+
+    mDamageRun = 0;
+    if (mIdleCount.fetchAndAddOrdered(1) + 1 >= mIdleFrames.load()) {
+	mIdleCount.store(0);
+	setLevel(mLevel.load() + 1);
+    }
+}
+
+/*
+  Hold the render thread after a swap so that the next swap lands on
+  the vsync that matches the current frame rate.  The wait is cut
+  short by fullRate().
+ */
+
+void FrameGovernor::swapped()
+{
+    int level = mLevel.load();
+    if (level == 0)
+	return;
+
+    unsigned long ms = 1000 / kFrameRates[level] - 1000 / kVsyncRate;
+    mFramesThrottled.ref();
+    QMutexLocker locker(&mSleepLock);
+    if (mLevel.load() == level)
+	mSleepWait.wait(&mSleepLock, ms);
+}
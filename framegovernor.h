@@ -0,0 +1,81 @@
+/*
+  Frame rate governor
+
+  Watches the scene graph of a QQuickWindow and lowers the effective
+  frame rate when frames are being rendered without any visual change.
+ */
+
+#ifndef _FRAME_GOVERNOR_H
+#define _FRAME_GOVERNOR_H
+
+#include <QObject>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QVariantMap>
+#include <QWaitCondition>
+
+class QQuickWindow;
+
+class FrameGovernor : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(bool enabled READ enabled WRITE setEnabled NOTIFY enabledChanged)
+    Q_PROPERTY(int frameRate READ frameRate NOTIFY frameRateChanged)
+    Q_PROPERTY(int idleFrames READ idleFrames WRITE setIdleFrames NOTIFY idleFramesChanged)
+    Q_PROPERTY(int maxFrameRate READ maxFrameRate WRITE setMaxFrameRate NOTIFY maxFrameRateChanged)
+
+public:
+    static FrameGovernor *instance();
+    ~FrameGovernor();
+
+    void         setWindow(QQuickWindow *window);
+
+    bool         enabled() const { return mEnabled.load() != 0; }
+    void         setEnabled(bool);
+
+    int          frameRate() const;
+
+    int          idleFrames() const { return mIdleFrames.load(); }
+    void         setIdleFrames(int);
+
+    // Cap applied even while there is damage or input (thermal throttling)
+    int          maxFrameRate() const;
+    void         setMaxFrameRate(int);
+
+    Q_INVOKABLE void        fullRate();
+    Q_INVOKABLE QVariantMap statistics() const;
+
+signals:
+    void         enabledChanged();
+    void         frameRateChanged();
+    void         idleFramesChanged();
+    void         maxFrameRateChanged();
+
+protected:
+    bool         eventFilter(QObject *object, QEvent *event);
+
+private:
+    FrameGovernor();
+    void         setLevel(int level);
+
+private slots:
+    // These run in the scene graph render thread
+    void         synchronizing();
+    void         swapped();
+
+private:
+    QQuickWindow  *mWindow;
+    QAtomicInt     mEnabled;
+    QAtomicInt     mLevel;        // Index into the frame rate table
+    QAtomicInt     mMinLevel;     // From maxFrameRate
+    QAtomicInt     mIdleFrames;   // Undamaged frames before stepping down
+    QAtomicInt     mIdleCount;
+    QAtomicInt     mFramesRendered;
+    QAtomicInt     mFramesDamaged;
+    QAtomicInt     mFramesThrottled;
+    int            mDamageRun;    // Consecutive damaged frames (render thread)
+    QMutex         mSleepLock;
+    QWaitCondition mSleepWait;
+};
+
+#endif // _FRAME_GOVERNOR_H
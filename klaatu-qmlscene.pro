@@ -1,5 +1,5 @@
 TARGET = klaatu_qmlscene
-QT += qml core-private gui-private quick
+QT += qml core-private gui-private quick quick-private
 DESTDIR = ../bin
 
 SOURCES = \
@@ -7,8 +7,11 @@ SOURCES = \
     screencontrol.cpp \
     event_thread.cpp \
     audiocontrol.cpp \
+    mediaworker.cpp \
+    soundmixer.cpp \
     lights.cpp \
     battery.cpp \
+    batteryhistory.cpp \
     inputcontext.cpp \
     power.cpp \
     command.cpp \
@@ -16,15 +19,29 @@ SOURCES = \
     sensors.cpp \
     screenorientation.cpp \
     wifi.cpp \
+    wificache.cpp \
     callmodel.cpp \
-    klaatuapplication.cpp
+    klaatuapplication.cpp \
+    framegovernor.cpp \
+    powerstats.cpp \
+    thermalmonitor.cpp \
+    sysfs.cpp \
+    uevent.cpp \
+    fakepowersupply.cpp \
+    fakewifi.cpp \
+    allocstats.cpp \
+    benchmark.cpp \
+    wifibenchmark.cpp
 
 HEADERS = \
     screencontrol.h \
     audiocontrol.h \
+    mediaworker.h \
+    soundmixer.h \
     event_thread.h \
     lights.h \
     battery.h \
+    batteryhistory.h \
     inputcontext.h \
     power.h \
     command.h \
@@ -32,10 +49,20 @@ HEADERS = \
     sensors.h \
     screenorientation.h \
     wifi.h \
+    wificache.h \
     sensor.h \
     callmodel.h \
     klaatuapplication.h \
-    cursorsignal.h
+    cursorsignal.h \
+    framegovernor.h \
+    powerstats.h \
+    thermalmonitor.h \
+    sysfs.h \
+    uevent.h \
+    fakepowersupply.h \
+    fakewifi.h \
+    allocstats.h \
+    benchmark.h
 
 ATOP=$$(ANDROID_BUILD_TOP)
 isEmpty(ATOP) {
@@ -57,6 +84,10 @@ contains (CONFIG, KLAATU_OLDLIBS) {
     LIBS += -landroidfw -lsuspend
 }
 
+contains (CONFIG, KLAATU_ALLOC_STATS) {
+    DEFINES += KLAATU_ALLOC_STATS
+}
+
 contains (CONFIG, KLAATU_INPUT_SERVICE) {
     LIBS += -linputservice
 }
@@ -0,0 +1,34 @@
+# Wifi models and the scripted wifi backend on a plain Linux host, with
+# no Android tree.  Builds klaatu_wifi_host; see wifihost_main.cpp.
+
+TARGET = klaatu_wifi_host
+QT += qml core-private gui-private quick quick-private
+DESTDIR = ../bin
+CONFIG += KLAATU_HOST
+DEFINES += KLAATU_HOST
+
+SOURCES = \
+    wifihost_main.cpp \
+    wifi.cpp \
+    wificache.cpp \
+    fakewifi.cpp \
+    framegovernor.cpp \
+    allocstats.cpp \
+    wifibenchmark.cpp
+
+HEADERS = \
+    wifi.h \
+    wificache.h \
+    fakewifi.h \
+    framegovernor.h \
+    allocstats.h \
+    benchmark.h
+
+contains (CONFIG, KLAATU_ALLOC_STATS) {
+    DEFINES += KLAATU_ALLOC_STATS
+}
+
+MOC_DIR=.moc-host
+OBJECTS_DIR=.obj-host
+
+mac: CONFIG -= app_bundle
@@ -0,0 +1,348 @@
+/*
+  Media playback thread
+ */
+
+#include "mediaworker.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <media/mediaplayer.h>
+
+#include <QFile>
+#include <QMutex>
+
+using namespace android;
+
+// --------------------------------------------------------------
+
+enum PlayerState { PREPARING, PREPARED, STARTED };
+
+struct MediaWorker::Player {
+    int             id;
+    sp<MediaPlayer> mp;
+    QString         key;        // File and stream type
+    PlayerState     state;
+    int             preloads;   // 0 for a one-shot player
+    QObject        *owner;      // Who is playing it, if anyone
+    bool            looping;
+
+    // Valid while it has an owner
+    int             serial;     // From the owner's play()
+    int             priority;
+    int             voice;      // Allocation order
+};
+
+/*
+  Notifications arrive on a binder thread; pass them to the media
+  thread by player id so a late one for a released player is harmless.
+ */
+
+class PlayerListener : public MediaPlayerListener
+{
+public:
+    PlayerListener(int id) : mId(id) {}
+
+    virtual void notify(int msg, int ext1, int ext2, const Parcel *) {
+	MediaWorker::instance()->postEvent(mId, msg, ext1, ext2);
+    }
+
+private:
+    int mId;
+};
+
+static QString playerKey(const QString& filename, int streamType)
+{
+    return QString::number(streamType) + QLatin1Char(':') + filename;
+}
+
+static int streamPriority(int streamType)
+{
+    switch (streamType) {
+    case AUDIO_STREAM_VOICE_CALL:
+	return 4;
+    case AUDIO_STREAM_RING:
+    case AUDIO_STREAM_ALARM:
+	return 3;
+    case AUDIO_STREAM_NOTIFICATION:
+	return 2;
+    case AUDIO_STREAM_MUSIC:
+	return 1;
+    default:
+	return 0;
+    }
+}
+
+const int kDefaultMaxVoices = 4;
+
+// --------------------------------------------------------------
+
+// Called from the GUI and the radio threads
+MediaWorker *MediaWorker::instance()
+{
+    static QMutex _sMediaWorkerInstance;
+    static MediaWorker *_s_media_worker = 0;
+
+    QMutexLocker _l(&_sMediaWorkerInstance);
+    if (!_s_media_worker)
+	_s_media_worker = new MediaWorker;
+    return _s_media_worker;
+}
+
+MediaWorker::MediaWorker()
+    : mNextId(0)
+    , mNextVoice(0)
+    , mMaxVoices(kDefaultMaxVoices)
+{
+    mThread.start();
+    moveToThread(&mThread);
+}
+
+MediaWorker::~MediaWorker()
+{
+    mThread.quit();
+    mThread.wait();
+    foreach (Player *player, mPlayers) {
+	player->mp->disconnect();
+	delete player;
+    }
+}
+
+void MediaWorker::preload(const QString& filename, int streamType)
+{
+    QMetaObject::invokeMethod(this, "doPreload", Qt::QueuedConnection,
+			      Q_ARG(QString, filename), Q_ARG(int, streamType));
+}
+
+void MediaWorker::unload(const QString& filename, int streamType)
+{
+    QMetaObject::invokeMethod(this, "doUnload", Qt::QueuedConnection,
+			      Q_ARG(QString, filename), Q_ARG(int, streamType));
+}
+
+void MediaWorker::play(QObject *owner, int serial, const QString& filename, int streamType,
+		       bool looping)
+{
+    QMetaObject::invokeMethod(this, "doPlay", Qt::QueuedConnection,
+			      Q_ARG(QObject *, owner), Q_ARG(int, serial),
+			      Q_ARG(QString, filename), Q_ARG(int, streamType),
+			      Q_ARG(bool, looping));
+}
+
+void MediaWorker::stop(QObject *owner)
+{
+    QMetaObject::invokeMethod(this, "doStop", Qt::QueuedConnection, Q_ARG(QObject *, owner));
+}
+
+void MediaWorker::postEvent(int player, int msg, int ext1, int ext2)
+{
+    QMetaObject::invokeMethod(this, "doEvent", Qt::QueuedConnection, Q_ARG(int, player),
+			      Q_ARG(int, msg), Q_ARG(int, ext1), Q_ARG(int, ext2));
+}
+
+// --------------------------------------------------------------
+// Everything below runs on the media thread
+
+MediaWorker::Player *MediaWorker::createPlayer(const QString& filename, int streamType)
+{
+    QByteArray path = QFile::encodeName(filename);
+    int fd = ::open(path.constData(), O_RDONLY);
+    if (fd < 0) {
+	fprintf(stderr, "Unable to open %s: %s\n", path.constData(), strerror(errno));
+	return 0;
+    }
+    struct stat stat_buf;
+    if (::fstat(fd, &stat_buf) < 0) {
+	fprintf(stderr, "Unable to stat %s: %s\n", path.constData(), strerror(errno));
+	::close(fd);
+	return 0;
+    }
+
+    Player *player = new Player;
+    player->id       = ++mNextId;
+    player->mp       = new MediaPlayer;
+    player->key      = playerKey(filename, streamType);
+    player->state    = PREPARING;
+    player->preloads = 0;
+    player->owner    = 0;
+    player->looping  = false;
+    player->serial   = 0;
+    player->priority = streamPriority(streamType);
+    player->voice    = 0;
+
+    player->mp->setListener(new PlayerListener(player->id));
+    player->mp->setAudioStreamType(static_cast<audio_stream_type_t>(streamType));
+    status_t err = player->mp->setDataSource(fd, 0, stat_buf.st_size);
+    ::close(fd);   // The media server has its own descriptor now
+    if (err == NO_ERROR)
+	err = player->mp->prepareAsync();
+    if (err != NO_ERROR) {
+	fprintf(stderr, "Unable to prepare %s (%d)\n", path.constData(), err);
+	player->mp->disconnect();
+	delete player;
+	return 0;
+    }
+    mPlayers.insert(player->id, player);
+    return player;
+}
+
+void MediaWorker::start(Player *player)
+{
+    if (player->preloads)
+	player->mp->seekTo(0);   // It may have played before
+    player->mp->setLooping(player->looping);
+    player->mp->start();
+    player->state = STARTED;
+}
+
+void MediaWorker::release(Player *player)
+{
+    if (player->owner && mOwners.value(player->owner) == player->id)
+	mOwners.remove(player->owner);
+    if (mPreloaded.value(player->key) == player->id)
+	mPreloaded.remove(player->key);
+    mPlayers.remove(player->id);
+    player->mp->disconnect();
+    delete player;
+}
+
+void MediaWorker::doPreload(const QString& filename, int streamType)
+{
+    Player *player = mPlayers.value(mPreloaded.value(playerKey(filename, streamType)));
+    if (!player) {
+	player = createPlayer(filename, streamType);
+	if (!player)
+	    return;
+	mPreloaded.insert(player->key, player->id);
+    }
+    player->preloads++;
+}
+
+void MediaWorker::doUnload(const QString& filename, int streamType)
+{
+    Player *player = mPlayers.value(mPreloaded.value(playerKey(filename, streamType)));
+    if (!player || --player->preloads > 0)
+	return;
+    mPreloaded.remove(player->key);
+    if (!player->owner)
+	release(player);
+    // else it finishes as a one-shot player
+}
+
+void MediaWorker::doPlay(QObject *owner, int serial, const QString& filename, int streamType,
+			 bool looping)
+{
+    doStop(owner);
+
+    if (!reserveVoice(streamPriority(streamType))) {
+	emit voiceStateChanged(owner, serial, VoicePreempted);
+	return;
+    }
+
+    Player *player = mPlayers.value(mPreloaded.value(playerKey(filename, streamType)));
+    if (!player || player->owner) {
+	// Not preloaded, or already busy: use a one-shot player
+	player = createPlayer(filename, streamType);
+	if (!player) {
+	    emit voiceStateChanged(owner, serial, VoiceError);
+	    return;
+	}
+    }
+    player->owner = owner;
+    player->serial = serial;
+    player->voice = ++mNextVoice;
+    player->looping = looping;
+    mOwners.insert(owner, player->id);
+    if (player->state == PREPARED) {
+	start(player);
+	report(player, VoicePlaying);
+    }
+    else
+	report(player, VoicePreparing);   // Starts on MEDIA_PREPARED
+}
+
+/*
+  Make room for a voice of 'priority', stealing the lowest priority
+  voices if the pool is full.
+ */
+
+bool MediaWorker::reserveVoice(int priority)
+{
+    while (mOwners.size() >= maxVoices()) {
+	Player *victim = 0;
+	foreach (int id, mOwners) {
+	    Player *player = mPlayers.value(id);
+	    if (!victim || player->priority < victim->priority ||
+		(player->priority == victim->priority && player->voice < victim->voice))
+		victim = player;
+	}
+	if (!victim || victim->priority > priority)
+	    return false;
+	report(victim, VoicePreempted);
+	doStop(victim->owner);
+    }
+    return true;
+}
+
+void MediaWorker::report(Player *player, VoiceState state)
+{
+    if (player->owner)
+	emit voiceStateChanged(player->owner, player->serial, state);
+}
+
+void MediaWorker::doStop(QObject *owner)
+{
+    Player *player = mPlayers.value(mOwners.take(owner));
+    if (!player)
+	return;
+    player->owner = 0;
+    if (player->preloads) {
+	if (player->state == STARTED) {
+	    player->mp->pause();
+	    player->state = PREPARED;
+	}
+    }
+    else {
+	if (player->state == STARTED)
+	    player->mp->stop();
+	release(player);
+    }
+}
+
+void MediaWorker::doEvent(int id, int msg, int ext1, int ext2)
+{
+    Player *player = mPlayers.value(id);
+    if (!player)
+	return;
+
+    switch (msg) {
+    case MEDIA_PREPARED:
+	player->state = PREPARED;
+	if (player->owner) {
+	    start(player);
+	    report(player, VoicePlaying);
+	}
+	break;
+    case MEDIA_PLAYBACK_COMPLETE:
+	report(player, VoiceStopped);
+	if (player->owner)
+	    mOwners.remove(player->owner);
+	player->owner = 0;
+	player->state = PREPARED;
+	if (!player->preloads)
+	    release(player);
+	break;
+    case MEDIA_ERROR:
+	fprintf(stderr, "Media player error %d %d\n", ext1, ext2);
+	report(player, VoiceError);
+	release(player);
+	break;
+    default:
+	break;
+    }
+}
@@ -0,0 +1,92 @@
+/*
+  Media playback thread
+ */
+
+#ifndef _MEDIA_WORKER_H
+#define _MEDIA_WORKER_H
+
+#include <QAtomicInt>
+#include <QHash>
+#include <QObject>
+#include <QThread>
+
+/*
+  Owns every MediaPlayer.  The public functions queue a request and
+  return at once, so neither the GUI thread nor the radio thread ever
+  waits on the media server.  Players are prepared with prepareAsync()
+  and started from their MEDIA_PREPARED notification.
+
+  Preloaded sounds are kept prepared, so playing one is a single
+  start() on the media thread.  Stopping a preloaded sound pauses and
+  rewinds it instead of calling stop(), which would need another
+  prepare.  Preloads are counted per file and stream type.
+
+  'owner' is only used as a key: a play() replaces whatever the same
+  owner was playing, and stop() stops it.  Each owner has at most one
+  voice.  When maxVoices are already playing, a new voice takes over
+  the lowest priority one (the oldest among equals) unless that has a
+  higher priority, in which case the new voice is refused.  Priority
+  follows the stream type: calls, then ringer and alarms, then
+  notifications, then music, then everything else.
+
+  Voice state is reported through voiceStateChanged() with the owner
+  and the 'serial' it passed to play(), so a report about an earlier
+  play() can be told apart.
+ */
+
+class MediaWorker : public QObject
+{
+    Q_OBJECT
+public:
+    enum VoiceState { VoiceStopped, VoicePreparing, VoicePlaying, VoicePreempted, VoiceError };
+
+    static MediaWorker *instance();
+    ~MediaWorker();
+
+    int          maxVoices() const { return mMaxVoices.load(); }
+    void         setMaxVoices(int maxVoices) { mMaxVoices.store(qMax(maxVoices, 1)); }
+
+    // 'streamType' is an audio_stream_type_t
+    void         preload(const QString& filename, int streamType);
+    void         unload(const QString& filename, int streamType);
+    void         play(QObject *owner, int serial, const QString& filename, int streamType,
+			  bool looping);
+    void         stop(QObject *owner);
+
+    // From the player listeners, on a binder thread
+    void         postEvent(int player, int msg, int ext1, int ext2);
+
+signals:
+    // Emitted on the media thread; connect with a queued connection
+    void         voiceStateChanged(QObject *owner, int serial, int state);
+
+private slots:
+    void         doPreload(const QString& filename, int streamType);
+    void         doUnload(const QString& filename, int streamType);
+    void         doPlay(QObject *owner, int serial, const QString& filename, int streamType,
+			    bool looping);
+    void         doStop(QObject *owner);
+    void         doEvent(int player, int msg, int ext1, int ext2);
+
+private:
+    MediaWorker();
+
+    struct Player;
+    Player      *createPlayer(const QString& filename, int streamType);
+    void         start(Player *player);
+    void         release(Player *player);
+    bool         reserveVoice(int priority);
+    void         report(Player *player, VoiceState state);
+
+    QThread      mThread;
+    int          mNextId;
+    int          mNextVoice;
+    QAtomicInt   mMaxVoices;
+
+    // Used only on the media thread
+    QHash<int, Player *>     mPlayers;     // By id
+    QHash<QObject *, int>    mOwners;      // Player id for each owner
+    QHash<QString, int>      mPreloaded;   // Player id by file and stream type
+};
+
+#endif // _MEDIA_WORKER_H
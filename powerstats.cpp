@@ -0,0 +1,237 @@
+/*
+  Power state telemetry.
+
+  Time is measured with elapsedRealtime() so that residency in SLEEP
+  includes the time the device spends suspended.
+
+  Send SIGUSR1 to the process to dump the statistics to stdout:
+
+      kill -USR1 `pidof klaatu_qmlscene`
+ */
+
+#include "powerstats.h"
+
+#include <utils/SystemClock.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <QSocketNotifier>
+#include <QStringList>
+
+// --------------------------------------------------------------------------------
+
+static const char *stateName(int state)
+{
+    switch (state) {
+    case ScreenControl::NORMAL: return "NORMAL";
+    case ScreenControl::DIM:    return "DIM";
+    case ScreenControl::SLEEP:  return "SLEEP";
+    }
+    return "UNKNOWN";
+}
+
+static const char *causeName(int cause)
+{
+    switch (cause) {
+    case ScreenControl::CAUSE_STARTUP:       return "startup";
+    case ScreenControl::CAUSE_TIMEOUT:       return "timeout";
+    case ScreenControl::CAUSE_POWER_KEY:     return "powerKey";
+    case ScreenControl::CAUSE_USER_ACTIVITY: return "userActivity";
+    case ScreenControl::CAUSE_GO_TO_SLEEP:   return "goToSleep";
+    case ScreenControl::CAUSE_SCREEN_LOCK:   return "screenLock";
+    }
+    return "unknown";
+}
+
+/*
+  SIGUSR1 is turned into a socket notification so the dump itself
+  runs in the GUI thread.
+ */
+
+static int sDumpFd[2] = { -1, -1 };
+
+static void dump_signal_handler(int)
+{
+    char c = 1;
+    ssize_t n = ::write(sDumpFd[0], &c, 1);
+    (void) n;
+}
+
+// --------------------------------------------------------------------------------
+
+PowerStats *PowerStats::instance()
+{
+    static PowerStats *_s_power_stats = 0;
+    if (!_s_power_stats)
+	_s_power_stats = new PowerStats;
+    return _s_power_stats;
+}
+
+PowerStats::PowerStats()
+    : mDumpNotifier(0)
+{
+    reset();
+    mState = -1;
+    mEnteredAt = android::elapsedRealtime();
+
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sDumpFd) == 0) {
+	mDumpNotifier = new QSocketNotifier(sDumpFd[1], QSocketNotifier::Read, this);
+	connect(mDumpNotifier, SIGNAL(activated(int)), SLOT(dumpRequested()));
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = dump_signal_handler;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, 0);
+    }
+    else
+	fprintf(stderr, "PowerStats: unable to create dump socket (%s)\n", strerror(errno));
+}
+
+PowerStats::~PowerStats()
+{
+}
+
+qint64 PowerStats::residency(ScreenControl::SystemState state) const
+{
+    QMutexLocker locker(&mLock);
+    return residencyLocked(state);
+}
+
+int PowerStats::transitionCount() const
+{
+    QMutexLocker locker(&mLock);
+    return mTransitionCount;
+}
+
+int PowerStats::wakeCount() const
+{
+    QMutexLocker locker(&mLock);
+    return mWakeCount;
+}
+
+qint64 PowerStats::residencyLocked(int state) const
+{
+    qint64 result = mResidency[state];
+    if (mState == state)
+	result += android::elapsedRealtime() - mEnteredAt;
+    return result;
+}
+
+void PowerStats::reset()
+{
+    QMutexLocker locker(&mLock);
+    memset(mResidency, 0, sizeof(mResidency));
+    memset(mWakeSources, 0, sizeof(mWakeSources));
+    memset(mLog, 0, sizeof(mLog));
+    mLogHead = 0;
+    mTransitionCount = 0;
+    mWakeCount = 0;
+    mEnteredAt = android::elapsedRealtime();
+    locker.unlock();
+    emit statsChanged();
+}
+
+void PowerStats::recordTransition(ScreenControl::SystemState from, ScreenControl::SystemState to,
+				  ScreenControl::TransitionCause cause)
+{
+    QMutexLocker locker(&mLock);
+    qint64 now = android::elapsedRealtime();
+    qint64 duration = now - mEnteredAt;
+    if (mState >= 0)
+	mResidency[mState] += duration;
+
+    Transition& t(mLog[mLogHead]);
+    t.when     = now;
+    t.duration = duration;
+    t.from     = from;
+    t.to       = to;
+    t.cause    = cause;
+    mLogHead = (mLogHead + 1) % kLogSize;
+
+    // The boot-time entry into NORMAL starts from SLEEP but is not a wake
+    mTransitionCount++;
+    if (from == ScreenControl::SLEEP && cause != ScreenControl::CAUSE_STARTUP) {
+	mWakeCount++;
+	mWakeSources[cause]++;
+    }
+
+    mState = to;
+    mEnteredAt = now;
+    locker.unlock();
+    emit statsChanged();
+}
+
+/*!
+  Return the transition log, oldest entry first.
+ */
+
+QVariantList PowerStats::transitions() const
+{
+    QMutexLocker locker(&mLock);
+    QVariantList result;
+    int count = qMin(mTransitionCount, (int) kLogSize);
+    for (int i = 0 ; i < count ; i++) {
+	const Transition& t(mLog[(mLogHead - count + i + kLogSize) % kLogSize]);
+	QVariantMap entry;
+	entry.insert(QStringLiteral("when"), t.when);
+	entry.insert(QStringLiteral("duration"), t.duration);
+	entry.insert(QStringLiteral("from"), t.from);
+	entry.insert(QStringLiteral("to"), t.to);
+	entry.insert(QStringLiteral("cause"), QString::fromLatin1(causeName(t.cause)));
+	result << entry;
+    }
+    return result;
+}
+
+QVariantMap PowerStats::wakeSources() const
+{
+    QMutexLocker locker(&mLock);
+    QVariantMap result;
+    for (int i = 0 ; i < ScreenControl::_CAUSE_COUNT ; i++)
+	result.insert(QString::fromLatin1(causeName(i)), mWakeSources[i]);
+    return result;
+}
+
+QString PowerStats::dump() const
+{
+    QMutexLocker locker(&mLock);
+    QStringList lines;
+    lines << QStringLiteral("Power state residency (ms):");
+    for (int i = ScreenControl::NORMAL ; i <= ScreenControl::SLEEP ; i++)
+	lines << QString::fromLatin1("  %1 %2").arg(QString::fromLatin1(stateName(i)), -8)
+	    .arg(residencyLocked(i));
+
+    lines << QString::fromLatin1("Transitions: %1  Wakes: %2").arg(mTransitionCount).arg(mWakeCount);
+    lines << QStringLiteral("Wake sources:");
+    for (int i = 0 ; i < ScreenControl::_CAUSE_COUNT ; i++)
+	if (mWakeSources[i])
+	    lines << QString::fromLatin1("  %1 %2").arg(QString::fromLatin1(causeName(i)), -14)
+		.arg(mWakeSources[i]);
+
+    lines << QStringLiteral("Recent transitions (when, from -> to, cause, time in previous state):");
+    int count = qMin(mTransitionCount, (int) kLogSize);
+    for (int i = 0 ; i < count ; i++) {
+	const Transition& t(mLog[(mLogHead - count + i + kLogSize) % kLogSize]);
+	lines << QString::fromLatin1("  %1 %2 -> %3 %4 %5")
+	    .arg(t.when, 10)
+	    .arg(QString::fromLatin1(stateName(t.from)), -6)
+	    .arg(QString::fromLatin1(stateName(t.to)), -6)
+	    .arg(QString::fromLatin1(causeName(t.cause)), -14)
+	    .arg(t.duration);
+    }
+    return lines.join(QStringLiteral("\n"));
+}
+
+void PowerStats::dumpRequested()
+{
+    char buf[16];
+    ssize_t n = ::read(sDumpFd[1], buf, sizeof(buf));
+    (void) n;
+    printf("%s\n", dump().toLocal8Bit().constData());
+    fflush(stdout);
+}
@@ -0,0 +1,80 @@
+/*
+  Power state telemetry
+
+  Residency counters, a transition log and wake source attribution
+  for the ScreenControl state machine.
+ */
+
+#ifndef _POWER_STATS_H
+#define _POWER_STATS_H
+
+#include <QObject>
+#include <QMutex>
+#include <QVariantList>
+#include <QVariantMap>
+
+#include "screencontrol.h"
+
+class QSocketNotifier;
+
+class PowerStats : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(qint64 normalTime READ normalTime NOTIFY statsChanged)
+    Q_PROPERTY(qint64 dimTime READ dimTime NOTIFY statsChanged)
+    Q_PROPERTY(qint64 sleepTime READ sleepTime NOTIFY statsChanged)
+    Q_PROPERTY(int transitionCount READ transitionCount NOTIFY statsChanged)
+    Q_PROPERTY(int wakeCount READ wakeCount NOTIFY statsChanged)
+
+public:
+    static PowerStats *instance();
+    ~PowerStats();
+
+    // Residency in milliseconds, including time in the current state
+    qint64       residency(ScreenControl::SystemState) const;
+    qint64       normalTime() const { return residency(ScreenControl::NORMAL); }
+    qint64       dimTime() const { return residency(ScreenControl::DIM); }
+    qint64       sleepTime() const { return residency(ScreenControl::SLEEP); }
+
+    int          transitionCount() const;
+    int          wakeCount() const;
+
+    Q_INVOKABLE QVariantList transitions() const;
+    Q_INVOKABLE QVariantMap  wakeSources() const;
+    Q_INVOKABLE QString      dump() const;
+    Q_INVOKABLE void         reset();
+
+    void         recordTransition(ScreenControl::SystemState from, ScreenControl::SystemState to,
+				  ScreenControl::TransitionCause cause);
+
+signals:
+    void         statsChanged();
+
+private slots:
+    void         dumpRequested();
+
+private:
+    PowerStats();
+    qint64       residencyLocked(int state) const;
+
+    struct Transition {
+	qint64 when;      // elapsedRealtime() in ms
+	qint64 duration;  // Time spent in the "from" state
+	quint8 from, to, cause;
+    };
+
+    enum { kLogSize = 64 };
+
+    mutable QMutex mLock;        // Transitions may be recorded from the input thread
+    qint64       mResidency[3];
+    qint64       mEnteredAt;     // elapsedRealtime() when the current state was entered
+    int          mState;         // -1 until the first transition
+    int          mTransitionCount;
+    int          mWakeCount;
+    int          mWakeSources[ScreenControl::_CAUSE_COUNT];
+    Transition   mLog[kLogSize];
+    int          mLogHead;       // Next slot to write
+    QSocketNotifier *mDumpNotifier;
+};
+
+#endif // _POWER_STATS_H
@@ -32,6 +32,15 @@
 #include "screenorientation.h"
 #include "power.h"
 #include "command.h"
+#include "framegovernor.h"
+#include "powerstats.h"
+#include "thermalmonitor.h"
+#include "uevent.h"
+#include "fakepowersupply.h"
+#include "fakewifi.h"
+#include "mediaworker.h"
+#include "soundmixer.h"
+#include "benchmark.h"
 
 #include <QtGui/private/qinputmethod_p.h>
 #include <qpa/qplatforminputcontext.h>
@@ -51,6 +60,19 @@ static void usage(int code=0)
 	     "Valid args:\n"
 	     "   -i|--import DIRNAME     Add to QML import path\n"
 	     "   -d|--device DEVICE      Set up input methods for hardware\n"
+	     "   -u|--uevent-replay FILE Read uevents from FILE instead of the kernel\n"
+	     "   --battery-history FILE  Keep the battery history in FILE across restarts\n"
+	     "   --power-supply-root DIR Read power_supply nodes from DIR instead of sysfs\n"
+	     "   --thermal-root DIR      Read thermal zones from DIR instead of sysfs\n"
+	     "   --fake-power-supply MS  Simulate a battery, with a uevent every MS ms\n"
+	     "                           (0 for a back-to-back uevent storm)\n"
+	     "   --fake-wifi SCRIPT      Play wifi events from SCRIPT instead of the wifi service\n"
+	     "   --wifi-cache FILE       Keep the last wifi scan in FILE across restarts\n"
+	     "   --max-voices N          Play at most N sounds at once (default 4)\n"
+	     "   --sound-sink SINK       Send SoundEffect audio to SINK: 'null' or a .wav file\n"
+	     "   --power-benchmark N     Time Battery through a storm of N fake uevents and exit\n"
+	     "   --wifi-benchmark N      Time N scan rounds through the wifi model and exit\n"
+	     "   --sound-benchmark N     Time N SoundMixer plays into a null sink and exit\n"
 	     "\n"
 	     "The DEVICE value may be 'nexus'\n"
 	     "The FILENAME should be a QML file to load\n", qPrintable(progname));
@@ -62,6 +84,7 @@ Q_DECLARE_METATYPE(QList<QPersistentModelIndex>)
 static void registerQmlTypes()
 {
     qmlRegisterType<AudioFile>("Klaatu", 1, 0, "AudioFile");
+    qmlRegisterType<SoundEffect>("Klaatu", 1, 0, "SoundEffect");
 
     qmlRegisterUncreatableType<AudioControl>("Klaatu", 1, 0, "AudioControl","Single instance");
     qmlRegisterUncreatableType<ScreenControl>("Klaatu", 1, 0, "ScreenControl","Single instance");
@@ -72,6 +95,10 @@ static void registerQmlTypes()
     qmlRegisterUncreatableType<Wifi>("Klaatu", 1, 0, "Sensors","Single instance");
     qmlRegisterUncreatableType<Wifi>("Klaatu", 1, 0, "ScreenOrientation","Single instance");
     qmlRegisterUncreatableType<Wifi>("Klaatu", 1, 0, "Power","Single instance");
+    qmlRegisterUncreatableType<FrameGovernor>("Klaatu", 1, 0, "FrameGovernor","Single instance");
+    qmlRegisterUncreatableType<PowerStats>("Klaatu", 1, 0, "PowerStats","Single instance");
+    qmlRegisterUncreatableType<ThermalMonitor>("Klaatu", 1, 0, "ThermalMonitor","Single instance");
+    qmlRegisterUncreatableType<SoundMixer>("Klaatu", 1, 0, "SoundMixer","Single instance");
 
     qRegisterMetaType<QSet<int> >();
     qRegisterMetaType<QList<QPersistentModelIndex> >();
@@ -90,6 +117,9 @@ int main(int argc, char **argv)
 
     QString     device;
     QStringList imports;
+    int         powerBenchmark = 0;
+    int         wifiBenchmark = 0;
+    int         soundBenchmark = 0;
     QStringList args = QGuiApplication::arguments();
     progname = args.takeFirst();
 
@@ -110,12 +140,85 @@ int main(int argc, char **argv)
 		usage();
 	    device = args.takeFirst();
 	}
+	else if (arg == QStringLiteral("--uevent-replay") || arg == QStringLiteral("-u")) {
+	    if (!args.size())
+		usage();
+	    UEventDispatcher::setSource(new UEventReplaySource(args.takeFirst()));
+	}
+	else if (arg == QStringLiteral("--battery-history")) {
+	    if (!args.size())
+		usage();
+	    Battery::setHistoryFile(args.takeFirst());
+	}
+	else if (arg == QStringLiteral("--power-supply-root")) {
+	    if (!args.size())
+		usage();
+	    Battery::setSysfsRoot(args.takeFirst());
+	}
+	else if (arg == QStringLiteral("--thermal-root")) {
+	    if (!args.size())
+		usage();
+	    ThermalMonitor::setSysfsRoot(args.takeFirst());
+	}
+	else if (arg == QStringLiteral("--fake-power-supply")) {
+	    if (!args.size())
+		usage();
+	    FakePowerSupply *fake = new FakePowerSupply(args.takeFirst().toInt());
+	    Battery::setSysfsRoot(fake->root());
+	    UEventDispatcher::setSource(fake);
+	}
+	else if (arg == QStringLiteral("--fake-wifi")) {
+	    if (!args.size())
+		usage();
+	    Wifi::setBackend(new FakeWifiBackend(args.takeFirst()));
+	}
+	else if (arg == QStringLiteral("--wifi-cache")) {
+	    if (!args.size())
+		usage();
+	    Wifi::setCacheFile(args.takeFirst());
+	}
+	else if (arg == QStringLiteral("--max-voices")) {
+	    if (!args.size())
+		usage();
+	    MediaWorker::instance()->setMaxVoices(args.takeFirst().toInt());
+	}
+	else if (arg == QStringLiteral("--sound-sink")) {
+	    if (!args.size())
+		usage();
+	    QString sink = args.takeFirst();
+	    if (sink == QStringLiteral("null"))
+		SoundMixer::setSink(new NullSoundSink);
+	    else
+		SoundMixer::setSink(new WavFileSoundSink(sink));
+	}
+	else if (arg == QStringLiteral("--power-benchmark")) {
+	    if (!args.size())
+		usage();
+	    powerBenchmark = args.takeFirst().toInt();
+	}
+	else if (arg == QStringLiteral("--wifi-benchmark")) {
+	    if (!args.size())
+		usage();
+	    wifiBenchmark = args.takeFirst().toInt();
+	}
+	else if (arg == QStringLiteral("--sound-benchmark")) {
+	    if (!args.size())
+		usage();
+	    soundBenchmark = args.takeFirst().toInt();
+	}
 	else {
 	    qWarning("Unexpected argument '%s'", qPrintable(arg));
 	    usage(1);
 	}
     }
 
+    if (powerBenchmark)
+	return Benchmark::power(powerBenchmark);
+    if (wifiBenchmark)
+	return Benchmark::wifiModel(wifiBenchmark);
+    if (soundBenchmark)
+	return Benchmark::sound(soundBenchmark);
+
     if (args.size() != 1)
 	usage(1);
 
@@ -125,6 +228,7 @@ int main(int argc, char **argv)
 
     QQuickView *view = new QQuickView;
     view->setResizeMode(QQuickView::SizeRootObjectToView);
+    FrameGovernor::instance()->setWindow(view);
 
     QQmlEngine *engine = view->engine();
     for (int i = 0 ; i < imports.size() ; i++)
@@ -132,8 +236,11 @@ int main(int argc, char **argv)
 
     ProcessState::self()->startThreadPool();
     ScreenControl *screen = ScreenControl::instance();
+    screen->setWindow(view);
     engine->rootContext()->setContextProperty(QStringLiteral("screencontrol"), 
 					      screen);
+    engine->rootContext()->setContextProperty(QStringLiteral("powerstats"),
+					      PowerStats::instance());
     engine->rootContext()->setContextProperty(QStringLiteral("audiocontrol"), 
 					      AudioControl::instance());
     engine->rootContext()->setContextProperty(QStringLiteral("battery"), 
@@ -148,6 +255,12 @@ int main(int argc, char **argv)
                                               Power::instance()),
     engine->rootContext()->setContextProperty(QStringLiteral("command"),
                                               Command::instance()),
+    engine->rootContext()->setContextProperty(QStringLiteral("framegovernor"),
+                                              FrameGovernor::instance()),
+    engine->rootContext()->setContextProperty(QStringLiteral("thermalmonitor"),
+                                              ThermalMonitor::instance()),
+    engine->rootContext()->setContextProperty(QStringLiteral("soundmixer"),
+                                              SoundMixer::instance()),
 #ifndef KLAATU_NO_WIFI
     engine->rootContext()->setContextProperty(QStringLiteral("wifi"),
 					      Wifi::instance());
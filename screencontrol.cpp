@@ -6,6 +6,7 @@
 #include "screencontrol.h"
 #include "event_thread.h"
 #include "lights.h"
+#include "powerstats.h"
 
 #if defined(SHORT_PLATFORM_VERSION) && (SHORT_PLATFORM_VERSION == 40)
 #include <hardware/hardware.h>
@@ -15,10 +16,15 @@
 #endif
 #include <hardware_legacy/power.h>
 #include <cutils/properties.h>
+#include <utils/Timers.h>
 //#include <hardware/hardware.h>
 //#include <hardware/lights.h>
 
 #include <QDebug>
+#include <QQuickWindow>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
 #include <QTimer>
 
 using namespace android;
@@ -60,6 +66,32 @@ static void set_screen_state(bool on)
 #endif
 }
 
+const int kNormalBrightness = 200;
+const int kDimBrightness    = 20;
+
+/*
+  Raise the backlight from a pool thread so it runs in parallel with
+  the power HAL call on the wake fast path.
+ */
+
+class BacklightTask : public QRunnable
+{
+public:
+    BacklightTask(int brightness, QAtomicInt *doneFlag, qint64 *doneTime)
+	: mBrightness(brightness), mDoneFlag(doneFlag), mDoneTime(doneTime) {}
+
+    void run() {
+	Lights::instance()->setBrightness( Lights::BACKLIGHT, mBrightness );
+	*mDoneTime = systemTime(SYSTEM_TIME_MONOTONIC);
+	mDoneFlag->storeRelease(1);
+    }
+
+private:
+    int         mBrightness;
+    QAtomicInt *mDoneFlag;
+    qint64     *mDoneTime;
+};
+
 // --------------------------------------------------------------------------------
 
 ScreenControl *ScreenControl::instance()
@@ -75,13 +107,30 @@ ScreenControl::ScreenControl()
     , mSleepTimeout(3000)
     , mScreenLockOn(false)
     , mState(SLEEP)
+    , mMaxBrightness(255)
+    , mLongPressTimeout(500)
+    , mVeryLongPressTimeout(8000)
+    , mKeyDownTime(-1)
+    , mKeyPress(SHORT_PRESS)
+    , mKeyWoke(false)
+    , mWindow(0)
+    , mHardwareAwake(0)
+    , mFastWake(0)
+    , mWaitingForFrame(0)
+    , mBacklightDone(0)
 {
+    memset(mWakeTrace, 0, sizeof(mWakeTrace));
+
     mTimer = new QTimer(this);
     mTimer->setSingleShot(true);
     connect(mTimer, SIGNAL(timeout()), SLOT(timeout()));
 
+    mKeyTimer = new QTimer(this);
+    mKeyTimer->setSingleShot(true);
+    connect(mKeyTimer, SIGNAL(timeout()), SLOT(powerKeyTimeout()));
+
     power_module_init();   // Must come before "setState"
-    setState(NORMAL);
+    setState(NORMAL, CAUSE_STARTUP);
 }
 
 ScreenControl::~ScreenControl()
@@ -89,6 +138,15 @@ ScreenControl::~ScreenControl()
     // Could kill the event hub, but this should only run if everyone is dying
 }
 
+void ScreenControl::setWindow(QQuickWindow *window)
+{
+    if (mWindow)
+	disconnect(mWindow, 0, this, 0);
+    mWindow = window;
+    if (mWindow)
+	connect(mWindow, SIGNAL(frameSwapped()), SLOT(frameSwapped()), Qt::DirectConnection);
+}
+
 void ScreenControl::setDimTimeout(int timeout)
 {
     if (timeout != mDimTimeout) {
@@ -118,7 +176,7 @@ void ScreenControl::setScreenLockOn(bool lockOn)
 	mScreenLockOn = lockOn;
 	if (mScreenLockOn) {
 	    mTimer->stop();
-	    setState(NORMAL);
+	    setState(NORMAL, CAUSE_SCREEN_LOCK);
 	}
 	else if (mDimTimeout > 0)  // We must be in NORMAL state
 	    mTimer->start(mDimTimeout);
@@ -126,6 +184,40 @@ void ScreenControl::setScreenLockOn(bool lockOn)
     }
 }
 
+void ScreenControl::setMaxBrightness(int level)
+{
+    level = qBound(0, level, 255);
+    if (mMaxBrightness.fetchAndStoreOrdered(level) != level) {
+	// Re-apply to a lit screen
+	if (mState == NORMAL)
+	    Lights::instance()->setBrightness( Lights::BACKLIGHT, brightness(kNormalBrightness) );
+	else if (mState == DIM)
+	    Lights::instance()->setBrightness( Lights::BACKLIGHT, brightness(kDimBrightness) );
+	emit maxBrightnessChanged();
+    }
+}
+
+int ScreenControl::brightness(int level) const
+{
+    return qMin(level, mMaxBrightness.load());
+}
+
+void ScreenControl::setLongPressTimeout(int timeout)
+{
+    if (timeout != mLongPressTimeout) {
+	mLongPressTimeout = timeout;
+	emit longPressTimeoutChanged();
+    }
+}
+
+void ScreenControl::setVeryLongPressTimeout(int timeout)
+{
+    if (timeout != mVeryLongPressTimeout) {
+	mVeryLongPressTimeout = timeout;
+	emit veryLongPressTimeoutChanged();
+    }
+}
+
 /*!  
   Poke the system to indicate user activity.
   The system will stay on at least "ms" milliseconds.
@@ -135,7 +227,7 @@ void ScreenControl::userActivity(int ms)
 {
 //    qDebug() << Q_FUNC_INFO << ms;
     if (mState != SLEEP) {
-	setState(NORMAL);
+	setState(NORMAL, CAUSE_USER_ACTIVITY);
 	if (!mScreenLockOn && mDimTimeout > 0)
 	    mTimer->start(qMax(mDimTimeout, ms));
     }
@@ -148,69 +240,223 @@ void ScreenControl::userActivity(int ms)
 void ScreenControl::goToSleep()
 {
     if (!mScreenLockOn)
-	setState(SLEEP);
+	setState(SLEEP, CAUSE_GO_TO_SLEEP);
 }
 
 void ScreenControl::timeout()
 {
     switch (mState) {
     case NORMAL:
-	setState(DIM);
+	setState(DIM, CAUSE_TIMEOUT);
 	break;
     case DIM:
-	setState(SLEEP);
+	setState(SLEEP, CAUSE_TIMEOUT);
 	break;
     case SLEEP:
 	break;
     }
 }
 
-/* 
-   For now we'll toggle between power on/off states
-   In the future, we need to distinguish cases where the key is held
-   down for a long time and a power menu needs to be displayed
+/*
+   The power key is classified by how long it is held, using the
+   timestamps on the input events:
+
+     short press       toggle between NORMAL and SLEEP
+     long press        emit powerMenuRequested() while the key is still down
+     very long press   emit forcedRebootRequested() while the key is still down
+
+   A key-down from DIM or SLEEP wakes the screen immediately; the release
+   of that press is not used to put the screen back to sleep.  The single
+   key timer only runs while the key is held.
+
+   This is called from the InputReader thread; the state machine runs
+   in the GUI thread.
 */
 
-void ScreenControl::powerKey(int value)
+void ScreenControl::powerKey(int value, qint64 eventTime)
+{
+    if (QThread::currentThread() != thread())
+	QMetaObject::invokeMethod(this, "handlePowerKey", Qt::QueuedConnection,
+				  Q_ARG(int, value), Q_ARG(qint64, eventTime));
+    else
+	handlePowerKey(value, eventTime);
+}
+
+void ScreenControl::handlePowerKey(int value, qint64 eventTime)
 {
 //    qDebug() << Q_FUNC_INFO << value << "current state=" << (int) mState;
 
     if (value) {  // Key down
-	switch (mState) {
-	case NORMAL:
-	    setState(SLEEP);
-	    break;
-	case DIM:
-	    setState(NORMAL);   // This choice is debatable
-	    break;
-	case SLEEP:
-	    setState(NORMAL);
-	    break;
-	}
+	if (mKeyDownTime >= 0)
+	    return;   // Auto-repeat
+	mKeyDownTime = eventTime;
+	mKeyPress = SHORT_PRESS;
+	mKeyWoke = (mState != NORMAL);
+	if (mKeyWoke)
+	    setState(NORMAL, CAUSE_POWER_KEY);
+	armPowerKeyTimer(systemTime(SYSTEM_TIME_MONOTONIC));
+    }
+    else {
+	if (mKeyDownTime < 0)
+	    return;
+	mKeyTimer->stop();
+	classifyPowerKey(eventTime);   // In case the timer has not caught up
+	if (mKeyPress == SHORT_PRESS && !mKeyWoke)
+	    setState(SLEEP, CAUSE_POWER_KEY);
+	mKeyDownTime = -1;
+    }
+}
+
+void ScreenControl::powerKeyTimeout()
+{
+    if (mKeyDownTime < 0)
+	return;
+    qint64 now = systemTime(SYSTEM_TIME_MONOTONIC);
+    classifyPowerKey(now);
+    armPowerKeyTimer(now);
+}
+
+void ScreenControl::classifyPowerKey(qint64 now)
+{
+    qint64 held = ns2ms(now - mKeyDownTime);
+    if (mKeyPress == SHORT_PRESS && held >= mLongPressTimeout) {
+	mKeyPress = LONG_PRESS;
+	emit powerMenuRequested();
+    }
+    if (mKeyPress == LONG_PRESS && held >= mVeryLongPressTimeout) {
+	mKeyPress = VERY_LONG_PRESS;
+	emit forcedRebootRequested();
+    }
+}
+
+void ScreenControl::armPowerKeyTimer(qint64 now)
+{
+    int threshold;
+    switch (mKeyPress) {
+    case SHORT_PRESS:
+	threshold = mLongPressTimeout;
+	break;
+    case LONG_PRESS:
+	threshold = mVeryLongPressTimeout;
+	break;
+    default:
+	return;
     }
+    qint64 remaining = threshold - ns2ms(now - mKeyDownTime);
+    mKeyTimer->start(qMax(0, (int) remaining));
 }
 
-void ScreenControl::setState(SystemState state)
+/*
+   Wake fast path.  Called from the InputReader thread on power key
+   down, before the key is queued to the GUI thread.  If the screen
+   is asleep we disable autosuspend, start the backlight on a pool
+   thread, ask the window for a frame and tell the power HAL we are
+   interactive, all without waiting for the GUI thread.  setState()
+   then skips the hardware calls it would otherwise make.
+
+   Each phase is stamped against the key event time; see wakeTimings().
+*/
+
+void ScreenControl::wakeFastPath(qint64 eventTime)
+{
+    if (!mHardwareAwake.testAndSetOrdered(0, 1))
+	return;
+
+    mFastWake.storeRelease(1);
+    mWakeTrace[WAKE_KEY_EVENT] = eventTime;
+    mWakeTrace[WAKE_FAST_PATH] = systemTime(SYSTEM_TIME_MONOTONIC);
+
+#ifdef POWER_HARDWARE_MODULE_ID
+    autosuspend_disable();
+#endif
+    mWakeTrace[WAKE_AUTOSUSPEND] = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    mBacklightDone.store(0);
+    QThreadPool::globalInstance()->start(new BacklightTask(brightness(kNormalBrightness),
+							   &mBacklightDone,
+							   &mWakeTrace[WAKE_BACKLIGHT]));
+
+    if (mWindow) {
+	mWaitingForFrame.storeRelease(1);
+	QMetaObject::invokeMethod(mWindow, "update", Qt::QueuedConnection);
+    }
+
+#ifdef POWER_HARDWARE_MODULE_ID
+    if (gPowerModule && gPowerModule->setInteractive)
+	gPowerModule->setInteractive(gPowerModule, true);
+#endif
+    mWakeTrace[WAKE_INTERACTIVE] = systemTime(SYSTEM_TIME_MONOTONIC);
+}
+
+/*
+   Runs in the scene graph render thread
+*/
+
+void ScreenControl::frameSwapped()
+{
+    if (mWaitingForFrame.testAndSetOrdered(1, 0)) {
+	mWakeTrace[WAKE_FRAME] = systemTime(SYSTEM_TIME_MONOTONIC);
+	emit wakeLatencyChanged();
+    }
+}
+
+int ScreenControl::wakeLatency() const
+{
+    if (!mWakeTrace[WAKE_FRAME] || mWakeTrace[WAKE_FRAME] < mWakeTrace[WAKE_KEY_EVENT])
+	return -1;
+    return ns2ms(mWakeTrace[WAKE_FRAME] - mWakeTrace[WAKE_KEY_EVENT]);
+}
+
+/*!
+  Return the phases of the last fast-path wake in milliseconds,
+  relative to the power key event time.
+ */
+
+QVariantMap ScreenControl::wakeTimings() const
+{
+    static const char *names[] = { "keyEvent", "fastPath", "autosuspend", "interactive",
+				   "backlight", "frame" };
+    QVariantMap result;
+    qint64 base = mWakeTrace[WAKE_KEY_EVENT];
+    if (!base)
+	return result;
+    for (int i = 0 ; i < _WAKE_PHASE_COUNT ; i++) {
+	if (i == WAKE_BACKLIGHT && !mBacklightDone.loadAcquire())
+	    continue;
+	if (mWakeTrace[i] >= base)
+	    result.insert(QString::fromLatin1(names[i]), ns2us(mWakeTrace[i] - base) / 1000.0);
+    }
+    return result;
+}
+
+void ScreenControl::setState(SystemState state, TransitionCause cause)
 {
     if (state != mState) {
 //	qDebug() << Q_FUNC_INFO << "Setting state" << (int) mState << "->" << (int) state;
+	PowerStats::instance()->recordTransition(mState, state, cause);
 	mState = state;
 	mTimer->stop();
 	switch (mState) {
 	case NORMAL:
-	    set_screen_state(1);
-	    Lights::instance()->setBrightness( Lights::BACKLIGHT, 200 );
+	    mHardwareAwake.store(1);
+	    if (!mFastWake.fetchAndStoreOrdered(0)) {
+		set_screen_state(1);
+		Lights::instance()->setBrightness( Lights::BACKLIGHT, brightness(kNormalBrightness) );
+	    }
 	    if (!mScreenLockOn && mDimTimeout > 0)
 		mTimer->start(mDimTimeout);
 	    break;
 	case DIM:
+	    mHardwareAwake.store(1);
+	    mFastWake.store(0);
 	    set_screen_state(1);
-	    Lights::instance()->setBrightness( Lights::BACKLIGHT, 20 );
+	    Lights::instance()->setBrightness( Lights::BACKLIGHT, brightness(kDimBrightness) );
 	    mTimer->start(mSleepTimeout);
 	    break;
 	case SLEEP:
 	    set_screen_state(0);
 	    Lights::instance()->setBrightness( Lights::BACKLIGHT, 0 );
+	    mHardwareAwake.store(0);
 	    break;
 	}
 	emit stateChanged();
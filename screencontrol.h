@@ -6,25 +6,39 @@
 #define _SCREEN_CONTROL_H
 
 #include <QObject>
+#include <QAtomicInt>
+#include <QVariantMap>
 
 class InputHandler;
+class QQuickWindow;
 class QTimer;
 
 class ScreenControl : public QObject
 {
     Q_OBJECT
     Q_ENUMS(SystemState)
+    Q_ENUMS(TransitionCause)
+    Q_ENUMS(KeyPress)
     Q_PROPERTY(int dimTimeout READ dimTimeout WRITE setDimTimeout NOTIFY dimTimeoutChanged)
     Q_PROPERTY(int sleepTimeout READ sleepTimeout WRITE setSleepTimeout NOTIFY sleepTimeoutChanged)
     Q_PROPERTY(bool screenLockOn READ screenLockOn WRITE setScreenLockOn NOTIFY screenLockOnChanged)
+    Q_PROPERTY(int longPressTimeout READ longPressTimeout WRITE setLongPressTimeout NOTIFY longPressTimeoutChanged)
+    Q_PROPERTY(int veryLongPressTimeout READ veryLongPressTimeout WRITE setVeryLongPressTimeout NOTIFY veryLongPressTimeoutChanged)
     Q_PROPERTY(SystemState state READ state NOTIFY stateChanged)
+    Q_PROPERTY(int wakeLatency READ wakeLatency NOTIFY wakeLatencyChanged)
+    Q_PROPERTY(int maxBrightness READ maxBrightness WRITE setMaxBrightness NOTIFY maxBrightnessChanged)
 
 public:
     enum SystemState { NORMAL, DIM, SLEEP };
+    enum TransitionCause { CAUSE_STARTUP, CAUSE_TIMEOUT, CAUSE_POWER_KEY, CAUSE_USER_ACTIVITY,
+			   CAUSE_GO_TO_SLEEP, CAUSE_SCREEN_LOCK, _CAUSE_COUNT };
+    enum KeyPress { SHORT_PRESS, LONG_PRESS, VERY_LONG_PRESS };
 
     static ScreenControl *instance();
     ~ScreenControl();
 
+    void         setWindow(QQuickWindow *window);
+
     int          dimTimeout() const { return mDimTimeout; }
     void         setDimTimeout(int);
     
@@ -34,24 +48,50 @@ public:
     bool         screenLockOn() const { return mScreenLockOn; }
     void         setScreenLockOn(bool);
     
+    int          longPressTimeout() const { return mLongPressTimeout; }
+    void         setLongPressTimeout(int);
+
+    int          veryLongPressTimeout() const { return mVeryLongPressTimeout; }
+    void         setVeryLongPressTimeout(int);
+
     SystemState  state() const { return mState; }
 
+    // Upper bound on the backlight level (thermal throttling)
+    int          maxBrightness() const { return mMaxBrightness.load(); }
+    void         setMaxBrightness(int);
+
+    int          wakeLatency() const;   // Power key event to first frame, in ms (-1 if unknown)
+    Q_INVOKABLE QVariantMap wakeTimings() const;
+
     Q_INVOKABLE void userActivity(int ms = 1000);
     Q_INVOKABLE void goToSleep();
-    void         powerKey(int value);
+    void         powerKey(int value, qint64 eventTime);   // eventTime in ns, SYSTEM_TIME_MONOTONIC
+    void         wakeFastPath(qint64 eventTime);          // Called from the InputReader thread
 
 signals:
     void         dimTimeoutChanged();
     void         sleepTimeoutChanged();
     void         screenLockOnChanged();
     void         stateChanged();
+    void         longPressTimeoutChanged();
+    void         veryLongPressTimeoutChanged();
+    void         powerMenuRequested();
+    void         forcedRebootRequested();
+    void         wakeLatencyChanged();
+    void         maxBrightnessChanged();
 
 private:
     ScreenControl();
-    void         setState(SystemState);
+    void         setState(SystemState, TransitionCause);
+    void         classifyPowerKey(qint64 now);
+    void         armPowerKeyTimer(qint64 now);
+    int          brightness(int level) const;
 		   
 private slots:
     void         timeout();
+    void         handlePowerKey(int value, qint64 eventTime);
+    void         powerKeyTimeout();
+    void         frameSwapped();
 
 private:
     int          mDimTimeout;
@@ -59,6 +99,25 @@ private:
     bool         mScreenLockOn;
     SystemState  mState;
     QTimer      *mTimer;
+    QAtomicInt   mMaxBrightness;    // Read by the backlight pool thread
+
+    // Power key hold-time classifier
+    int          mLongPressTimeout;
+    int          mVeryLongPressTimeout;
+    qint64       mKeyDownTime;    // -1 when the key is up
+    KeyPress     mKeyPress;       // Classification reached so far
+    bool         mKeyWoke;        // This press woke the screen
+    QTimer      *mKeyTimer;
+
+    // Wake fast path
+    enum WakePhase { WAKE_KEY_EVENT, WAKE_FAST_PATH, WAKE_AUTOSUSPEND, WAKE_INTERACTIVE,
+		     WAKE_BACKLIGHT, WAKE_FRAME, _WAKE_PHASE_COUNT };
+    QQuickWindow *mWindow;
+    QAtomicInt   mHardwareAwake;    // Display hardware is on (NORMAL or DIM)
+    QAtomicInt   mFastWake;         // The fast path already did the hardware work
+    QAtomicInt   mWaitingForFrame;
+    QAtomicInt   mBacklightDone;
+    qint64       mWakeTrace[_WAKE_PHASE_COUNT];
 };
 
 #endif // _SCREEN_CONTROL_H
@@ -0,0 +1,543 @@
+/*
+  Low latency mixer for short UI sounds
+ */
+
+#include "soundmixer.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <media/AudioTrack.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include <QDebug>
+
+using namespace android;
+
+const int kMaxClipSeconds = 5;   // Longer files are not UI sounds
+
+// --------------------------------------------------------------------------------
+
+/*
+  WAV files are little endian, as is every target we run on, so the
+  header fields are read in place.
+ */
+
+static quint32 le32(const uchar *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24); }
+static quint16 le16(const uchar *p) { return p[0] | (p[1] << 8); }
+
+SoundClip::SoundClip(const QString& path)
+    : mFile(path)
+    , mFrames(0)
+    , mFrameCount(0)
+{
+}
+
+SoundClip::~SoundClip()
+{
+    mFile.close();   // Drops the map
+}
+
+SoundClip *SoundClip::load(const QString& path)
+{
+    SoundClip *clip = new SoundClip(path);
+    if (!clip->mFile.open(QIODevice::ReadOnly)) {
+	qWarning() << "Unable to open sound" << path;
+	delete clip;
+	return 0;
+    }
+    qint64 size = clip->mFile.size();
+    const uchar *data = size >= 12 ? clip->mFile.map(0, size) : 0;
+    if (!data || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WAVE", 4)) {
+	qWarning() << "Not a WAV file" << path;
+	delete clip;
+	return 0;
+    }
+
+    // Find the format and the samples; chunks are padded to even sizes
+    int channels = 0, rate = 0, bits = 0, format = 0;
+    const uchar *samples = 0;
+    quint32 sampleBytes = 0;
+    qint64 pos = 12;
+    while (pos + 8 <= size) {
+	quint32 chunkSize = le32(data + pos + 4);
+	const uchar *chunk = data + pos + 8;
+	if (chunkSize > size - pos - 8)
+	    chunkSize = size - pos - 8;
+	if (!memcmp(data + pos, "fmt ", 4) && chunkSize >= 16) {
+	    format   = le16(chunk);
+	    channels = le16(chunk + 2);
+	    rate     = le32(chunk + 4);
+	    bits     = le16(chunk + 14);
+	}
+	else if (!memcmp(data + pos, "data", 4)) {
+	    samples = chunk;
+	    sampleBytes = chunkSize;
+	}
+	pos += 8 + chunkSize + (chunkSize & 1);
+    }
+
+    if (format != 1 || (channels != 1 && channels != 2) || (bits != 8 && bits != 16) ||
+	rate <= 0 || !samples) {
+	qWarning() << "Unsupported WAV format in" << path;
+	delete clip;
+	return 0;
+    }
+
+    int inFrames = sampleBytes / (channels * bits / 8);
+    if (inFrames > kMaxClipSeconds * rate) {
+	qWarning() << "Sound is too long for the mixer" << path;
+	delete clip;
+	return 0;
+    }
+
+    if (channels == 2 && bits == 16 && rate == SoundMixer::kRate &&
+	!(reinterpret_cast<quintptr>(samples) & 1)) {
+	// Already in the mixer format: play it from the map
+	clip->mFrames = reinterpret_cast<const qint16 *>(samples);
+	clip->mFrameCount = inFrames;
+	return clip;
+    }
+
+    // Convert to stereo 16 bit at the mixer rate, interpolating linearly.
+    // The fraction is taken down to Q15 so the product with a full
+    // scale sample difference still fits in 32 bits.
+    int outFrames = qint64(inFrames) * SoundMixer::kRate / rate;
+    clip->mConverted.resize(outFrames * 2);
+    qint16 *out = clip->mConverted.data();
+    for (int i = 0 ; i < outFrames ; i++) {
+	qint64 fixed = (qint64(i) * rate << 16) / SoundMixer::kRate;   // 16.16 input position
+	int index = fixed >> 16;
+	int frac = (fixed & 0xffff) >> 1;
+	int next = qMin(index + 1, inFrames - 1);
+	for (int c = 0 ; c < 2 ; c++) {
+	    int ch = qMin(c, channels - 1);
+	    int a, b;
+	    if (bits == 16) {
+		a = qint16(le16(samples + (index * channels + ch) * 2));
+		b = qint16(le16(samples + (next * channels + ch) * 2));
+	    }
+	    else {
+		a = (samples[index * channels + ch] - 128) << 8;
+		b = (samples[next * channels + ch] - 128) << 8;
+	    }
+	    out[i * 2 + c] = a + (((b - a) * frac) >> 15);
+	}
+    }
+    clip->mFile.close();
+    clip->mFrames = out;
+    clip->mFrameCount = outFrames;
+    return clip;
+}
+
+// --------------------------------------------------------------------------------
+
+bool NullSoundSink::open(int rate, int)
+{
+    mRate = rate;
+    return true;
+}
+
+void NullSoundSink::start()
+{
+    mClock.start();
+    mNext = 0;
+}
+
+bool NullSoundSink::write(const qint16 *, int frames)
+{
+    if (!mClock.isValid())
+	start();
+    qint64 wait = mNext - mClock.nsecsElapsed();
+    if (wait > 0)
+	usleep(wait / 1000);
+    else
+	mNext = mClock.nsecsElapsed();   // Fell behind; don't try to catch up
+    mNext += qint64(frames) * 1000000000 / mRate;
+    return true;
+}
+
+// --------------------------------------------------------------------------------
+
+WavFileSoundSink::WavFileSoundSink(const QString& path)
+    : mFile(path)
+    , mRate(0)
+    , mBytes(0)
+{
+}
+
+WavFileSoundSink::~WavFileSoundSink()
+{
+    if (mFile.isOpen()) {
+	writeHeader();
+	mFile.close();
+    }
+}
+
+bool WavFileSoundSink::open(int rate, int frames)
+{
+    if (!mFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+	qWarning() << "Unable to write" << mFile.fileName();
+	return false;
+    }
+    mRate = rate;
+    writeHeader();
+    mStopped.start();
+    return NullSoundSink::open(rate, frames);
+}
+
+/*
+  The mixer stops the sink when it goes idle, which may be the last
+  thing it does, so the header is brought up to date here.  The time
+  spent stopped is written out as silence on the next start, to keep
+  the file's timeline the same as the real one.
+ */
+
+void WavFileSoundSink::start()
+{
+    if (mStopped.isValid() && mFile.isOpen()) {
+	static const qint16 kSilence[1024 * 2] = { 0 };
+	qint64 frames = mStopped.elapsed() * mRate / 1000;
+	while (frames > 0) {
+	    int n = qMin(frames, qint64(1024));
+	    if (mFile.write(reinterpret_cast<const char *>(kSilence), n * 4) != n * 4)
+		break;
+	    mBytes += n * 4;
+	    frames -= n;
+	}
+	mStopped.invalidate();
+    }
+    NullSoundSink::start();
+}
+
+void WavFileSoundSink::stop()
+{
+    if (mFile.isOpen()) {
+	writeHeader();
+	mFile.flush();
+    }
+    mStopped.start();
+}
+
+bool WavFileSoundSink::write(const qint16 *data, int frames)
+{
+    qint64 bytes = qint64(frames) * 4;
+    if (mFile.write(reinterpret_cast<const char *>(data), bytes) != bytes)
+	return false;
+    mBytes += bytes;
+    return NullSoundSink::write(data, frames);
+}
+
+void WavFileSoundSink::writeHeader()
+{
+    struct {
+	char    riff[4];
+	quint32 riffSize;
+	char    wave[4], fmt[4];
+	quint32 fmtSize;
+	quint16 format, channels;
+	quint32 rate, byteRate;
+	quint16 blockAlign, bits;
+	char    data[4];
+	quint32 dataSize;
+    } header;
+
+    memcpy(header.riff, "RIFF", 4);
+    header.riffSize   = 36 + mBytes;
+    memcpy(header.wave, "WAVE", 4);
+    memcpy(header.fmt, "fmt ", 4);
+    header.fmtSize    = 16;
+    header.format     = 1;
+    header.channels   = 2;
+    header.rate       = mRate;
+    header.byteRate   = mRate * 4;
+    header.blockAlign = 4;
+    header.bits       = 16;
+    memcpy(header.data, "data", 4);
+    header.dataSize   = mBytes;
+
+    qint64 pos = mFile.pos();
+    mFile.seek(0);
+    mFile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    if (pos > qint64(sizeof(header)))
+	mFile.seek(pos);
+}
+
+// --------------------------------------------------------------------------------
+
+class AudioTrackSoundSink : public SoundSink
+{
+public:
+    bool open(int rate, int frames) {
+#if defined(SHORT_PLATFORM_VERSION) && (SHORT_PLATFORM_VERSION == 44)
+	size_t minFrames = 0;
+#else
+	int minFrames = 0;
+#endif
+	AudioTrack::getMinFrameCount(&minFrames, AUDIO_STREAM_SYSTEM, rate);
+	mTrack = new AudioTrack(AUDIO_STREAM_SYSTEM, rate, AUDIO_FORMAT_PCM_16_BIT,
+				AUDIO_CHANNEL_OUT_STEREO, qMax(int(minFrames), 2 * frames),
+#if defined(SHORT_PLATFORM_VERSION) && (SHORT_PLATFORM_VERSION == 40)
+				0);
+#else
+				AUDIO_OUTPUT_FLAG_NONE);
+#endif
+	if (mTrack->initCheck() != NO_ERROR) {
+	    qWarning("Unable to create an AudioTrack for the sound mixer");
+	    mTrack.clear();
+	    return false;
+	}
+	return true;
+    }
+
+    void start() { mTrack->start(); }
+    void stop() { mTrack->stop(); }
+
+    bool write(const qint16 *data, int frames) {
+	size_t bytes = frames * 4;
+	return mTrack->write(data, bytes) == (ssize_t) bytes;
+    }
+
+    int latency() const { return mTrack->latency(); }
+
+private:
+    sp<AudioTrack> mTrack;
+};
+
+// --------------------------------------------------------------------------------
+
+/*
+  The mixing kernels work on interleaved samples.  Voices are summed
+  into 32 bit accumulators and saturated to 16 bits once per block.
+ */
+
+static void mixInto(qint32 *acc, const qint16 *src, int samples, qint16 gain)
+{
+    int i = 0;
+#ifdef __ARM_NEON__
+    int16x4_t g = vdup_n_s16(gain);
+    for ( ; i + 8 <= samples ; i += 8) {
+	int16x8_t s = vld1q_s16(src + i);
+	int32x4_t lo = vld1q_s32(acc + i);
+	int32x4_t hi = vld1q_s32(acc + i + 4);
+	lo = vaddq_s32(lo, vshrq_n_s32(vmull_s16(vget_low_s16(s), g), 15));
+	hi = vaddq_s32(hi, vshrq_n_s32(vmull_s16(vget_high_s16(s), g), 15));
+	vst1q_s32(acc + i, lo);
+	vst1q_s32(acc + i + 4, hi);
+    }
+#endif
+    for ( ; i < samples ; i++)
+	acc[i] += (src[i] * gain) >> 15;
+}
+
+static void saturate(qint16 *out, const qint32 *acc, int samples)
+{
+    int i = 0;
+#ifdef __ARM_NEON__
+    for ( ; i + 8 <= samples ; i += 8) {
+	int16x4_t lo = vqmovn_s32(vld1q_s32(acc + i));
+	int16x4_t hi = vqmovn_s32(vld1q_s32(acc + i + 4));
+	vst1q_s16(out + i, vcombine_s16(lo, hi));
+    }
+#endif
+    for ( ; i < samples ; i++)
+	out[i] = qBound(-32768, acc[i], 32767);
+}
+
+// --------------------------------------------------------------------------------
+
+SoundSink *SoundMixer::sSink = 0;
+
+void SoundMixer::setSink(SoundSink *sink)
+{
+    sSink = sink;
+}
+
+SoundMixer *SoundMixer::instance()
+{
+    static QMutex _sSoundMixerInstance;
+    static SoundMixer *_s_sound_mixer = 0;
+
+    QMutexLocker _l(&_sSoundMixerInstance);
+    if (!_s_sound_mixer) {
+	_s_sound_mixer = new SoundMixer(sSink ? sSink : new AudioTrackSoundSink);
+	_s_sound_mixer->start(QThread::TimeCriticalPriority);
+    }
+    return _s_sound_mixer;
+}
+
+SoundMixer::SoundMixer(SoundSink *sink)
+    : mSink(sink)
+    , mFailed(false)
+{
+    mClock.start();
+    resetLatencyStats();
+}
+
+QSharedPointer<SoundClip> SoundMixer::clip(const QString& path)
+{
+    QMutexLocker _l(&mCacheLock);
+    QSharedPointer<SoundClip> result = mCache.value(path).toStrongRef();
+    if (!result) {
+	SoundClip *clip = SoundClip::load(path);
+	if (clip) {
+	    result = QSharedPointer<SoundClip>(clip);
+	    mCache.insert(path, result);
+	}
+    }
+    return result;
+}
+
+void SoundMixer::play(const QSharedPointer<SoundClip>& clip, qreal volume)
+{
+    if (!clip || clip->frameCount() == 0)
+	return;
+
+    Voice voice;
+    voice.clip = clip;
+    voice.position = 0;
+    voice.gain = qRound(qBound(qreal(0), volume, qreal(1)) * 32767);
+    voice.requested = mClock.nsecsElapsed();
+
+    QMutexLocker _l(&mLock);
+    if (mFailed)
+	return;
+    mPending.append(voice);
+    mWake.wakeOne();
+}
+
+QVariantMap SoundMixer::latencyStats() const
+{
+    QMutexLocker _l(&mLock);
+    QVariantMap result;
+    result.insert(QStringLiteral("count"), mStats.count);
+    result.insert(QStringLiteral("meanUs"),
+		  mStats.count ? mStats.totalNs / 1000.0 / mStats.count : 0.0);
+    result.insert(QStringLiteral("minUs"), mStats.count ? mStats.minNs / 1000.0 : 0.0);
+    result.insert(QStringLiteral("maxUs"), mStats.maxNs / 1000.0);
+    result.insert(QStringLiteral("lastUs"), mStats.lastNs / 1000.0);
+    result.insert(QStringLiteral("sinkLatencyMs"), mSink->latency());
+    return result;
+}
+
+void SoundMixer::resetLatencyStats()
+{
+    QMutexLocker _l(&mLock);
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+void SoundMixer::run()
+{
+    if (!mSink->open(kRate, kBlockFrames)) {
+	QMutexLocker _l(&mLock);
+	mFailed = true;
+	mPending.clear();
+	return;
+    }
+
+    qint32 acc[kBlockFrames * 2];
+    qint16 out[kBlockFrames * 2];
+    bool running = false;
+    int idle = 0;
+
+    while (true) {
+	mLock.lock();
+	if (mVoices.isEmpty() && mPending.isEmpty() && (!running || idle >= kIdleBlocks)) {
+	    mLock.unlock();
+	    if (running) {
+		mSink->stop();
+		running = false;
+	    }
+	    mLock.lock();
+	    while (mPending.isEmpty())
+		mWake.wait(&mLock);
+	}
+	mVoices += mPending;
+	mPending.clear();
+	mLock.unlock();
+
+	// Too many voices: the oldest ones give way
+	while (mVoices.size() > kMaxVoices)
+	    mVoices.removeFirst();
+
+	if (!running) {
+	    mSink->start();
+	    running = true;
+	}
+	idle = mVoices.isEmpty() ? idle + 1 : 0;
+
+	memset(acc, 0, sizeof(acc));
+	for (int i = 0 ; i < mVoices.size() ; i++) {
+	    Voice& voice(mVoices[i]);
+	    int frames = qMin(int(kBlockFrames), voice.clip->frameCount() - voice.position);
+	    mixInto(acc, voice.clip->frames() + voice.position * 2, frames * 2, voice.gain);
+	    voice.position += frames;
+	}
+	saturate(out, acc, kBlockFrames * 2);
+	mSink->write(out, kBlockFrames);
+
+	qint64 now = mClock.nsecsElapsed();
+	qint64 sinkNs = qint64(mSink->latency()) * 1000000;
+	mLock.lock();
+	for (int i = mVoices.size() - 1 ; i >= 0 ; i--) {
+	    Voice& voice(mVoices[i]);
+	    if (voice.requested) {
+		qint64 ns = now - voice.requested + sinkNs;
+		if (!mStats.count || ns < mStats.minNs)
+		    mStats.minNs = ns;
+		mStats.maxNs = qMax(mStats.maxNs, ns);
+		mStats.totalNs += ns;
+		mStats.lastNs = ns;
+		mStats.count++;
+		voice.requested = 0;
+	    }
+	    if (voice.position >= voice.clip->frameCount())
+		mVoices.removeAt(i);
+	}
+	mLock.unlock();
+    }
+}
+
+// --------------------------------------------------------------------------------
+
+SoundEffect::SoundEffect(QObject *parent)
+    : QObject(parent)
+    , mVolume(1.0)
+{
+}
+
+/*
+  Loading a short clip is a map and at most a small conversion, so it
+  is done here rather than on another thread.
+ */
+
+void SoundEffect::setSource(const QUrl& url)
+{
+    if (url == mUrl)
+	return;
+
+    bool wasLoaded = loaded();
+    mUrl = url;
+    mClip.clear();
+    if (mUrl.isLocalFile())
+	mClip = SoundMixer::instance()->clip(mUrl.toLocalFile());
+    emit sourceChanged();
+    if (loaded() != wasLoaded)
+	emit loadedChanged();
+}
+
+void SoundEffect::setVolume(qreal volume)
+{
+    if (volume != mVolume) {
+	mVolume = volume;
+	emit volumeChanged();
+    }
+}
+
+void SoundEffect::play()
+{
+    SoundMixer::instance()->play(mClip, mVolume);
+}
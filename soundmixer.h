@@ -0,0 +1,196 @@
+/*
+  Low latency mixer for short UI sounds
+
+  Key clicks and other short sounds are decoded once and mixed in
+  process, instead of going through a MediaPlayer for every play.
+ */
+
+#ifndef _SOUND_MIXER_H
+#define _SOUND_MIXER_H
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QThread>
+#include <QUrl>
+#include <QVariantMap>
+#include <QVector>
+#include <QWaitCondition>
+#include <QWeakPointer>
+
+/*
+  A sound as 16 bit stereo frames at the mixer rate.  A WAV file that
+  is already in that format is played straight from a memory map;
+  anything else (mono, 8 bit, another rate) is converted once.
+ */
+
+class SoundClip
+{
+public:
+    static SoundClip *load(const QString& path);   // 0 on failure
+    ~SoundClip();
+
+    const qint16 *frames() const { return mFrames; }
+    int           frameCount() const { return mFrameCount; }
+
+private:
+    SoundClip(const QString& path);
+
+    QFile         mFile;        // Holds the map, if there is one
+    QVector<qint16> mConverted;
+    const qint16 *mFrames;
+    int           mFrameCount;
+};
+
+/*
+  Where mixed audio goes.  write() blocks until the block is queued,
+  which is what paces the mixer.
+ */
+
+class SoundSink
+{
+public:
+    virtual ~SoundSink() {}
+
+    virtual bool open(int rate, int frames) = 0;   // Stereo, 16 bit, 'frames' per write()
+    virtual void start() {}
+    virtual void stop() {}
+    virtual bool write(const qint16 *data, int frames) = 0;
+    virtual int  latency() const { return 0; }     // ms from write() to the speaker
+};
+
+// Discards the audio, in real time
+class NullSoundSink : public SoundSink
+{
+public:
+    NullSoundSink() : mRate(0), mNext(0) {}
+
+    bool open(int rate, int frames);
+    void start();
+    bool write(const qint16 *data, int frames);
+
+private:
+    int           mRate;
+    QElapsedTimer mClock;
+    qint64        mNext;        // ns on mClock when the next block is due
+};
+
+// Writes the audio to a WAV file, in real time, for host testing
+class WavFileSoundSink : public NullSoundSink
+{
+public:
+    WavFileSoundSink(const QString& path);
+    ~WavFileSoundSink();
+
+    bool open(int rate, int frames);
+    void start();
+    void stop();
+    bool write(const qint16 *data, int frames);
+
+private:
+    void          writeHeader();
+
+    QFile         mFile;
+    int           mRate;
+    quint32       mBytes;
+    QElapsedTimer mStopped;     // Valid while the sink is stopped
+};
+
+/*
+  Mixes up to kMaxVoices clips into the sink on its own thread, in
+  blocks of kBlockFrames.  play() may be called from any thread.  The
+  sink is kept running through kIdleBlocks of silence after the last
+  voice ends, so a burst of key clicks does not restart it each time.
+
+  Latency is measured per voice from play() to the write() of the
+  block holding its first frame, plus the sink's own latency.
+ */
+
+class SoundMixer : public QThread
+{
+    Q_OBJECT
+public:
+    enum { kRate = 44100, kBlockFrames = 256, kMaxVoices = 16 };
+    enum { kIdleBlocks = 172 };   // About a second
+
+    static SoundMixer *instance();
+    static void  setSink(SoundSink *sink);   // Call before instance(); takes ownership
+
+    // Shared with every other user of the same file
+    QSharedPointer<SoundClip> clip(const QString& path);
+
+    void         play(const QSharedPointer<SoundClip>& clip, qreal volume);
+
+    Q_INVOKABLE QVariantMap latencyStats() const;
+    Q_INVOKABLE void        resetLatencyStats();
+
+protected:
+    void         run();
+
+private:
+    SoundMixer(SoundSink *sink);
+
+    struct Voice {
+	QSharedPointer<SoundClip> clip;
+	int      position;      // Frames already mixed
+	qint16   gain;          // Q15
+	qint64   requested;     // ns on mClock; 0 once measured
+    };
+
+    static SoundSink *sSink;
+
+    SoundSink     *mSink;
+    QElapsedTimer  mClock;
+
+    QMutex         mCacheLock;
+    QHash<QString, QWeakPointer<SoundClip> > mCache;
+
+    mutable QMutex mLock;
+    QWaitCondition mWake;
+    QList<Voice>   mPending;    // From play(), not yet picked up
+    bool           mFailed;     // The sink wouldn't open
+
+    struct LatencyStats {
+	int     count;
+	qint64  totalNs, minNs, maxNs, lastNs;
+    } mStats;                   // Guarded by mLock
+
+    QList<Voice>   mVoices;     // Mixer thread only
+};
+
+/*
+  QML handle for a short sound played through the SoundMixer
+ */
+
+class SoundEffect : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(QUrl source READ source WRITE setSource NOTIFY sourceChanged)
+    Q_PROPERTY(qreal volume READ volume WRITE setVolume NOTIFY volumeChanged)
+    Q_PROPERTY(bool loaded READ loaded NOTIFY loadedChanged)
+
+public:
+    SoundEffect(QObject *parent=0);
+
+    QUrl     source() const { return mUrl; }
+    void     setSource(const QUrl& url);
+    qreal    volume() const { return mVolume; }
+    void     setVolume(qreal volume);
+    bool     loaded() const { return !mClip.isNull(); }
+
+    Q_INVOKABLE void play();
+
+signals:
+    void     sourceChanged();
+    void     volumeChanged();
+    void     loadedChanged();
+
+private:
+    QUrl     mUrl;
+    qreal    mVolume;
+    QSharedPointer<SoundClip> mClip;
+};
+
+#endif // _SOUND_MIXER_H
@@ -0,0 +1,115 @@
+/*
+  Sysfs attribute reader
+ */
+
+#include "sysfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// --------------------------------------------------------------------------------
+
+SysfsAttribute::SysfsAttribute()
+    : mFd(-1)
+{
+}
+
+SysfsAttribute::~SysfsAttribute()
+{
+    close();
+}
+
+void SysfsAttribute::setPath(const QString& path)
+{
+    close();
+    mPath = path.toLocal8Bit();
+}
+
+bool SysfsAttribute::open()
+{
+    if (mFd >= 0)
+	return true;
+    if (mPath.isEmpty())
+	return false;
+    do {
+	mFd = ::open(mPath.constData(), O_RDONLY | O_CLOEXEC);
+    } while (mFd < 0 && errno == EINTR);
+    return mFd >= 0;
+}
+
+void SysfsAttribute::close()
+{
+    if (mFd >= 0) {
+	::close(mFd);
+	mFd = -1;
+    }
+}
+
+int SysfsAttribute::read(char *buf, int size)
+{
+    if (size < 1)
+	return -1;
+    buf[0] = 0;
+    if (size < 2)
+	return -1;
+
+    // One retry with a fresh descriptor covers a device that was
+    // removed and re-added since the last read.
+    for (int attempt = 0 ; attempt < 2 ; attempt++) {
+	if (!open())
+	    return -1;
+
+	ssize_t n;
+	do {
+	    n = ::pread(mFd, buf, size - 1, 0);
+	} while (n < 0 && errno == EINTR);
+
+	if (n >= 0) {
+	    while (n > 0 && (buf[n-1] == '\n' || buf[n-1] == ' ' || buf[n-1] == '\t'))
+		n--;
+	    buf[n] = 0;
+	    return n;
+	}
+	close();
+    }
+    return -1;
+}
+
+bool SysfsAttribute::readBool(bool defvalue)
+{
+    char buf[kMaxValue];
+    if (read(buf, sizeof(buf)) <= 0)
+	return defvalue;
+    return buf[0] != '0';
+}
+
+int SysfsAttribute::readInt(int defvalue)
+{
+    char buf[kMaxValue];
+    if (read(buf, sizeof(buf)) <= 0)
+	return defvalue;
+    return parseInt(buf, defvalue);
+}
+
+/*
+  Parse a decimal integer with optional leading whitespace and sign.
+ */
+
+int SysfsAttribute::parseInt(const char *str, int defvalue)
+{
+    while (*str == ' ' || *str == '\t')
+	str++;
+
+    bool negative = false;
+    if (*str == '-' || *str == '+')
+	negative = (*str++ == '-');
+
+    if (*str < '0' || *str > '9')
+	return defvalue;
+
+    int value = 0;
+    while (*str >= '0' && *str <= '9')
+	value = value * 10 + (*str++ - '0');
+    return negative ? -value : value;
+}
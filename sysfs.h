@@ -0,0 +1,50 @@
+/*
+  Sysfs attribute reader
+ */
+
+#ifndef _SYSFS_H
+#define _SYSFS_H
+
+#include <QByteArray>
+#include <QString>
+
+/*
+  A single sysfs attribute file.  The file is opened on first use and
+  kept open; every read is a pread() from offset zero, which makes the
+  kernel regenerate the value.  If the device goes away the descriptor
+  is dropped and the path is re-opened on the next read.
+ */
+
+class SysfsAttribute
+{
+public:
+    enum { kMaxValue = 128 };
+
+    SysfsAttribute();
+    ~SysfsAttribute();
+
+    void        setPath(const QString& path);
+    bool        isValid() const { return !mPath.isEmpty(); }
+    const QByteArray& path() const { return mPath; }
+
+    // Read the value into 'buf' with trailing whitespace removed.
+    // Returns the length or -1 on failure; 'buf' is always NUL terminated.
+    int         read(char *buf, int size);
+
+    bool        readBool(bool defvalue = false);
+    int         readInt(int defvalue = 0);
+
+    static int  parseInt(const char *str, int defvalue = 0);
+
+private:
+    SysfsAttribute(const SysfsAttribute&);
+    SysfsAttribute& operator=(const SysfsAttribute&);
+
+    bool        open();
+    void        close();
+
+    QByteArray  mPath;
+    int         mFd;
+};
+
+#endif // _SYSFS_H
@@ -0,0 +1,223 @@
+/*
+  Thermal zone monitor.
+
+  Each thermal_zone directory has a "temp" attribute and a set of
+  trip_point_N_temp / trip_point_N_type pairs.  The zones are polled;
+  the interval shrinks as any zone gets close to its next trip point
+  and while we are throttling.  A trip point is crossed at its
+  temperature and released kHysteresis below it.
+
+  The throttle level is the highest level of any crossed trip point:
+  active trips map to LIGHT, passive to MODERATE, hot and critical to
+  SEVERE.
+ */
+
+#include "thermalmonitor.h"
+#include "framegovernor.h"
+#include "screencontrol.h"
+
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QVariantMap>
+
+// --------------------------------------------------------------------------------
+
+static const int kHysteresis = 2000;   // Millidegrees
+
+// Poll faster the closer the hottest zone is to its next trip point
+static const struct {
+    int margin;     // Millidegrees below the next trip point
+    int interval;   // ms
+} kPollIntervals[] = {
+    {  2000,  1000 },
+    {  5000,  2000 },
+    { 10000,  5000 },
+    {     0, 15000 },   // Anything further away
+};
+
+// What the shell is asked to do at each throttle level
+static const struct {
+    int frameRate;
+    int brightness;
+} kThrottleActions[] = {
+    { 60, 255 },   // THROTTLE_NONE
+    { 30, 160 },   // THROTTLE_LIGHT
+    { 15, 100 },   // THROTTLE_MODERATE
+    { 15,  40 },   // THROTTLE_SEVERE
+};
+
+QString ThermalMonitor::sSysfsRoot(QStringLiteral("/sys/class/thermal"));
+
+ThermalMonitor *ThermalMonitor::instance()
+{
+    static ThermalMonitor *_s_thermal_monitor = 0;
+    if (!_s_thermal_monitor)
+	_s_thermal_monitor = new ThermalMonitor;
+    return _s_thermal_monitor;
+}
+
+void ThermalMonitor::setSysfsRoot(const QString& path)
+{
+    sSysfsRoot = path;
+}
+
+static ThermalMonitor::ThrottleLevel levelForTripType(const QByteArray& type)
+{
+    if (type == "active")
+	return ThermalMonitor::THROTTLE_LIGHT;
+    if (type == "passive")
+	return ThermalMonitor::THROTTLE_MODERATE;
+    return ThermalMonitor::THROTTLE_SEVERE;   // "hot", "critical"
+}
+
+static QByteArray readFile(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+	return QByteArray();
+    return file.readLine().trimmed();
+}
+
+ThermalMonitor::ThermalMonitor()
+    : mLevel(THROTTLE_NONE)
+    , mTemperature(0)
+    , mThrottling(true)
+{
+    QDirIterator it(sSysfsRoot, QStringList() << QStringLiteral("thermal_zone*"), QDir::Dirs);
+    while (it.hasNext()) {
+	QDir d(it.next());
+	if (!d.exists(QStringLiteral("temp")))
+	    continue;
+
+	Zone *zone = new Zone;
+	zone->name = QString::fromLatin1(readFile(d.filePath(QStringLiteral("type"))));
+	if (zone->name.isEmpty())
+	    zone->name = it.fileName();
+	zone->temp.setPath(d.filePath(QStringLiteral("temp")));
+	zone->temperature = 0;
+
+	for (int i = 0 ; ; i++) {
+	    QString prefix = QStringLiteral("trip_point_%1_").arg(i);
+	    QByteArray temp = readFile(d.filePath(prefix + QStringLiteral("temp")));
+	    if (temp.isEmpty())
+		break;
+	    TripPoint trip;
+	    trip.temperature = SysfsAttribute::parseInt(temp.constData());
+	    QByteArray type = readFile(d.filePath(prefix + QStringLiteral("type")));
+	    trip.type = QString::fromLatin1(type);
+	    trip.level = levelForTripType(type);
+	    trip.crossed = false;
+	    if (trip.temperature <= 0)   // Disabled trip point
+		continue;
+	    int j = 0;
+	    while (j < zone->trips.size() && zone->trips.at(j).temperature < trip.temperature)
+		j++;
+	    zone->trips.insert(j, trip);
+	}
+	mZones << zone;
+    }
+
+    mTimer.setSingleShot(true);
+    mTimer.setInterval(kPollIntervals[0].interval);
+    connect(&mTimer, SIGNAL(timeout()), SLOT(poll()));
+    if (mZones.size())
+	poll();
+}
+
+ThermalMonitor::~ThermalMonitor()
+{
+    qDeleteAll(mZones);
+}
+
+void ThermalMonitor::setThrottling(bool throttling)
+{
+    if (throttling != mThrottling) {
+	mThrottling = throttling;
+	applyThrottle();
+	emit throttlingChanged();
+    }
+}
+
+/*!
+  Read every zone now and reschedule the next poll.
+ */
+
+void ThermalMonitor::poll()
+{
+    ThrottleLevel level = THROTTLE_NONE;
+    int hottest = 0;
+    int margin = -1;   // Smallest distance to an uncrossed trip point
+
+    foreach (Zone *zone, mZones) {
+	zone->temperature = zone->temp.readInt(zone->temperature);
+	if (zone == mZones.first() || zone->temperature > hottest)
+	    hottest = zone->temperature;
+
+	for (int i = 0 ; i < zone->trips.size() ; i++) {
+	    TripPoint& trip = zone->trips[i];
+	    int threshold = trip.crossed ? trip.temperature - kHysteresis : trip.temperature;
+	    trip.crossed = (zone->temperature >= threshold);
+	    if (trip.crossed) {
+		if (trip.level > level)
+		    level = trip.level;
+	    }
+	    else {
+		int distance = trip.temperature - zone->temperature;
+		if (margin < 0 || distance < margin)
+		    margin = distance;
+	    }
+	}
+    }
+
+    int interval = kPollIntervals[0].interval;
+    if (level == THROTTLE_NONE) {
+	int i = 0;
+	while (kPollIntervals[i].margin && (margin < 0 || margin >= kPollIntervals[i].margin))
+	    i++;
+	interval = kPollIntervals[i].interval;
+    }
+    if (interval != mTimer.interval()) {
+	mTimer.setInterval(interval);
+	emit pollIntervalChanged();
+    }
+    mTimer.start();
+
+    if (hottest != mTemperature) {
+	mTemperature = hottest;
+	emit temperatureChanged();
+    }
+    if (level != mLevel) {
+	mLevel = level;
+	applyThrottle();
+	emit throttleLevelChanged();
+    }
+}
+
+void ThermalMonitor::applyThrottle()
+{
+    int level = mThrottling ? mLevel : THROTTLE_NONE;
+    FrameGovernor::instance()->setMaxFrameRate(kThrottleActions[level].frameRate);
+    ScreenControl::instance()->setMaxBrightness(kThrottleActions[level].brightness);
+}
+
+QVariantList ThermalMonitor::zones() const
+{
+    QVariantList result;
+    foreach (const Zone *zone, mZones) {
+	QVariantList trips;
+	foreach (const TripPoint& trip, zone->trips) {
+	    QVariantMap map;
+	    map.insert(QStringLiteral("temperature"), trip.temperature);
+	    map.insert(QStringLiteral("type"), trip.type);
+	    map.insert(QStringLiteral("crossed"), trip.crossed);
+	    trips << map;
+	}
+	QVariantMap map;
+	map.insert(QStringLiteral("name"), zone->name);
+	map.insert(QStringLiteral("temperature"), zone->temperature);
+	map.insert(QStringLiteral("trips"), trips);
+	result << map;
+    }
+    return result;
+}
@@ -0,0 +1,78 @@
+/*
+  Thermal zone monitor
+
+  Watches /sys/class/thermal zones against their trip points and
+  derives a throttle level for the shell.
+ */
+
+#ifndef _THERMAL_MONITOR_H
+#define _THERMAL_MONITOR_H
+
+#include <QList>
+#include <QObject>
+#include <QTimer>
+#include <QVariantList>
+
+#include "sysfs.h"
+
+class ThermalMonitor : public QObject
+{
+    Q_OBJECT
+    Q_ENUMS(ThrottleLevel)
+    Q_PROPERTY(ThrottleLevel throttleLevel READ throttleLevel NOTIFY throttleLevelChanged)
+    Q_PROPERTY(int temperature READ temperature NOTIFY temperatureChanged)
+    Q_PROPERTY(int pollInterval READ pollInterval NOTIFY pollIntervalChanged)
+    Q_PROPERTY(bool throttling READ throttling WRITE setThrottling NOTIFY throttlingChanged)
+
+public:
+    enum ThrottleLevel { THROTTLE_NONE, THROTTLE_LIGHT, THROTTLE_MODERATE, THROTTLE_SEVERE };
+
+    static ThermalMonitor *instance();
+    static void   setSysfsRoot(const QString& path);   // Call before instance()
+    ~ThermalMonitor();
+
+    ThrottleLevel throttleLevel() const { return mLevel; }
+    int           temperature() const { return mTemperature; }   // Hottest zone, millidegrees C
+    int           pollInterval() const { return mTimer.interval(); }
+
+    // When set, the monitor caps the frame rate and backlight itself
+    bool          throttling() const { return mThrottling; }
+    void          setThrottling(bool);
+
+    Q_INVOKABLE QVariantList zones() const;
+    Q_INVOKABLE void         poll();
+
+signals:
+    void          throttleLevelChanged();
+    void          temperatureChanged();
+    void          pollIntervalChanged();
+    void          throttlingChanged();
+
+private:
+    ThermalMonitor();
+    void          applyThrottle();
+
+    struct TripPoint {
+	int           temperature;   // Millidegrees C
+	ThrottleLevel level;
+	bool          crossed;
+	QString       type;
+    };
+
+    struct Zone {
+	QString          name;
+	SysfsAttribute   temp;
+	int              temperature;
+	QList<TripPoint> trips;      // Sorted by temperature
+    };
+
+    static QString sSysfsRoot;
+
+    QList<Zone *>  mZones;
+    QTimer         mTimer;
+    ThrottleLevel  mLevel;
+    int            mTemperature;
+    bool           mThrottling;
+};
+
+#endif // _THERMAL_MONITOR_H
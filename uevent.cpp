@@ -0,0 +1,492 @@
+/*
+  Kernel uevent socket, parser and dispatcher.
+
+  The socket code follows uevent_kernel_multicast_recv() in libcutils:
+  only messages from the kernel (pid 0, uid 0) are accepted.
+ */
+
+#include "uevent.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+
+#include <QDebug>
+#include <QVector>
+
+// --------------------------------------------------------------------------------
+
+bool UEventString::operator==(const char *str) const
+{
+    return strncmp(mData, str, mSize) == 0 && str[mSize] == 0;
+}
+
+int UEventString::toInt(int defvalue) const
+{
+    const char *p = mData;
+    const char *end = mData + mSize;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+	negative = (*p++ == '-');
+    if (p == end || *p < '0' || *p > '9')
+	return defvalue;
+    int value = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+	value = value * 10 + (*p++ - '0');
+    return negative ? -value : value;
+}
+
+// --------------------------------------------------------------------------------
+
+UEvent::UEvent()
+    : mMsg(""), mLen(0), mFirstField(0)
+{
+}
+
+/*
+  The message must be NUL separated; a trailing partial field (from a
+  truncated message) is dropped.
+ */
+
+bool UEvent::parse(const char *msg, int len)
+{
+    mMsg = msg;
+    mLen = len;
+    mAction = mDevpath = mSubsystem = UEventString();
+
+    // Header: "action@devpath"
+    const char *p = static_cast<const char *>(memchr(msg, 0, len));
+    if (!p)
+	return false;
+    mFirstField = p + 1 - msg;
+
+    int pos = 0;
+    UEventString key, value;
+    while (nextField(&pos, &key, &value)) {
+	switch (key.data()[0]) {
+	case 'A':
+	    if (key == "ACTION") mAction = value;
+	    break;
+	case 'D':
+	    if (key == "DEVPATH") mDevpath = value;
+	    break;
+	case 'S':
+	    if (key == "SUBSYSTEM") mSubsystem = value;
+	    break;
+	}
+    }
+    return !mAction.isEmpty();
+}
+
+bool UEvent::nextField(int *pos, UEventString *key, UEventString *value) const
+{
+    int i = *pos < mFirstField ? mFirstField : *pos;
+    while (i < mLen) {
+	const char *field = mMsg + i;
+	const char *nul = static_cast<const char *>(memchr(field, 0, mLen - i));
+	if (!nul)
+	    return false;   // Truncated
+	i = nul + 1 - mMsg;
+	const char *eq = static_cast<const char *>(memchr(field, '=', nul - field));
+	if (eq) {
+	    *key   = UEventString(field, eq - field);
+	    *value = UEventString(eq + 1, nul - eq - 1);
+	    *pos   = i;
+	    return true;
+	}
+    }
+    *pos = i;
+    return false;
+}
+
+UEventString UEvent::value(const char *key) const
+{
+    int pos = 0;
+    UEventString k, v;
+    while (nextField(&pos, &k, &v))
+	if (k == key)
+	    return v;
+    return UEventString();
+}
+
+// --------------------------------------------------------------------------------
+
+/*
+  Build a classic BPF program that accepts a uevent only if it has a
+  "SUBSYSTEM=" field matching one of 'subsystems'.  BPF has no loops,
+  so the search for "\0SUBSYSTEM=" is unrolled over the first
+  kScanLimit bytes.  A load past the end of the message drops it (so a
+  message with no SUBSYSTEM is dropped); anything we cannot decide in
+  the program is accepted and left to the userspace check.
+ */
+
+static const int kScanLimit = 768;
+static const unsigned int kAccept = 0xffffffff;
+
+static unsigned int be32(const char *p, int n)
+{
+    unsigned int v = 0;
+    for (int i = 0 ; i < n ; i++)
+	v = (v << 8) | static_cast<unsigned char>(p[i]);
+    return v;
+}
+
+static void appendCompare(QVector<struct sock_filter>& prog, const char *bytes, int len,
+			  int offset, int failTarget)
+{
+    int done = 0;
+    while (done < len) {
+	int n = (len - done >= 4) ? 4 : (len - done >= 2 ? 2 : 1);
+	int size = (n == 4) ? BPF_W : (n == 2 ? BPF_H : BPF_B);
+	struct sock_filter ld  = BPF_STMT(BPF_LD | size | BPF_IND, offset + done);
+	prog << ld;
+	int jf = failTarget - (prog.size() + 1);
+	struct sock_filter jeq = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, be32(bytes + done, n), 0, jf);
+	prog << jeq;
+	done += n;
+    }
+}
+
+static int compareLength(int len)
+{
+    int count = 0;
+    while (len > 0) {
+	len -= (len >= 4) ? 4 : (len >= 2 ? 2 : 1);
+	count += 2;
+    }
+    return count;
+}
+
+static void buildFilter(const QList<QByteArray>& subsystems, QVector<struct sock_filter>& prog)
+{
+    static const char kKey[] = "\0SUBSYSTEM=";   // 11 bytes, without the implicit NUL
+    const int kKeyLen = sizeof(kKey) - 1;
+
+    // Scan: 4 instructions per offset, then accept if we ran off the end of the window
+    int verify = kScanLimit * 4 + 1;
+    for (int k = 0 ; k < kScanLimit ; k++) {
+	struct sock_filter ld  = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, k);
+	struct sock_filter jeq = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, be32(kKey, 4), 0, 2);
+	struct sock_filter ldx = BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, k);
+	prog << ld << jeq << ldx;
+	struct sock_filter ja  = BPF_STMT(BPF_JMP | BPF_JA, verify - (prog.size() + 1));
+	prog << ja;
+    }
+    struct sock_filter accept_window = BPF_STMT(BPF_RET | BPF_K, kAccept);
+    prog << accept_window;
+
+    // Verify the rest of the key; a false match is left to userspace
+    int keyCompare = compareLength(kKeyLen - 4);
+    int first = verify + keyCompare + 2;
+    int total = first;
+    for (int i = 0 ; i < subsystems.size() ; i++)
+	total += compareLength(subsystems.at(i).size() + 1) + 1;
+    int drop = total;
+
+    appendCompare(prog, kKey + 4, kKeyLen - 4, 4, verify + keyCompare + 1);
+    struct sock_filter skip = BPF_STMT(BPF_JMP | BPF_JA, 1);
+    prog << skip;
+    struct sock_filter accept_key = BPF_STMT(BPF_RET | BPF_K, kAccept);
+    prog << accept_key;
+    Q_ASSERT(prog.size() == first);
+
+    // One block per subsystem: compare name and terminating NUL, then accept
+    for (int i = 0 ; i < subsystems.size() ; i++) {
+	const QByteArray& name(subsystems.at(i));
+	int next = prog.size() + compareLength(name.size() + 1) + 1;
+	appendCompare(prog, name.constData(), name.size() + 1, kKeyLen, next);
+	struct sock_filter accept = BPF_STMT(BPF_RET | BPF_K, kAccept);
+	prog << accept;
+    }
+    Q_ASSERT(prog.size() == drop);
+    struct sock_filter reject = BPF_STMT(BPF_RET | BPF_K, 0);
+    prog << reject;
+}
+
+// --------------------------------------------------------------------------------
+
+UEventSocket::UEventSocket()
+    : mFd(-1)
+{
+}
+
+UEventSocket::~UEventSocket()
+{
+    close();
+}
+
+bool UEventSocket::open()
+{
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_pid = getpid();
+    addr.nl_groups = 0xffffffff;
+
+    mFd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (mFd < 0) {
+	fprintf(stderr, "Unable to open uevent socket (%s)\n", strerror(errno));
+	return false;
+    }
+
+    int on = 1;
+    int bufsize = 64 * 1024;
+    setsockopt(mFd, SOL_SOCKET, SO_RCVBUFFORCE, &bufsize, sizeof(bufsize));
+    setsockopt(mFd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+
+    if (bind(mFd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+	// Someone else in this process may already own our pid; let the kernel choose
+	addr.nl_pid = 0;
+	if (bind(mFd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+	    fprintf(stderr, "Unable to bind uevent socket (%s)\n", strerror(errno));
+	    close();
+	    return false;
+	}
+    }
+    return true;
+}
+
+void UEventSocket::close()
+{
+    if (mFd >= 0) {
+	::close(mFd);
+	mFd = -1;
+    }
+}
+
+bool UEventSocket::setSubsystems(const QList<QByteArray>& subsystems)
+{
+    if (mFd < 0)
+	return false;
+
+    if (subsystems.isEmpty()) {
+	int dummy = 0;
+	setsockopt(mFd, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy));
+	return true;
+    }
+
+    QVector<struct sock_filter> prog;
+    buildFilter(subsystems, prog);
+    if (prog.size() > BPF_MAXINSNS) {
+	fprintf(stderr, "uevent filter too large (%d instructions)\n", prog.size());
+	return false;
+    }
+
+    struct sock_fprog fprog;
+    fprog.len = prog.size();
+    fprog.filter = prog.data();
+    if (setsockopt(mFd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+	fprintf(stderr, "Unable to attach uevent filter (%s)\n", strerror(errno));
+	return false;
+    }
+    return true;
+}
+
+int UEventSocket::receive(char *buf, int size, bool *truncated)
+{
+    struct iovec iov = { buf, static_cast<size_t>(size) };
+    struct sockaddr_nl addr;
+    char control[CMSG_SPACE(sizeof(struct ucred))];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = &addr;
+    hdr.msg_namelen = sizeof(addr);
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+	n = recvmsg(mFd, &hdr, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+	return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS)
+	return 0;
+    struct ucred *cred = (struct ucred *) CMSG_DATA(cmsg);
+    if (cred->uid != 0 || addr.nl_groups == 0 || addr.nl_pid != 0)
+	return 0;   // Not from the kernel
+
+    *truncated = (hdr.msg_flags & MSG_TRUNC) != 0;
+    return n > size ? size : n;
+}
+
+// --------------------------------------------------------------------------------
+
+UEventReplaySource::UEventReplaySource(const QString& filename, int interval)
+    : mFile(filename)
+    , mInterval(interval)
+{
+}
+
+bool UEventReplaySource::open()
+{
+    if (!mFile.open(QIODevice::ReadOnly | QIODevice::Text)) {
+	fprintf(stderr, "Unable to open uevent replay file %s\n", qPrintable(mFile.fileName()));
+	return false;
+    }
+    return true;
+}
+
+int UEventReplaySource::receive(char *buf, int size, bool *truncated)
+{
+    *truncated = false;
+    int len = 0;
+    while (!mFile.atEnd()) {
+	QByteArray line = mFile.readLine().trimmed();
+	if (line.startsWith('#'))
+	    continue;
+	if (line.isEmpty()) {
+	    if (len)
+		break;
+	    continue;
+	}
+	if (len + line.size() + 1 > size) {
+	    *truncated = true;
+	    continue;
+	}
+	memcpy(buf + len, line.constData(), line.size());
+	len += line.size();
+	buf[len++] = 0;
+    }
+    if (!len)
+	return -1;
+    if (mInterval > 0)
+	usleep(mInterval * 1000);
+    return len;
+}
+
+// --------------------------------------------------------------------------------
+
+/*
+  Large enough for any kernel uevent (the kernel limit is 2048 bytes
+  of environment plus the header)
+ */
+
+const int UEVENT_MSG_LEN = 8192;
+
+// A subscriber that stops draining its queue loses the oldest messages
+const int kMaxPending = 256;
+
+void UEventSubscription::flush()
+{
+    UEventBatch batch;
+    {
+	QMutexLocker locker(&UEventDispatcher::instance()->mLock);
+	batch.swap(mPending);
+    }
+    if (!batch.isEmpty())
+	emit events(batch);
+}
+
+UEventSource *UEventDispatcher::sSource = 0;
+
+UEventDispatcher *UEventDispatcher::instance()
+{
+    static UEventDispatcher *_s_dispatcher = 0;
+    if (!_s_dispatcher)
+	_s_dispatcher = new UEventDispatcher(sSource ? sSource : new UEventSocket);
+    return _s_dispatcher;
+}
+
+void UEventDispatcher::setSource(UEventSource *source)
+{
+    sSource = source;
+}
+
+UEventDispatcher::UEventDispatcher(UEventSource *source)
+    : mSource(source)
+{
+    qRegisterMetaType<UEventBatch>("UEventBatch");
+    mOpen = mSource->open();
+}
+
+void UEventDispatcher::subscribe(const QByteArray& subsystem, const QByteArray& action,
+				 QObject *receiver, const char *member)
+{
+    UEventSubscription *sub = new UEventSubscription(subsystem, action, receiver);
+    connect(sub, SIGNAL(events(UEventBatch)), receiver, member);
+    connect(receiver, SIGNAL(destroyed(QObject*)), this, SLOT(receiverDestroyed(QObject*)),
+	    Qt::ConnectionType(Qt::DirectConnection | Qt::UniqueConnection));
+    {
+	QMutexLocker locker(&mLock);
+	mSubscriptions << sub;
+    }
+    updateFilter();
+
+    if (mOpen && !isRunning())
+	start();
+}
+
+/*
+  Runs in the receiver's thread, before its children (the
+  subscriptions) are deleted.
+ */
+
+void UEventDispatcher::receiverDestroyed(QObject *receiver)
+{
+    QMutexLocker locker(&mLock);
+    for (int i = mSubscriptions.size() - 1 ; i >= 0 ; i--)
+	if (mSubscriptions.at(i)->parent() == receiver)
+	    mSubscriptions.removeAt(i);
+    locker.unlock();
+    updateFilter();
+}
+
+void UEventDispatcher::updateFilter()
+{
+    QList<QByteArray> subsystems;
+    {
+	QMutexLocker locker(&mLock);
+	foreach (const UEventSubscription *sub, mSubscriptions)
+	    if (!subsystems.contains(sub->mSubsystem))
+		subsystems << sub->mSubsystem;
+    }
+    if (mOpen)
+	mSource->setSubsystems(subsystems);
+}
+
+void UEventDispatcher::run()
+{
+    QByteArray buffer(UEVENT_MSG_LEN, 0);
+    bool truncated = false;
+    int n;
+    while ((n = mSource->receive(buffer.data(), buffer.size(), &truncated)) >= 0) {
+	if (n == 0)
+	    continue;
+	if (truncated)
+	    qWarning("uevent truncated to %d bytes", n);
+	dispatch(buffer.constData(), n);
+    }
+}
+
+void UEventDispatcher::dispatch(const char *msg, int len)
+{
+    UEvent uevent;
+    if (!uevent.parse(msg, len))
+	return;
+
+    QByteArray copy;   // Shared by every subscriber that wants it
+    QMutexLocker locker(&mLock);
+    foreach (UEventSubscription *sub, mSubscriptions) {
+	if (uevent.subsystem() != sub->mSubsystem.constData())
+	    continue;
+	if (!sub->mAction.isEmpty() && uevent.action() != sub->mAction.constData())
+	    continue;
+	if (copy.isNull())
+	    copy = QByteArray(msg, len);
+	bool post = sub->mPending.isEmpty();
+	if (sub->mPending.size() >= kMaxPending)
+	    sub->mPending.removeFirst();
+	sub->mPending << copy;
+	if (post)
+	    QMetaObject::invokeMethod(sub, "flush", Qt::QueuedConnection);
+    }
+}
@@ -0,0 +1,194 @@
+/*
+  Kernel uevent socket, parser and dispatcher
+ */
+
+#ifndef _UEVENT_H
+#define _UEVENT_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QList>
+#include <QMetaType>
+#include <QMutex>
+#include <QThread>
+
+/*
+  A view into a uevent message buffer.  Nothing is copied; the view is
+  only valid while the buffer it points into is.
+ */
+
+class UEventString
+{
+public:
+    UEventString() : mData(""), mSize(0) {}
+    UEventString(const char *data, int size) : mData(data), mSize(size) {}
+
+    const char *data() const { return mData; }
+    int         size() const { return mSize; }
+    bool        isEmpty() const { return mSize == 0; }
+
+    bool        operator==(const char *str) const;
+    bool        operator!=(const char *str) const { return !(*this == str); }
+    int         toInt(int defvalue = 0) const;
+    QByteArray  toByteArray() const { return QByteArray(mData, mSize); }
+
+private:
+    const char *mData;
+    int         mSize;
+};
+
+/*
+  A parsed uevent: "action@devpath\0KEY=VALUE\0KEY=VALUE\0..."
+  parse() makes a single pass over the message and records where the
+  common keys are.  Other keys can be looked up with value().
+ */
+
+class UEvent
+{
+public:
+    UEvent();
+
+    bool         parse(const char *msg, int len);
+
+    UEventString action() const { return mAction; }
+    UEventString devpath() const { return mDevpath; }
+    UEventString subsystem() const { return mSubsystem; }
+    UEventString value(const char *key) const;
+
+    // Iterate over KEY=VALUE fields; 'pos' starts at 0
+    bool         nextField(int *pos, UEventString *key, UEventString *value) const;
+
+private:
+    const char  *mMsg;
+    int          mLen;
+    int          mFirstField;
+    UEventString mAction, mDevpath, mSubsystem;
+};
+
+/*
+  Where the dispatcher gets its messages from.  receive() blocks until
+  a message is available and returns its length, 0 for a message that
+  should be ignored, or -1 when the source is exhausted.
+ */
+
+class UEventSource
+{
+public:
+    virtual ~UEventSource() {}
+
+    virtual bool open() = 0;
+    virtual bool setSubsystems(const QList<QByteArray>&) { return true; }
+    virtual int  receive(char *buf, int size, bool *truncated) = 0;
+};
+
+/*
+  A NETLINK_KOBJECT_UEVENT socket.  setSubsystems() attaches a BPF
+  socket filter so that only messages for those subsystems are queued
+  to the socket; an empty list passes everything.
+ */
+
+class UEventSocket : public UEventSource
+{
+public:
+    UEventSocket();
+    ~UEventSocket();
+
+    bool         open();
+    void         close();
+    int          fd() const { return mFd; }
+
+    bool         setSubsystems(const QList<QByteArray>& subsystems);
+
+    // Messages that do not fit are truncated; '*truncated' is set when
+    // that happens.
+    int          receive(char *buf, int size, bool *truncated);
+
+private:
+    int          mFd;
+};
+
+/*
+  Replays uevents from a text file, for running without root or on a
+  host.  Each event is a paragraph: an "action@devpath" line followed by
+  KEY=VALUE lines.  Paragraphs are separated by blank lines and lines
+  starting with '#' are ignored.  Events are delivered 'interval' ms apart.
+ */
+
+class UEventReplaySource : public UEventSource
+{
+public:
+    UEventReplaySource(const QString& filename, int interval = 100);
+
+    bool         open();
+    int          receive(char *buf, int size, bool *truncated);
+
+private:
+    QFile        mFile;
+    int          mInterval;
+};
+
+// --------------------------------------------------------------------------------
+
+typedef QList<QByteArray> UEventBatch;   // Raw messages; parse with UEvent
+Q_DECLARE_METATYPE(UEventBatch)
+
+class UEventSubscription : public QObject
+{
+    Q_OBJECT
+public:
+    UEventSubscription(const QByteArray& subsystem, const QByteArray& action, QObject *receiver)
+	: QObject(receiver), mSubsystem(subsystem), mAction(action) {}
+
+signals:
+    void         events(const UEventBatch& batch);
+
+public slots:
+    void         flush();
+
+private:
+    friend class UEventDispatcher;
+    QByteArray   mSubsystem;
+    QByteArray   mAction;      // Empty matches every action
+    UEventBatch  mPending;     // Guarded by the dispatcher lock
+};
+
+/*
+  One thread reads uevents for the whole process.  Components subscribe
+  by subsystem (and optionally action); matching messages are collected
+  per subscriber and delivered as a batch in the subscriber's thread.
+  A subscription ends when its receiver is destroyed.
+ */
+
+class UEventDispatcher : public QThread
+{
+    Q_OBJECT
+public:
+    static UEventDispatcher *instance();
+    static void  setSource(UEventSource *source);   // Call before instance(); takes ownership
+
+    // 'member' is a SLOT(...) taking (const UEventBatch&)
+    void         subscribe(const QByteArray& subsystem, const QByteArray& action,
+			   QObject *receiver, const char *member);
+
+protected:
+    void         run();
+
+private slots:
+    void         receiverDestroyed(QObject *receiver);
+
+private:
+    UEventDispatcher(UEventSource *source);
+    void         dispatch(const char *msg, int len);
+    void         updateFilter();
+
+    static UEventSource *sSource;
+
+    QMutex       mLock;
+    QList<UEventSubscription *> mSubscriptions;
+    UEventSource *mSource;
+    bool         mOpen;
+
+    friend class UEventSubscription;
+};
+
+#endif // _UEVENT_H
@@ -1,28 +1,30 @@
 /*
   Wifi state machine and interface.
-  This object should be placed in its own thread
+  Wifi and its models are only touched on the GUI thread; the binder
+  callbacks convert their data and post it there (see setState).
 
   This is strongly based on the WifiStateMachine.java code
   in Android.
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "wifi.h"
+#include "wificache.h"
 
+#ifndef KLAATU_HOST
+#include "screencontrol.h"
 #include <wifi/WifiClient.h>
+#endif
 
+#include <QDateTime>
 #include <QDebug>
 #include <QMutex>
+#include <QSet>
+#include <QVector>
 
 // using namespace android;
 
-/*
-  This common mutex is used to guard against reading data that
-  originates from the Wifi server
- */
-
-static QMutex sWifiMutex;
-
 /*
   Adjust the signalLevel to between 0 and 4 (see notes in WifiManager.java)
  */
@@ -41,7 +43,114 @@ static int rssiToLevel(int rssi)
 }
 
 // ------------------------------------------------------------
-// Communicate with the wifi server
+
+const double kRssiWeight     = 0.25;   // Weight of a new sample in the average
+const int    kRssiHysteresis = 3;      // dB past a bar threshold before the level moves
+const int    kNoRssi         = -200;   // At or below: no signal
+
+int RssiFilter::add(int rssi)
+{
+    if (rssi <= kNoRssi) {
+	reset();
+	return value();
+    }
+    if (!mValid) {
+	mValue = rssi;
+	mValid = true;
+	mLevel = rssiToLevel(rssi);
+	return value();
+    }
+
+    mValue += kRssiWeight * (rssi - mValue);
+    int average = value();
+    int level = rssiToLevel(average);
+    if (level > mLevel)
+	mLevel = qMax(mLevel, rssiToLevel(average - kRssiHysteresis));
+    else if (level < mLevel)
+	mLevel = qMin(mLevel, rssiToLevel(average + kRssiHysteresis));
+    return average;
+}
+
+int RssiFilter::value() const
+{
+    return mValid ? qRound(mValue) : -9999;
+}
+
+// ------------------------------------------------------------
+
+EmitRateLimiter::EmitRateLimiter(int interval, QObject *parent)
+    : QObject(parent)
+    , mInterval(interval)
+{
+    mTimer.setSingleShot(true);
+    connect(&mTimer, SIGNAL(timeout()), SLOT(timeout()));
+}
+
+void EmitRateLimiter::trigger()
+{
+    if (mTimer.isActive())
+	return;
+    if (mInterval <= 0 || !mLast.isValid() || mLast.elapsed() >= mInterval) {
+	mLast.start();
+	emit fire();
+    }
+    else
+	mTimer.start(mInterval - mLast.elapsed());
+}
+
+void EmitRateLimiter::timeout()
+{
+    mLast.start();
+    emit fire();
+}
+
+Wifi::KeyMgmt Wifi::keyMgmtFromFlags(const char *flags)
+{
+    if (strstr(flags, "WPA2"))
+	return Wifi::KEYMGMT_WPA2;
+    if (strstr(flags, "WPA"))
+	return Wifi::KEYMGMT_WPA;
+    if (strstr(flags, "WEP"))
+	return Wifi::KEYMGMT_WEP;
+    return Wifi::KEYMGMT_NONE;
+}
+
+#ifndef KLAATU_HOST
+
+/*
+  SSIDs and flag strings repeat from scan to scan.  The pool is looked
+  up with the raw bytes, so a string seen before costs neither a
+  conversion nor an allocation, and every record holding it shares one
+  QString.  It is emptied if it ever grows past kMaxPool.
+ */
+
+class StringPool
+{
+public:
+    QString intern(const android::String8& str) {
+	QByteArray key = QByteArray::fromRawData(str.string(), str.size());
+	QHash<QByteArray, QString>::const_iterator it = mPool.constFind(key);
+	if (it != mPool.constEnd())
+	    return it.value();
+	if (mPool.size() >= kMaxPool)
+	    mPool.clear();
+	QString value = QString::fromLocal8Bit(str.string(), str.size());
+	mPool.insert(QByteArray(str.string(), str.size()), value);
+	return value;
+    }
+
+private:
+    enum { kMaxPool = 1024 };
+    QHash<QByteArray, QString> mPool;
+};
+
+static QMutex     sPoolLock;   // Binder callbacks may arrive on any binder thread
+static StringPool sPool;
+
+// ------------------------------------------------------------
+// Communicate with the wifi server.  The callbacks arrive on a binder
+// thread; they convert the data into records there and Wifi applies
+// them on the GUI thread.
 
 class MyWifiClient : public android::WifiClient
 {
@@ -50,19 +159,56 @@ public:
     virtual ~MyWifiClient() {}
        
     void State(android::WifiState state) {
-	Wifi::instance()->setState(state);
+	Wifi::instance()->setState(static_cast<Wifi::DriverState>(state));
     }
 
     void ScanResults(const android::Vector<android::ScannedStation>& scandata) {
-	Wifi::instance()->setScanResults(scandata);
+	// fprintf(stderr, "Wifi::setScanResults (%d)\n", scandata.size());
+	WifiScanList list(scandata.size());
+	sPoolLock.lock();
+	for (size_t i = 0 ; i < scandata.size() ; i++) {
+	    const android::ScannedStation& scanned(scandata[i]);
+	    WifiScanRecord& record(list[i]);
+	    record.bssid     = QString::fromLocal8Bit(scanned.bssid.string(), scanned.bssid.size());
+	    record.ssid      = sPool.intern(scanned.ssid);
+	    record.flags     = sPool.intern(scanned.flags);
+	    record.frequency = scanned.frequency;
+	    record.rssi      = scanned.rssi;
+	    record.key_mgmt  = Wifi::keyMgmtFromFlags(scanned.flags.string());
+	}
+	sPoolLock.unlock();
+	Wifi::instance()->setScanResults(list);
     }
 
     void ConfiguredStations(const android::Vector<android::ConfiguredStation>& configdata) {
-	Wifi::instance()->setConfiguredStations(configdata);
+	// fprintf(stderr, "Wifi::setConfiguredStations (%d)\n", configdata.size());
+	WifiConfigList list(configdata.size());
+	sPoolLock.lock();
+	for (size_t i = 0 ; i < configdata.size() ; i++) {
+	    const android::ConfiguredStation& config(configdata[i]);
+	    WifiConfigRecord& record(list[i]);
+	    record.ssid           = sPool.intern(config.ssid);
+	    record.pre_shared_key = QString::fromLocal8Bit(config.pre_shared_key.string());
+	    record.network_id     = config.network_id;
+	    record.status         = config.status;
+	    record.key_mgmt       = Wifi::keyMgmtFromFlags(config.key_mgmt.string());
+	}
+	sPoolLock.unlock();
+	Wifi::instance()->setConfiguredStations(list);
     }
 
     void Information(const android::WifiInformation& info) {
-	Wifi::instance()->setInformation(info);
+	// fprintf(stderr, "Wifi::setInformation)\n");
+	WifiInfoRecord record;
+	record.bssid            = QString::fromLocal8Bit(info.bssid.string());
+	record.ssid             = QString::fromLocal8Bit(info.ssid.string());
+	record.ipaddr           = QString::fromLocal8Bit(info.ipaddr.string());
+	record.macaddr          = QString::fromLocal8Bit(info.macaddr.string());
+	record.supplicant_state = info.supplicant_state;
+	record.network_id       = info.network_id;
+	record.rssi             = info.rssi;
+	record.link_speed       = info.link_speed;
+	Wifi::instance()->setInformation(record);
     }
 
 private:
@@ -76,6 +222,57 @@ MyWifiClient *MyWifiClient::instance() {
     return _s_wifiClient.get();
 }
 
+class BinderWifiBackend : public WifiBackend
+{
+public:
+    void registerClient() {
+	MyWifiClient::instance()->Register(android::WIFI_CLIENT_FLAG_BROADCAST);
+    }
+    void setEnabled(bool enabled) { MyWifiClient::instance()->SetEnabled(enabled); }
+    void enableRssiPolling(bool enable) { MyWifiClient::instance()->EnableRssiPolling(enable); }
+    void startScan(bool active) { MyWifiClient::instance()->StartScan(active); }
+    void addOrUpdateNetwork(const WifiConfigRecord& record) {
+	android::ConfiguredStation config;
+	config.ssid = record.ssid.toLocal8Bit();
+	if (record.key_mgmt != Wifi::KEYMGMT_NONE) {
+	    config.key_mgmt = "WPA-PSK";
+	    config.pre_shared_key = record.pre_shared_key.toLocal8Bit();
+	}
+	else {
+	    config.key_mgmt = "NONE";
+	}
+	MyWifiClient::instance()->AddOrUpdateNetwork(config);
+    }
+    void removeNetwork(int network_id) { MyWifiClient::instance()->RemoveNetwork(network_id); }
+    void selectNetwork(int network_id) { MyWifiClient::instance()->SelectNetwork(network_id); }
+    void reconnect() { MyWifiClient::instance()->Reconnect(); }
+    void disconnect() { MyWifiClient::instance()->Disconnect(); }
+    void reassociate() { MyWifiClient::instance()->Reassociate(); }
+};
+
+typedef BinderWifiBackend DefaultWifiBackend;
+
+#else // KLAATU_HOST
+
+class NullWifiBackend : public WifiBackend
+{
+public:
+    void registerClient() {}
+    void setEnabled(bool) {}
+    void enableRssiPolling(bool) {}
+    void startScan(bool) {}
+    void addOrUpdateNetwork(const WifiConfigRecord&) {}
+    void removeNetwork(int) {}
+    void selectNetwork(int) {}
+    void reconnect() {}
+    void disconnect() {}
+    void reassociate() {}
+};
+
+typedef NullWifiBackend DefaultWifiBackend;
+
+#endif // KLAATU_HOST
+
 // ------------------------------------------------------------
 
 ScannedStationModel::ScannedStationModel(QObject *parent)
@@ -90,9 +287,8 @@ ScannedStationModel::ScannedStationModel(QObject *parent)
     setRoleNames(roles);
 }
 
-void ScannedStationModel::update(const android::Vector<android::ScannedStation>& update)
+void ScannedStationModel::update(const WifiScanList& update)
 {
-    QMutexLocker locker(&sWifiMutex);
     beginResetModel();
     mStations = update;
     endResetModel();
@@ -100,26 +296,24 @@ void ScannedStationModel::update(const android::Vector<android::ScannedStation>&
 
 int ScannedStationModel::rowCount(const QModelIndex&) const
 {
-    QMutexLocker locker(&sWifiMutex);
     return mStations.size();
 }
 
 QVariant ScannedStationModel::data(const QModelIndex& index, int role) const
 {
-    QMutexLocker locker(&sWifiMutex);
-    if (index.row() < 0 || index.row() > (int) mStations.size())
+    if (index.row() < 0 || index.row() >= mStations.size())
 	return QVariant();
-    const android::ScannedStation& station(mStations[index.row()]);
+    const WifiScanRecord& station(mStations.at(index.row()));
     if (role == BssidRole)
-	return QString::fromLocal8Bit(station.bssid.string());
+	return station.bssid;
     else if (role == FrequencyRole)
 	return station.frequency;
     else if (role == RssiRole)
 	return station.rssi;
     else if (role == FlagsRole)
-	return QString::fromLocal8Bit(station.flags.string());
+	return station.flags;
     else if (role == SsidRole)
-	return QString::fromLocal8Bit(station.ssid.string());
+	return station.ssid;
     return QVariant();
 }
 
@@ -134,9 +328,8 @@ ConfiguredStationModel::ConfiguredStationModel(QObject *parent)
     setRoleNames(roles);
 }
 
-void ConfiguredStationModel::update(const android::Vector<android::ConfiguredStation>& update)
+void ConfiguredStationModel::update(const WifiConfigList& update)
 {
-    QMutexLocker locker(&sWifiMutex);
     beginResetModel();
     // TODO: Sort the list based on index
     mStations = update;
@@ -145,20 +338,18 @@ void ConfiguredStationModel::update(const android::Vector<android::ConfiguredSta
 
 int ConfiguredStationModel::rowCount(const QModelIndex&) const
 {
-    QMutexLocker locker(&sWifiMutex);
     return mStations.size();
 }
 
 QVariant ConfiguredStationModel::data(const QModelIndex& index, int role) const
 {
-    QMutexLocker locker(&sWifiMutex);
-    if (index.row() < 0 || index.row() > (int) mStations.size())
+    if (index.row() < 0 || index.row() >= mStations.size())
 	return QVariant();
-    const android::ConfiguredStation& station(mStations[index.row()]);
+    const WifiConfigRecord& station(mStations.at(index.row()));
     if (role == NetworkIdRole)
 	return station.network_id;
     else if (role == SsidRole)
-	return QString::fromLocal8Bit(station.ssid.string());
+	return station.ssid;
     return QVariant();
 }
 
@@ -177,17 +368,17 @@ public:
 	, station_count(0)
 	, ssid(inSsid)
 	, status(UNKNOWN)
-	, key_mgmt(Wifi::KEYMGMT_NONE) {
-    }
-
-    static Wifi::KeyMgmt flagsToKeyMgmt(const QString& flags) {
-	if (flags.contains("WPA2"))
-	    return Wifi::KEYMGMT_WPA2;
-	if (flags.contains("WPA"))
-	    return Wifi::KEYMGMT_WPA;
-	if (flags.contains("WEP"))
-	    return Wifi::KEYMGMT_WEP;
-	return Wifi::KEYMGMT_NONE;
+	, key_mgmt(Wifi::KEYMGMT_NONE)
+	, shown_rssi(-9999)
+	, prev_rssi(-9999)
+	, prev_level(0)
+	, prev_count(0)
+	, stale(false)
+	, age(0)
+	, order(0)
+	, row(0)
+	, changed(0)
+	, remove(false) {
     }
 
     QString createNote() const { 
@@ -199,7 +390,7 @@ public:
 	if (status == CURRENT)  return QStringLiteral("Current");
 	if (status == ENABLED)  return QStringLiteral("Enabled");
 	if (status == DISABLED) return QStringLiteral("Disabled");
-	switch (flagsToKeyMgmt(flags)) {
+	switch (key_mgmt) {
 	case Wifi::KEYMGMT_WPA2: return QStringLiteral("WPA2");
 	case Wifi::KEYMGMT_WPA:  return QStringLiteral("WPA");
 	case Wifi::KEYMGMT_WEP:  return QStringLiteral("WEP");
@@ -210,18 +401,36 @@ public:
 
     static bool lessThan(const Station *self, const Station *other) {
 	if (self->status == CURRENT) 
-	    return true;
+	    return other->status != CURRENT;
 	if (other->status == CURRENT)
 	    return false;
-	return self->rssi > other->rssi;
+	return self->shown_rssi > other->shown_rssi;
     }
 
-    int     network_id, rssi, frequency, station_count;
+    int     network_id, rssi, frequency, station_count;   // rssi is from the last scan
+    RssiFilter filter;
+    int     shown_rssi;                                  // filter.value()
     QString ssid, flags, pre_shared_key;
     Status  status;
     Wifi::KeyMgmt key_mgmt;
+    bool    stale;                  // Scan data restored from the cache
+    int     age;                    // Seconds old when restored
+
+    // Bookkeeping for CombinedModel::commit()
+    int     prev_rssi, prev_level, prev_count;  // As last shown
+    int     order;                  // Row after sorting
+    int     row;                    // Current row while sorting
+    int     changed;                // Mask of roleBit() values
+    bool    remove;
 };
 
+static inline int roleBit(int role)
+{
+    return 1 << (role - CombinedModel::NetworkIdRole);
+}
+
+static const int kAllRoles = (roleBit(CombinedModel::AgeRole) << 1) - 1;
+
 CombinedModel::CombinedModel(QObject *parent)
     : QAbstractListModel(parent)
 {
@@ -237,104 +446,108 @@ CombinedModel::CombinedModel(QObject *parent)
     roles[FrequencyRole]    = "frequency";
     roles[KeyMgmtRole]      = "keyMgmt";
     roles[PreSharedKeyRole] = "preSharedKey";
+    roles[StaleRole]        = "stale";
+    roles[AgeRole]          = "age";
     setRoleNames(roles);
 }
 
-Station * CombinedModel::findBySsid(const QString& ssid)
+CombinedModel::~CombinedModel()
 {
-    QListIterator<Station *> iter(mStations);
-    while (iter.hasNext()) {
-	Station *s = iter.next();
-	if (s->ssid == ssid) 
-	    return s;
-    }
+    qDeleteAll(mStations);
+}
+
+/*
+  Stations are found through a hash on the SSID.  A new station is not
+  visible until commit() inserts it.
+ */
 
-    beginInsertRows(QModelIndex(), mStations.count(), mStations.count());
-    // qDebug() << " ...insert row" << mStations.count();
-    Station *s = new Station(ssid);
-    mStations.append(s);
-    endInsertRows();
+Station * CombinedModel::findBySsid(const QString& ssid, QList<Station *> *added)
+{
+    Station *s = mIndex.value(ssid);
+    if (!s) {
+	s = new Station(ssid);
+	mIndex.insert(ssid, s);
+	added->append(s);
+    }
     return s;
 }
 
-void CombinedModel::update(const android::Vector<android::ScannedStation>& update)
+void CombinedModel::update(const WifiScanList& update, int age)
 {
+    bool stale = (age >= 0);
     // qDebug() << "[" << Q_FUNC_INFO;
-    QMutexLocker locker(&sWifiMutex);
-
     // Remove all current RSSI values
     QListIterator<Station *> it(mStations);
     while (it.hasNext()) {
 	Station *s = it.next();
+	s->prev_rssi = s->shown_rssi;
+	s->prev_level = s->filter.level();
+	s->prev_count = s->station_count;
 	s->rssi = -9999;
 	s->station_count = 0;
     }
 
-    for (size_t i = 0 ; i < update.size() ; i++) {
-	const android::ScannedStation& scanned(update[i]);
-	Station *s = findBySsid(QString::fromLocal8Bit(scanned.ssid.string()));
-	QSet<int> changed;
-	changed << CombinedModel::RssiRole << CombinedModel::SignalLevelRole << CombinedModel::StationCountRole;
+    QList<Station *> added;
+    for (int i = 0 ; i < update.size() ; i++) {
+	const WifiScanRecord& scanned(update.at(i));
+	Station *s = findBySsid(scanned.ssid, &added);
 
 	if (scanned.rssi > s->rssi) 
 	    s->rssi = scanned.rssi;  // Might be more than one station
 
+	// Live readings replace cached ones rather than averaging with them
+	if (s->stale != stale || s->age != qMax(age, 0)) {
+	    if (!stale)
+		s->filter.reset();
+	    s->stale = stale;
+	    s->age = qMax(age, 0);
+	    s->changed |= roleBit(StaleRole) | roleBit(AgeRole);
+	}
+
 	if (s->frequency != scanned.frequency) {
 	    s->frequency = scanned.frequency;
-	    changed << CombinedModel::FrequencyRole;
+	    s->changed |= roleBit(FrequencyRole);
 	}
 
 	if (s->flags != scanned.flags) {
 	    s->flags = scanned.flags;
-	    s->key_mgmt = Station::flagsToKeyMgmt(QString::fromLocal8Bit(scanned.flags.string()));
-	    changed << CombinedModel::FlagsRole << CombinedModel::KeyMgmtRole;
+	    s->key_mgmt = static_cast<Wifi::KeyMgmt>(scanned.key_mgmt);
+	    s->changed |= roleBit(FlagsRole) | roleBit(KeyMgmtRole) | roleBit(NoteRole);
 	}
 	
 	s->station_count += 1;
-	int row = mStations.indexOf(s);
-	// qDebug() << " ...data changed row" << row;
-	emit dataChanged(createIndex(row, 0), createIndex(row, 0), changed);
     }
 
-    // Remove stations that didn't show up on the scan
-    int row = 0;
-    while (row < mStations.size()) {
-	Station *s = mStations[row];
-	if (s->rssi == -9999 && s->network_id == -1) {
-	    beginRemoveRows(QModelIndex(), row, row);
-	    delete mStations.takeAt(row);
-	    // qDebug() << " ...remove row" << row;
-	    endRemoveRows();
-	}
-	else {
-	    row += 1;
-	}
-    }
+    // Smooth the new readings.  The filter's hysteresis keeps the
+    // signal level from flapping between scans.
+    foreach (Station *s, added)
+	s->shown_rssi = s->filter.add(s->rssi);
 
-    emit layoutAboutToBeChanged();
-    QList<Station *> mOldList(mStations);
-    qStableSort(mStations.begin(), mStations.end(), Station::lessThan);
-    for (int row = 0 ; row < mStations.size() ; row++) {
-	int old_row = mOldList.indexOf(mStations[row]);
-	if (row != old_row) {
-	    changePersistentIndex(createIndex(old_row, 0), createIndex(row, 0));
-	    // qDebug() << " ...move row" << old_row << "to" << row;
+    // Work out what each existing row needs to report, and drop the
+    // stations that didn't show up on the scan
+    it.toFront();
+    while (it.hasNext()) {
+	Station *s = it.next();
+	s->shown_rssi = s->filter.add(s->rssi);   // -9999 resets it
+	if (s->shown_rssi != s->prev_rssi)
+	    s->changed |= roleBit(RssiRole);
+	if (s->filter.level() != s->prev_level)
+	    s->changed |= roleBit(SignalLevelRole);
+	if (s->station_count != s->prev_count)
+	    s->changed |= roleBit(StationCountRole) | roleBit(NoteRole);
+	s->remove = (s->rssi == -9999 && s->network_id == -1);
+	if (s->stale && !stale && s->rssi == -9999) {
+	    s->stale = false;     // Configured, and gone from the live scan
+	    s->age = 0;
+	    s->changed |= roleBit(StaleRole) | roleBit(AgeRole);
 	}
     }
-    emit layoutChanged();
 
-    // qDebug() << " > After scan update, combined list is";
-    // for (int row = 0 ; row < mStations.size() ; row++) {
-    // 	Station *s = mStations[row];
-    // 	qDebug("   id=%d ssid='%s' rssi=%d status=%d", s->network_id, 
-    // 	       s->ssid.toLocal8Bit().constData(), s->rssi, s->status);
-    // }
+    commit(added);
 }
 
-void CombinedModel::update(const android::Vector<android::ConfiguredStation>& update)
+void CombinedModel::update(const WifiConfigList& update)
 {
-    QMutexLocker locker(&sWifiMutex);
-
     // Mark stations with a non-negative network id
     QListIterator<Station *> it(mStations);
     while (it.hasNext()) {
@@ -343,47 +556,96 @@ void CombinedModel::update(const android::Vector<android::ConfiguredStation>& up
 	    s->network_id = -2;
     }
 
-    for (size_t i = 0 ; i < update.size() ; i++) {
-	const android::ConfiguredStation& config(update[i]);
-	Station *s = findBySsid(QString::fromLocal8Bit(config.ssid.string()));
+    QList<Station *> added;
+    for (int i = 0 ; i < update.size() ; i++) {
+	const WifiConfigRecord& config(update.at(i));
+	Station *s = findBySsid(config.ssid, &added);
 	s->network_id = config.network_id;
 	s->status     = static_cast<Station::Status>(config.status);
-	s->key_mgmt   = Station::flagsToKeyMgmt(QString::fromLocal8Bit(config.key_mgmt.string()));
+	s->key_mgmt   = static_cast<Wifi::KeyMgmt>(config.key_mgmt);
 	s->pre_shared_key = config.pre_shared_key;
-	int row = mStations.indexOf(s);
-	emit dataChanged(createIndex(row, 0), createIndex(row, 0));
+	s->changed = kAllRoles;
     }
 
     // Remove stations that didn't show up in the list and don't have scan results
-    int row = 0;
-    while (row < mStations.size()) {
-	Station *s = mStations[row];
+    it.toFront();
+    while (it.hasNext()) {
+	Station *s = it.next();
 	if (s->network_id == -2) {
 	    if (s->rssi != -9999) {
 		s->network_id = -1;
 		s->status = Station::UNKNOWN;
-		row += 1;
-	    }
-	    else {
-		beginRemoveRows(QModelIndex(), row, row);
-		delete mStations.takeAt(row);
-		endRemoveRows();
+		s->changed = kAllRoles;
 	    }
+	    else
+		s->remove = true;
 	}
-	else {
-	    row += 1;
+    }
+
+    commit(added);
+}
+
+/*
+  Apply a round of changes to the views with as few notifications as
+  possible: one insert for all new stations, one remove per run of
+  dropped rows, a move for each row that has to change place, and one
+  dataChanged per run of changed rows.
+ */
+
+void CombinedModel::commit(const QList<Station *>& added)
+{
+    if (added.size()) {
+	int first = mStations.size();
+	beginInsertRows(QModelIndex(), first, first + added.size() - 1);
+	foreach (Station *s, added) {
+	    s->changed = 0;
+	    mStations.append(s);
 	}
+	endInsertRows();
     }
 
-    emit layoutAboutToBeChanged();
-    QList<Station *> mOldList(mStations);
-    qStableSort(mStations.begin(), mStations.end(), Station::lessThan);
-    for (int row = 0 ; row < mStations.size() ; row++) {
-	int old_row = mOldList.indexOf(mStations[row]);
-	if (row != old_row)
-	    changePersistentIndex(createIndex(old_row, 0), createIndex(row, 0));
+    int row = mStations.size();
+    while (row > 0) {
+	if (!mStations.at(row - 1)->remove) {
+	    row--;
+	    continue;
+	}
+	int last = row - 1;
+	int first = last;
+	while (first > 0 && mStations.at(first - 1)->remove)
+	    first--;
+	beginRemoveRows(QModelIndex(), first, last);
+	for (int i = last ; i >= first ; i--) {
+	    Station *s = mStations.takeAt(i);
+	    mIndex.remove(s->ssid);
+	    delete s;
+	}
+	endRemoveRows();
+	row = first;
+    }
+
+    sortRows();
+
+    row = 0;
+    while (row < mStations.size()) {
+	if (!mStations.at(row)->changed) {
+	    row++;
+	    continue;
+	}
+	int first = row;
+	int mask = 0;
+	while (row < mStations.size() && mStations.at(row)->changed) {
+	    mask |= mStations.at(row)->changed;
+	    mStations.at(row)->changed = 0;
+	    row++;
+	}
+	QSet<int> roles;    // Empty means every role
+	if (mask != kAllRoles)
+	    for (int role = NetworkIdRole ; role <= AgeRole ; role++)
+		if (mask & roleBit(role))
+		    roles << role;
+	emit dataChanged(createIndex(first, 0), createIndex(row - 1, 0), roles);
     }
-    emit layoutChanged();
 
     // qDebug() << " > After update, combined list is";
     // for (int row = 0 ; row < mStations.size() ; row++) {
@@ -393,35 +655,579 @@ void CombinedModel::update(const android::Vector<android::ConfiguredStation>& up
     // }
 }
 
+/*
+  Put the rows in Station::lessThan order with beginMoveRows().  The
+  rows on the longest run that is already in order (the longest
+  increasing subsequence of their sorted positions) stay put; each
+  other row is moved once, to just after its sorted predecessor.
+  Station::row tracks where each station is as the rows move, so only
+  the rows a move shifts are touched.
+ */
+
+void CombinedModel::sortRows()
+{
+    int n = mStations.size();
+    QList<Station *> sorted(mStations);
+    qStableSort(sorted.begin(), sorted.end(), Station::lessThan);
+    for (int i = 0 ; i < n ; i++)
+	sorted.at(i)->order = i;
+
+    // Patience sort: tails[k] is the row ending the best run of length k+1
+    QVector<int> tails;
+    QVector<int> prev(n, -1);
+    for (int i = 0 ; i < n ; i++) {
+	int order = mStations.at(i)->order;
+	int lo = 0, hi = tails.size();
+	while (lo < hi) {
+	    int mid = (lo + hi) / 2;
+	    if (mStations.at(tails.at(mid))->order < order)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	if (lo > 0)
+	    prev[i] = tails.at(lo - 1);
+	if (lo == tails.size())
+	    tails.append(i);
+	else
+	    tails[lo] = i;
+    }
+
+    QVector<bool> stable(n, false);   // Indexed by sorted position
+    for (int i = tails.isEmpty() ? -1 : tails.last() ; i >= 0 ; i = prev.at(i))
+	stable[mStations.at(i)->order] = true;
+
+    for (int i = 0 ; i < n ; i++)
+	mStations.at(i)->row = i;
+
+    for (int k = 0 ; k < n ; k++) {
+	if (stable.at(k))
+	    continue;
+	int from = sorted.at(k)->row;
+	int to = k ? sorted.at(k - 1)->row + 1 : 0;
+	if (from == to)
+	    continue;
+	// qDebug() << " ...move row" << from << "to" << to;
+	int dest = from < to ? to - 1 : to;
+	beginMoveRows(QModelIndex(), from, from, QModelIndex(), to);
+	mStations.move(from, dest);
+	endMoveRows();
+	for (int i = qMin(from, dest) ; i <= qMax(from, dest) ; i++)
+	    mStations.at(i)->row = i;
+    }
+}
+
 int CombinedModel::rowCount(const QModelIndex&) const
 {
-    // This function is called recursively when we're updating models
-    //  so we can't grab the mutex.
-    // QMutexLocker locker(&sWifiMutex);
     return mStations.size();
 }
 
 QVariant CombinedModel::data(const QModelIndex& index, int role) const
 {
-    QMutexLocker locker(&sWifiMutex);
-    if (index.row() < 0 || index.row() > (int) mStations.size())
+    if (index.row() < 0 || index.row() >= mStations.size())
 	return QVariant();
     const Station *s = mStations.at(index.row());
     if (role == NetworkIdRole) return s->network_id;
     else if (role == SsidRole) return s->ssid;
-    else if (role == RssiRole) return s->rssi;
-    else if (role == SignalLevelRole) return rssiToLevel(s->rssi);
+    else if (role == RssiRole) return s->shown_rssi;
+    else if (role == SignalLevelRole) return s->filter.level();
     else if (role == NoteRole) return s->createNote();
     else if (role == StatusRole) return s->status;
     else if (role == StationCountRole) return s->station_count;
     else if (role == FlagsRole) return s->flags;
     else if (role == KeyMgmtRole) return s->key_mgmt;
     else if (role == PreSharedKeyRole) return s->pre_shared_key;
+    else if (role == StaleRole) return s->stale;
+    else if (role == AgeRole) return s->age;
+    return QVariant();
+}
+
+// ------------------------------------------------------------
+
+const int kMaxMissedScans = 3;     // Scans an access point may miss before it is dropped
+const int kRoamDelta      = 8;     // dB a candidate must beat the incumbent by
+const int kFiveGhzBonus   = 5;     // dB credited to a usable 5 GHz access point
+const int kFiveGhzMinRssi = -70;   // Below this the bonus doesn't apply
+
+struct AccessPoint {
+    AccessPoint(const QString& inBssid)
+	: bssid(inBssid), frequency(0), lastSeen(0), missed(0) {}
+
+    bool    is5GHz() const { return frequency >= 4900; }
+    int     score() const {
+	int value = filter.value();
+	if (is5GHz() && value >= kFiveGhzMinRssi)
+	    value += kFiveGhzBonus;
+	return value;
+    }
+
+    QString    bssid;
+    int        frequency;
+    RssiFilter filter;
+    qint64     lastSeen;     // ms since the epoch
+    int        missed;       // Scans since it was last seen
+};
+
+struct AccessPointGroup {
+    AccessPointGroup(const QString& inSsid)
+	: ssid(inSsid), best(0), rows(0), fetched(false), changed(false) {}
+    ~AccessPointGroup() { qDeleteAll(aps); }
+
+    QString ssid;
+    QList<AccessPoint *> aps;     // In the order first seen
+    AccessPoint *best;
+    int     rows;                 // Child rows the views know about
+    bool    fetched;
+    bool    changed;
+};
+
+AccessPointModel::AccessPointModel(QObject *parent)
+    : QAbstractItemModel(parent)
+{
+    QHash<int, QByteArray> roles;
+    roles[SsidRole]             = "ssid";
+    roles[BssidRole]            = "bssid";
+    roles[FrequencyRole]        = "frequency";
+    roles[BandRole]             = "band";
+    roles[RssiRole]             = "rssi";
+    roles[SignalLevelRole]      = "signalLevel";
+    roles[LastSeenRole]         = "lastSeen";
+    roles[BestRole]             = "best";
+    roles[CurrentRole]          = "current";
+    roles[AccessPointCountRole] = "accessPointCount";
+    setRoleNames(roles);
+}
+
+AccessPointModel::~AccessPointModel()
+{
+    qDeleteAll(mGroups);
+}
+
+/*
+  New access points are appended to their group and made visible with
+  one insert per group; new SSIDs are inserted in one batch at the end.
+  Rows are never reordered, so an expanded SSID stays where it was.
+ */
+
+void AccessPointModel::update(const WifiScanList& update, qint64 when)
+{
+    foreach (AccessPointGroup *g, mGroups)
+	foreach (AccessPoint *ap, g->aps)
+	    ap->missed++;
+
+    QList<AccessPointGroup *> added;
+    for (int i = 0 ; i < update.size() ; i++) {
+	const WifiScanRecord& scanned(update.at(i));
+	AccessPointGroup *g = mIndex.value(scanned.ssid);
+	if (!g) {
+	    g = new AccessPointGroup(scanned.ssid);
+	    mIndex.insert(scanned.ssid, g);
+	    added.append(g);
+	}
+	AccessPoint *ap = 0;
+	foreach (AccessPoint *candidate, g->aps) {
+	    if (candidate->bssid == scanned.bssid) {
+		ap = candidate;
+		break;
+	    }
+	}
+	if (!ap) {
+	    ap = new AccessPoint(scanned.bssid);
+	    g->aps.append(ap);
+	}
+	ap->frequency = scanned.frequency;
+	ap->filter.add(scanned.rssi);
+	ap->lastSeen = when;
+	ap->missed = 0;
+	g->changed = true;
+    }
+
+    // Drop access points that have been gone too long, then SSIDs
+    // that have none left
+    for (int row = mGroups.size() - 1 ; row >= 0 ; row--) {
+	AccessPointGroup *g = mGroups.at(row);
+	QModelIndex parent = createIndex(row, 0);
+	for (int i = g->aps.size() - 1 ; i >= 0 ; i--) {
+	    if (g->aps.at(i)->missed < kMaxMissedScans)
+		continue;
+	    bool visible = (i < g->rows);
+	    if (visible)
+		beginRemoveRows(parent, i, i);
+	    AccessPoint *ap = g->aps.takeAt(i);
+	    if (ap == g->best)
+		g->best = 0;
+	    delete ap;
+	    g->changed = true;
+	    if (visible) {
+		g->rows--;
+		endRemoveRows();
+	    }
+	}
+	if (g->aps.isEmpty()) {
+	    beginRemoveRows(QModelIndex(), row, row);
+	    mGroups.removeAt(row);
+	    mIndex.remove(g->ssid);
+	    delete g;
+	    endRemoveRows();
+	}
+    }
+
+    for (int row = 0 ; row < mGroups.size() ; row++) {
+	AccessPointGroup *g = mGroups.at(row);
+	if (g->fetched && g->aps.size() > g->rows) {
+	    beginInsertRows(createIndex(row, 0), g->rows, g->aps.size() - 1);
+	    g->rows = g->aps.size();
+	    endInsertRows();
+	}
+	chooseBest(g);
+	if (g->changed)
+	    groupChanged(g, true);
+    }
+
+    if (added.size()) {
+	int first = mGroups.size();
+	beginInsertRows(QModelIndex(), first, first + added.size() - 1);
+	foreach (AccessPointGroup *g, added) {
+	    chooseBest(g);
+	    g->changed = false;
+	    mGroups.append(g);
+	}
+	endInsertRows();
+    }
+}
+
+void AccessPointModel::setCurrentBssid(const QString& bssid)
+{
+    if (bssid == mCurrentBssid)
+	return;
+    QString old = mCurrentBssid;
+    mCurrentBssid = bssid;
+    foreach (AccessPointGroup *g, mGroups) {
+	foreach (AccessPoint *ap, g->aps) {
+	    if (ap->bssid == old || ap->bssid == bssid) {
+		chooseBest(g);
+		groupChanged(g, true);
+		break;
+	    }
+	}
+    }
+}
+
+/*
+  Only access points seen on the last scan are candidates.  If none
+  were, the previous choice stands.
+ */
+
+bool AccessPointModel::chooseBest(AccessPointGroup *group)
+{
+    AccessPoint *top = 0, *current = 0;
+    bool previousSeen = false;
+    foreach (AccessPoint *ap, group->aps) {
+	if (ap->missed)
+	    continue;
+	if (ap->bssid == mCurrentBssid)
+	    current = ap;
+	if (ap == group->best)
+	    previousSeen = true;
+	if (!top || ap->score() > top->score())
+	    top = ap;
+    }
+    if (!top)
+	return false;
+
+    AccessPoint *best = top;
+    AccessPoint *incumbent = current ? current : (previousSeen ? group->best : 0);
+    if (incumbent && top->score() < incumbent->score() + kRoamDelta)
+	best = incumbent;
+    if (best == group->best)
+	return false;
+    group->best = best;
+    group->changed = true;
+    return true;
+}
+
+void AccessPointModel::groupChanged(AccessPointGroup *group, bool children)
+{
+    group->changed = false;
+    int row = mGroups.indexOf(group);
+    if (row < 0)
+	return;
+    QModelIndex parent = createIndex(row, 0);
+    emit dataChanged(parent, parent);
+    if (children && group->rows)
+	emit dataChanged(createIndex(0, 0, group), createIndex(group->rows - 1, 0, group));
+}
+
+// Child indexes carry their group; top level indexes carry nothing
+AccessPointGroup *AccessPointModel::groupAt(const QModelIndex& index) const
+{
+    if (!index.isValid())
+	return 0;
+    if (index.internalPointer())
+	return static_cast<AccessPointGroup *>(index.internalPointer());
+    if (index.row() < 0 || index.row() >= mGroups.size())
+	return 0;
+    return mGroups.at(index.row());
+}
+
+QModelIndex AccessPointModel::index(int row, int column, const QModelIndex& parent) const
+{
+    if (row < 0 || column != 0)
+	return QModelIndex();
+    if (!parent.isValid())
+	return row < mGroups.size() ? createIndex(row, 0) : QModelIndex();
+    AccessPointGroup *g = groupAt(parent);
+    if (!g || parent.internalPointer() || row >= g->rows)
+	return QModelIndex();
+    return createIndex(row, 0, g);
+}
+
+QModelIndex AccessPointModel::parent(const QModelIndex& child) const
+{
+    if (!child.isValid() || !child.internalPointer())
+	return QModelIndex();
+    int row = mGroups.indexOf(static_cast<AccessPointGroup *>(child.internalPointer()));
+    return row < 0 ? QModelIndex() : createIndex(row, 0);
+}
+
+int AccessPointModel::rowCount(const QModelIndex& parent) const
+{
+    if (!parent.isValid())
+	return mGroups.size();
+    if (parent.internalPointer())
+	return 0;
+    AccessPointGroup *g = groupAt(parent);
+    return g ? g->rows : 0;
+}
+
+int AccessPointModel::columnCount(const QModelIndex&) const
+{
+    return 1;
+}
+
+bool AccessPointModel::hasChildren(const QModelIndex& parent) const
+{
+    if (!parent.isValid())
+	return !mGroups.isEmpty();
+    if (parent.internalPointer())
+	return false;
+    AccessPointGroup *g = groupAt(parent);
+    return g && !g->aps.isEmpty();
+}
+
+bool AccessPointModel::canFetchMore(const QModelIndex& parent) const
+{
+    if (!parent.isValid() || parent.internalPointer())
+	return false;
+    AccessPointGroup *g = groupAt(parent);
+    return g && !g->fetched;
+}
+
+void AccessPointModel::fetchMore(const QModelIndex& parent)
+{
+    if (!canFetchMore(parent))
+	return;
+    AccessPointGroup *g = groupAt(parent);
+    g->fetched = true;
+    if (g->aps.size()) {
+	beginInsertRows(parent, 0, g->aps.size() - 1);
+	g->rows = g->aps.size();
+	endInsertRows();
+    }
+}
+
+QVariant AccessPointModel::data(const QModelIndex& index, int role) const
+{
+    AccessPointGroup *g = groupAt(index);
+    if (!g)
+	return QVariant();
+    bool child = (index.internalPointer() != 0);
+    if (child && index.row() >= g->rows)
+	return QVariant();
+
+    if (role == SsidRole)
+	return g->ssid;
+    if (role == AccessPointCountRole)
+	return child ? 0 : g->aps.size();
+    if (role == CurrentRole && !child) {
+	foreach (const AccessPoint *ap, g->aps)
+	    if (ap->bssid == mCurrentBssid)
+		return true;
+	return false;
+    }
+
+    const AccessPoint *ap = child ? g->aps.at(index.row()) : g->best;
+    if (!ap)
+	return QVariant();
+    if (role == BssidRole) return ap->bssid;
+    else if (role == FrequencyRole) return ap->frequency;
+    else if (role == BandRole) return ap->is5GHz() ? QStringLiteral("5 GHz") : QStringLiteral("2.4 GHz");
+    else if (role == RssiRole) return ap->filter.value();
+    else if (role == SignalLevelRole) return ap->filter.level();
+    else if (role == LastSeenRole) return QDateTime::fromMSecsSinceEpoch(ap->lastSeen);
+    else if (role == BestRole) return ap == g->best;
+    else if (role == CurrentRole) return ap->bssid == mCurrentBssid;
     return QVariant();
 }
 
 // ------------------------------------------------------------
 
+const int kMinScanInterval = 4000;   // ms between any two scans
+const int kDegradedRssi    = -75;    // A connected link below this is degrading
+
+// Scan interval in ms for each mode: the first interval after entering
+// the mode, and the ceiling it doubles up to
+static const struct {
+    int base, max;
+} kScanIntervals[] = {
+    {      0,      0 },   // PAUSED
+    {  10000,  10000 },   // FOREGROUND
+    {  15000,  15000 },   // DEGRADED
+    {  20000, 320000 },   // DISCONNECTED
+    {  60000, 960000 },   // CONNECTED
+};
+
+WifiScanScheduler::WifiScanScheduler(Wifi *wifi)
+    : QObject(wifi)
+    , mWifi(wifi)
+    , mMode(PAUSED)
+    , mInterval(0)
+    , mForeground(false)
+    , mDeferredActive(false)
+    , mHeldRequest(false)
+{
+    mTimer.setSingleShot(true);
+    connect(&mTimer, SIGNAL(timeout()), SLOT(timeout()));
+    mDeferTimer.setSingleShot(true);
+    connect(&mDeferTimer, SIGNAL(timeout()), SLOT(deferredScan()));
+
+    connect(wifi, SIGNAL(driverStateChanged()), SLOT(reevaluate()));
+    connect(wifi, SIGNAL(activeChanged()), SLOT(reevaluate()));
+    connect(wifi, SIGNAL(rssiChanged()), SLOT(reevaluate()));
+#ifndef KLAATU_HOST
+    connect(ScreenControl::instance(), SIGNAL(stateChanged()), SLOT(reevaluate()));
+#endif
+}
+
+void WifiScanScheduler::setForeground(bool foreground)
+{
+    mForeground = foreground;
+    reevaluate();
+}
+
+void WifiScanScheduler::reevaluate()
+{
+#ifndef KLAATU_HOST
+    bool asleep = (ScreenControl::instance()->state() == ScreenControl::SLEEP);
+#else
+    bool asleep = false;   // No screen to follow
+#endif
+
+    Mode mode;
+    if (mWifi->driverState() != Wifi::ENABLED || asleep)
+	mode = PAUSED;
+    else if (mForeground)
+	mode = FOREGROUND;
+    else if (mWifi->active() && mWifi->rssi() < kDegradedRssi)
+	mode = DEGRADED;
+    else if (!mWifi->active())
+	mode = DISCONNECTED;
+    else
+	mode = CONNECTED;
+
+    if (mode == mMode)
+	return;
+
+    Mode old = mMode;
+    mMode = mode;
+    if (mode == PAUSED) {
+	mTimer.stop();
+	if (mDeferTimer.isActive()) {
+	    mDeferTimer.stop();
+	    mHeldRequest = true;
+	}
+	emit intervalChanged();
+	return;
+    }
+
+    setInterval(kScanIntervals[mode].base);
+    bool held = mHeldRequest;
+    mHeldRequest = false;
+    if (mode == FOREGROUND || mode == DEGRADED || held) {
+	// Don't make the user wait a full interval
+	bool active = (mode == FOREGROUND || mDeferredActive);
+	mDeferredActive = false;
+	requestScan(active);
+    }
+    mTimer.start(mInterval);
+    if (old == PAUSED)
+	emit resumed();
+}
+
+void WifiScanScheduler::setInterval(int interval)
+{
+    if (interval != mInterval) {
+	mInterval = interval;
+	emit intervalChanged();
+    }
+}
+
+void WifiScanScheduler::timeout()
+{
+    if (mMode == PAUSED)
+	return;
+    requestScan(mMode == FOREGROUND);
+    setInterval(qMin(mInterval * 2, kScanIntervals[mMode].max));
+    mTimer.start(mInterval);
+}
+
+/*
+  Results also arrive from scans the supplicant starts on its own.
+  Fresh results push the next scheduled scan back by a full interval.
+ */
+
+void WifiScanScheduler::scanResultsArrived()
+{
+    mLastScan.start();
+    if (mTimer.isActive())
+	mTimer.start(mInterval);
+}
+
+/*
+  While PAUSED nothing looks at the results and the radio should stay
+  quiet, so a request is only remembered and made on resume.
+ */
+
+void WifiScanScheduler::requestScan(bool active)
+{
+    if (mMode == PAUSED) {
+	mDeferredActive = mDeferredActive || active;
+	mHeldRequest = true;
+	return;
+    }
+    if (mLastScan.isValid() && mLastScan.elapsed() < kMinScanInterval) {
+	// Too soon: fold into one scan at the end of the window
+	mDeferredActive = mDeferredActive || active;
+	if (!mDeferTimer.isActive())
+	    mDeferTimer.start(kMinScanInterval - mLastScan.elapsed());
+	return;
+    }
+    mLastScan.start();
+    mWifi->backend()->startScan(active);
+}
+
+void WifiScanScheduler::deferredScan()
+{
+    bool active = mDeferredActive;
+    mDeferredActive = false;
+    requestScan(active);
+}
+
+// ------------------------------------------------------------
+
+const int kDefaultRssiInterval        = 2000;   // ms
+const int kDefaultSignalLevelInterval = 1000;
+
 // This is sometimes called from the non-main thread.
 Wifi * Wifi::instance() 
 {
@@ -437,244 +1243,459 @@ Wifi * Wifi::instance()
 /* For the moment we assume only the wlan0 interface */
 
 Wifi::Wifi()
-    : mActive(false)
-    , mDriverState(UNKNOWN)
-    , mDisplayState(DISCONNECTED)
-    , mNetworkId(-1)
-    , mRssi(-9999)
-    , mSignalLevel(-1)
-    , mLinkSpeed(-1)
+    : mDriverState(UNKNOWN)
+    , mConnection(new Connection)
+    , mIncoming(0)
+    , mBackend(sBackend ? sBackend : new DefaultWifiBackend)
+    , mScanHeld(false)
+    , mCache(0)
+    , mScanTime(0)
+    , mScanCached(false)
+    , mPendingPosted(false)
+    , mPendingFlags(0)
+    , mPendingState(UNKNOWN)
 {
+    memset(&mStats, 0, sizeof(mStats));
+
     mStationModel = new ScannedStationModel(this);
     mConfiguredModel = new ConfiguredStationModel(this);
     mCombinedModel = new CombinedModel(this);
+    mAccessPointModel = new AccessPointModel(this);
+
+    mRssiLimiter = new EmitRateLimiter(kDefaultRssiInterval, this);
+    connect(mRssiLimiter, SIGNAL(fire()), SIGNAL(rssiChanged()));
+    mSignalLevelLimiter = new EmitRateLimiter(kDefaultSignalLevelInterval, this);
+    connect(mSignalLevelLimiter, SIGNAL(fire()), SIGNAL(signalLevelChanged()));
+
+    mScanScheduler = new WifiScanScheduler(this);
+    connect(mScanScheduler, SIGNAL(intervalChanged()), SIGNAL(scanIntervalChanged()));
+    connect(mScanScheduler, SIGNAL(resumed()), SLOT(applyHeldScan()));
+
+    if (!sCacheFile.isEmpty()) {
+	mCache = new WifiCache(sCacheFile, this);
+	restoreCache();
+    }
+
+    mBackend->registerClient();
+}
+
+WifiBackend *Wifi::sBackend = 0;
 
-    MyWifiClient *client = MyWifiClient::instance();
-    client->Register(android::WIFI_CLIENT_FLAG_BROADCAST);
+void Wifi::setBackend(WifiBackend *backend)
+{
+    sBackend = backend;
+}
+
+QString Wifi::sCacheFile;
+
+void Wifi::setCacheFile(const QString& path)
+{
+    sCacheFile = path;
 }
 
 Wifi::~Wifi()
+{
+    delete mBackend;
+    delete mIncoming.load();
+}
+
+Wifi::Connection::Connection()
+    : displayState(DISCONNECTED)
+    , networkId(-1)
+    , rssi(-9999)
+    , signalLevel(-1)
+    , linkSpeed(-1)
+    , active(false)
 {
 }
 
 
 void Wifi::setEnabled(bool value)
 {
-    MyWifiClient::instance()->SetEnabled(value);
+    mBackend->setEnabled(value);
 }
 
 void Wifi::enableRssiPolling(bool enable)
 {
-    MyWifiClient::instance()->EnableRssiPolling(enable);
+    mBackend->enableRssiPolling(enable);
 }
 
 void Wifi::startScan(bool active)
 {
-    MyWifiClient::instance()->StartScan(active);
+    mScanScheduler->requestScan(active);
 }
 
-void Wifi::addOrUpdateNetwork(const QString& ssid, const QString& password)
+void Wifi::setRssiInterval(int interval)
 {
-    android::ConfiguredStation config;
-    config.ssid = ssid.toLocal8Bit();
-    if (!password.isEmpty()) {
-	config.key_mgmt = "WPA-PSK";
-	config.pre_shared_key = password.toLocal8Bit();
+    if (interval != mRssiLimiter->interval()) {
+	mRssiLimiter->setInterval(interval);
+	emit rssiIntervalChanged();
     }
-    else {
-	config.key_mgmt = "NONE";
+}
+
+void Wifi::setSignalLevelInterval(int interval)
+{
+    if (interval != mSignalLevelLimiter->interval()) {
+	mSignalLevelLimiter->setInterval(interval);
+	emit signalLevelIntervalChanged();
     }
-    MyWifiClient::instance()->AddOrUpdateNetwork(config);
+}
+
+void Wifi::setScanForeground(bool foreground)
+{
+    if (foreground != mScanScheduler->foreground()) {
+	mScanScheduler->setForeground(foreground);
+	emit scanForegroundChanged();
+    }
+}
+
+void Wifi::addOrUpdateNetwork(const QString& ssid, const QString& password)
+{
+    WifiConfigRecord config;
+    config.ssid           = ssid;
+    config.pre_shared_key = password;
+    config.network_id     = -1;
+    config.status         = 0;
+    config.key_mgmt       = password.isEmpty() ? KEYMGMT_NONE : KEYMGMT_WPA;
+    mBackend->addOrUpdateNetwork(config);
 }
 
 void Wifi::removeNetwork(int network_id)
 {
-    MyWifiClient::instance()->RemoveNetwork(network_id);
+    mBackend->removeNetwork(network_id);
 }
 
 void Wifi::selectNetwork(int network_id)
 {
-    MyWifiClient::instance()->SelectNetwork(network_id);
+    mBackend->selectNetwork(network_id);
 }
 
 void Wifi::reconnect()
 {
-    MyWifiClient::instance()->Reconnect();
+    mBackend->reconnect();
 }
 
 void Wifi::disconnect()
 {
-    MyWifiClient::instance()->Disconnect();
+    mBackend->disconnect();
 }
 
 void Wifi::reassociate()
 {
-    MyWifiClient::instance()->Reassociate();
+    mBackend->reassociate();
 }
 
+/*
+  The connection fields live in an immutable snapshot that is replaced
+  as a whole by applyConnection().  Both that and the getters run only
+  on the GUI thread; the binder threads just hand over new snapshots
+  through mIncoming.  A getter is therefore a plain pointer load.
+ */
+
 bool Wifi::active() const
 {
-    QMutexLocker _l(&sWifiMutex);
-    return mActive; 
+    return mConnection->active;
 }
 
 Wifi::DriverState Wifi::driverState() const 
 { 
-    QMutexLocker _l(&sWifiMutex);
-    return mDriverState; 
+    return static_cast<DriverState>(mDriverState.load());
 }
 
 Wifi::DisplayState Wifi::displayState() const 
 { 
-    QMutexLocker _l(&sWifiMutex);
-     return mDisplayState; 
+    return mConnection->displayState;
 }
 
 int Wifi::networkId() const 
 { 
-    QMutexLocker _l(&sWifiMutex);
-    return mNetworkId; 
+    return mConnection->networkId;
 }
 
 QString Wifi::bssid() const 
 { 
-    QMutexLocker _l(&sWifiMutex);
-    return mBssid; 
+    return mConnection->bssid;
 }
 
 QString Wifi::ssid() const 
 { 
-    QMutexLocker _l(&sWifiMutex);
-    return mSsid; 
+    return mConnection->ssid;
 }
 
 QString Wifi::ipaddr() const 
 { 
-    QMutexLocker _l(&sWifiMutex);
-    return mIPAddress; 
+    return mConnection->ipaddr;
 }
 
 QString Wifi::macaddr() const 
 { 
-    QMutexLocker _l(&sWifiMutex);
-    return mMacAddress; 
+    return mConnection->macaddr;
 }
 
 int Wifi::rssi() const 
 { 
-    QMutexLocker _l(&sWifiMutex);
-    return mRssi; 
+    return mConnection->rssi;
 }
 
 int Wifi::signalLevel() const 
 { 
-    QMutexLocker _l(&sWifiMutex);
-    return mSignalLevel; 
+    return mConnection->signalLevel;
 }
 
 int Wifi::linkSpeed() const 
 { 
-    QMutexLocker _l(&sWifiMutex);
-    return mLinkSpeed; 
+    return mConnection->linkSpeed;
 }
 
-void Wifi::setState(android::WifiState state)
+/*
+  The set* functions run on a binder thread.  Each one converts its
+  data into records (see StringPool) and posts applyPending() to the
+  GUI thread if it isn't already queued.  A burst of callbacks
+  therefore costs one model update per event loop turn, using the
+  latest data of each kind.
+ */
+
+void Wifi::setState(DriverState state)
 {
-    QMutexLocker _l(&sWifiMutex);
-    DriverState s = static_cast<DriverState>(state);
-    if (s != mDriverState) {
-	mDriverState = s;
-	emit driverStateChanged();
-    }
+    QMutexLocker _l(&mPendingLock);
+    mPendingState = state;
+    postPendingLocked(PENDING_STATE);
 }
 
-void Wifi::setScanResults(const android::Vector<android::ScannedStation>& scandata)
+void Wifi::setScanResults(const WifiScanList& list)
 {
-    // fprintf(stderr, "Wifi::setScanResults (%d)\n", scandata.size());
-    mStationModel->update(scandata);
-    emit stationModelChanged();
-    mCombinedModel->update(scandata);
-    emit combinedModelChanged();
+    QMutexLocker _l(&mPendingLock);
+    mPendingScan = list;
+    postPendingLocked(PENDING_SCAN);
 }
 
-void Wifi::setConfiguredStations(const android::Vector<android::ConfiguredStation>& configdata)
+void Wifi::setConfiguredStations(const WifiConfigList& list)
 {
-    // fprintf(stderr, "Wifi::setConfiguredStations (%d)\n", configdata.size());
-    mConfiguredModel->update(configdata);
-    emit configuredModelChanged();
-    mCombinedModel->update(configdata);
-    emit combinedModelChanged();
+    QMutexLocker _l(&mPendingLock);
+    mPendingConfig = list;
+    postPendingLocked(PENDING_CONFIG);
 }
 
-static Wifi::DisplayState _infoToDisplayState(const android::WifiInformation& info)
+static Wifi::DisplayState _infoToDisplayState(const WifiInfoRecord& info)
 {
     if (info.supplicant_state != Wifi::COMPLETED)
 	return static_cast<Wifi::DisplayState>(info.supplicant_state);
-    if (info.ipaddr.size() == 0)
+    if (info.ipaddr.isEmpty())
 	return Wifi::ACQUIRING_DHCP;
     return Wifi::FULLY_CONFIGURED;
 }
 
-void Wifi::setInformation(const android::WifiInformation& info)
+/*
+  The snapshot for new connection information is built here, on the
+  caller's thread.  Only the newest unapplied snapshot is kept.
+ */
+
+void Wifi::setInformation(const WifiInfoRecord& info)
 {
-    // fprintf(stderr, "Wifi::setInformation)\n");
-    QMutexLocker _l(&sWifiMutex);
+    Connection *c = new Connection;
+    c->displayState = _infoToDisplayState(info);
+    c->networkId    = info.network_id;
+    c->bssid        = info.bssid;
+    c->ssid         = info.ssid;
+    c->ipaddr       = info.ipaddr;
+    c->macaddr      = info.macaddr;
+    c->rssi         = info.rssi;          // Smoothed in applyConnection()
+    c->linkSpeed    = info.link_speed;
+    c->active       = (c->displayState == Wifi::FULLY_CONFIGURED);
+    delete mIncoming.fetchAndStoreOrdered(c);
+
+    QMutexLocker _l(&mPendingLock);
+    postPendingLocked(PENDING_INFO);
+}
 
-    QString ipaddr = QString::fromLocal8Bit(info.ipaddr.string());
-    if (ipaddr != mIPAddress) {
-	mIPAddress = ipaddr;
-	emit ipaddrChanged();
+void Wifi::postPendingLocked(int flag)
+{
+    mPendingFlags |= flag;
+    if (!mPendingPosted) {
+	mPendingPosted = true;
+	QMetaObject::invokeMethod(this, "applyPending", Qt::QueuedConnection);
     }
+}
 
-    QString macaddr = QString::fromLocal8Bit(info.macaddr.string());
-    if (macaddr != mMacAddress) {
-	mMacAddress = macaddr;
-	emit macaddrChanged();
+void Wifi::applyPending()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    DriverState state;
+    WifiScanList scandata;
+    WifiConfigList configdata;
+
+    mPendingLock.lock();
+    int flags = mPendingFlags;
+    state = mPendingState;
+    if (flags & PENDING_SCAN) {
+	scandata = mPendingScan;
+	mPendingScan.clear();
     }
-
-    QString bssid = QString::fromLocal8Bit(info.bssid.string());
-    if (bssid != mBssid) {
-	mBssid = bssid;
-	emit bssidChanged();
+    if (flags & PENDING_CONFIG) {
+	configdata = mPendingConfig;
+	mPendingConfig.clear();
     }
-
-    QString ssid = QString::fromLocal8Bit(info.ssid.string());
-    if (ssid != mSsid) {
-	mSsid = ssid;
-	emit ssidChanged();
+    mPendingFlags = 0;
+    mPendingPosted = false;
+    mPendingLock.unlock();
+
+    if (flags & PENDING_STATE)
+	applyState(state);
+    if (flags & PENDING_CONFIG) {
+	mConfiguredModel->update(configdata);
+	emit configuredModelChanged();
+	mCombinedModel->update(configdata);
+	emit combinedModelChanged();
+	saveCache();
     }
-
-    DisplayState s = _infoToDisplayState(info);
-    if (mDisplayState != s) {
-	mDisplayState = s;
-	emit displayStateChanged();
+    if (flags & PENDING_SCAN) {
+	mScanScheduler->scanResultsArrived();
+	if (mScanScheduler->mode() == WifiScanScheduler::PAUSED) {
+	    // Nobody is looking; keep only the latest results for later
+	    mHeldScan = scandata;
+	    mScanHeld = true;
+	}
+	else
+	    applyScan(scandata);
+    }
+    if (flags & PENDING_INFO) {
+	Connection *c = mIncoming.fetchAndStoreOrdered(0);
+	if (c)
+	    applyConnection(c);
     }
 
-    if (mNetworkId != info.network_id) {
-	mNetworkId = info.network_id;
-	emit networkIdChanged();
+    mStats.updates++;
+    if (flags & PENDING_SCAN) {
+	mStats.scans++;
+	mStats.stations += scandata.size();
     }
+    qint64 elapsed = timer.nsecsElapsed();
+    mStats.totalNs += elapsed;
+    if (elapsed > mStats.maxNs)
+	mStats.maxNs = elapsed;
+}
+
+/*
+  The timings cover the model updates and whatever the views connected
+  to the models do synchronously in response.
+ */
+
+QVariantMap Wifi::updateStats() const
+{
+    QVariantMap result;
+    result.insert(QStringLiteral("updates"), mStats.updates);
+    result.insert(QStringLiteral("scans"), mStats.scans);
+    result.insert(QStringLiteral("stations"), mStats.stations);
+    result.insert(QStringLiteral("meanUs"),
+		  mStats.updates ? mStats.totalNs / 1000.0 / mStats.updates : 0.0);
+    result.insert(QStringLiteral("maxUs"), mStats.maxNs / 1000.0);
+    return result;
+}
+
+void Wifi::resetUpdateStats()
+{
+    memset(&mStats, 0, sizeof(mStats));
+}
 
-    if (info.link_speed != mLinkSpeed) {
-	mLinkSpeed = info.link_speed;
-	emit linkSpeedChanged();
+void Wifi::applyScan(const WifiScanList& scandata)
+{
+    mScanTime = QDateTime::currentMSecsSinceEpoch();
+    mStationModel->update(scandata);
+    emit stationModelChanged();
+    mCombinedModel->update(scandata);
+    emit combinedModelChanged();
+    mAccessPointModel->update(scandata, mScanTime);
+    emit accessPointModelChanged();
+
+    if (mScanCached) {
+	mScanCached = false;
+	emit scanCachedChanged();
     }
+    saveCache();
+}
 
-    if (mRssi != info.rssi) {
-	int signal_level = rssiToLevel(info.rssi);
-	if (signal_level != mSignalLevel) {
-	    mSignalLevel = signal_level;
-	    emit signalLevelChanged();
-	}
+/*
+  Fill the models from the cache before the first callback can arrive.
+  The first real scan then updates the restored rows in place.  Scan
+  results older than kMaxCacheAge are not worth showing.
+ */
+
+const qint64 kMaxCacheAge = 24 * 3600 * 1000;   // ms
 
-	mRssi = info.rssi;
-	emit rssiChanged();
+void Wifi::restoreCache()
+{
+    WifiScanList scandata;
+    WifiConfigList configdata;
+    qint64 scanTime;
+    if (!mCache->load(&scandata, &scanTime, &configdata))
+	return;
+
+    qint64 age = QDateTime::currentMSecsSinceEpoch() - scanTime;
+    if (age < 0 || age > kMaxCacheAge)
+	scandata.clear();
+
+    mConfiguredModel->update(configdata);
+    mCombinedModel->update(configdata);
+    if (scandata.size()) {
+	mStationModel->update(scandata);
+	mCombinedModel->update(scandata, age / 1000);
+	mAccessPointModel->update(scandata, scanTime);
+	mScanTime = scanTime;
+	mScanCached = true;
     }
+}
 
-    bool active = (mDisplayState == Wifi::FULLY_CONFIGURED);
-    if (active != mActive) {
-	mActive = active;
-	emit activeChanged();
+void Wifi::saveCache()
+{
+    if (mCache)
+	mCache->save(mStationModel->stations(), mScanTime, mConfiguredModel->stations());
+}
+
+void Wifi::applyHeldScan()
+{
+    if (mScanHeld) {
+	mScanHeld = false;
+	applyScan(mHeldScan);
+	mHeldScan.clear();
     }
 }
 
+void Wifi::applyState(DriverState state)
+{
+    if (mDriverState.fetchAndStoreOrdered(state) != state)
+	emit driverStateChanged();
+}
+
+
+/*
+  Publish a new connection snapshot and emit the signals for the fields
+  that differ from the previous one.
+ */
+
+void Wifi::applyConnection(Connection *c)
+{
+    QSharedPointer<const Connection> old = mConnection;
+
+    // The filter is GUI-thread state, so the smoothing happens here
+    // rather than on the binder thread
+    if (c->bssid != old->bssid) {
+	mRssiFilter.reset();
+	mAccessPointModel->setCurrentBssid(c->bssid);
+    }
+    c->rssi = mRssiFilter.add(c->rssi);
+    c->signalLevel = mRssiFilter.level();
+    mConnection = QSharedPointer<const Connection>(c);
+
+    if (c->ipaddr != old->ipaddr)             emit ipaddrChanged();
+    if (c->macaddr != old->macaddr)           emit macaddrChanged();
+    if (c->bssid != old->bssid)               emit bssidChanged();
+    if (c->ssid != old->ssid)                 emit ssidChanged();
+    if (c->displayState != old->displayState) emit displayStateChanged();
+    if (c->networkId != old->networkId)       emit networkIdChanged();
+    if (c->linkSpeed != old->linkSpeed)       emit linkSpeedChanged();
+    if (c->signalLevel != old->signalLevel)   mSignalLevelLimiter->trigger();
+    if (c->rssi != old->rssi)                 mRssiLimiter->trigger();
+    if (c->active != old->active)             emit activeChanged();
+}
@@ -7,9 +7,93 @@
 
 #include <QObject>
 #include <QAbstractListModel>
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QHash>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QTimer>
+#include <QVariantMap>
+#include <QVector>
 
-#include <wifi/IWifiClient.h>
-#include <utils/Vector.h>
+/*
+  Scan results, configured networks and connection information,
+  converted from the wifi client's String8 data once when they arrive.
+  The SSID and flags strings are interned so repeated scans share them.
+  key_mgmt holds a Wifi::KeyMgmt value and supplicant_state a
+  Wifi::DisplayState value.  Nothing here depends on the wifi client
+  headers, so the models also build on a host (CONFIG += KLAATU_HOST).
+ */
+
+struct WifiScanRecord {
+    QString bssid, ssid, flags;
+    int     frequency, rssi;
+    int     key_mgmt;
+};
+
+struct WifiConfigRecord {
+    QString ssid, pre_shared_key;
+    int     network_id, status;
+    int     key_mgmt;
+};
+
+struct WifiInfoRecord {
+    QString bssid, ssid, ipaddr, macaddr;
+    int     supplicant_state, network_id, rssi, link_speed;
+};
+
+typedef QVector<WifiScanRecord>   WifiScanList;
+typedef QVector<WifiConfigRecord> WifiConfigList;
+
+/*
+  Exponentially weighted RSSI average with a signal level that only
+  changes once the average is kRssiHysteresis dB past a bar threshold.
+  An RSSI at or below -200 (no signal) resets the filter.
+ */
+
+class RssiFilter
+{
+public:
+    RssiFilter() : mValue(0), mLevel(0), mValid(false) {}
+
+    void     reset() { mValid = false; mLevel = 0; }
+    int      add(int rssi);     // Returns value()
+    int      value() const;     // Rounded average, -9999 when reset
+    int      level() const { return mLevel; }
+
+private:
+    double   mValue;
+    int      mLevel;
+    bool     mValid;
+};
+
+/*
+  Passes trigger() on as fire() no more than once per 'interval' ms.
+  A trigger inside the interval fires at its end.
+ */
+
+class EmitRateLimiter : public QObject
+{
+    Q_OBJECT
+public:
+    EmitRateLimiter(int interval, QObject *parent);
+
+    int      interval() const { return mInterval; }
+    void     setInterval(int interval) { mInterval = interval; }
+    void     trigger();
+
+signals:
+    void     fire();
+
+private slots:
+    void     timeout();
+
+private:
+    int           mInterval;
+    QTimer        mTimer;
+    QElapsedTimer mLast;
+};
 
 class ScannedStationModel : public QAbstractListModel
 {
@@ -19,12 +103,13 @@ public:
 			    FlagsRole, SsidRole };
     ScannedStationModel(QObject *parent=0);
     
-    void     update(const android::Vector<android::ScannedStation>&);
+    void     update(const WifiScanList&);
+    const WifiScanList& stations() const { return mStations; }
     int      rowCount(const QModelIndex& parent = QModelIndex()) const;
     QVariant data(const QModelIndex& index, int role=Qt::DisplayRole) const;
 
 private:
-    android::Vector<android::ScannedStation> mStations;
+    WifiScanList mStations;
 };
 
 class ConfiguredStationModel : public QAbstractListModel
@@ -34,12 +119,13 @@ public:
     enum ConfiguredStationRoles { NetworkIdRole = Qt::UserRole+1, SsidRole };
     ConfiguredStationModel(QObject *parent=0);
     
-    void     update(const android::Vector<android::ConfiguredStation>& update);
+    void     update(const WifiConfigList& update);
+    const WifiConfigList& stations() const { return mStations; }
     int      rowCount(const QModelIndex& parent = QModelIndex()) const;
     QVariant data(const QModelIndex& index, int role=Qt::DisplayRole) const;
 
 private:
-    android::Vector<android::ConfiguredStation> mStations;
+    WifiConfigList mStations;
 };
 
 class Station;
@@ -51,21 +137,150 @@ public:
     enum CombinedRoles { NetworkIdRole = Qt::UserRole+1, SsidRole,
 			 RssiRole, SignalLevelRole, NoteRole, StatusRole, 
 			 StationCountRole, FlagsRole, FrequencyRole, 
-			 KeyMgmtRole, PreSharedKeyRole };
+			 KeyMgmtRole, PreSharedKeyRole, StaleRole, AgeRole };
     CombinedModel(QObject *parent=0);
+    ~CombinedModel();
     
-    void     update(const android::Vector<android::ScannedStation>& update);
-    void     update(const android::Vector<android::ConfiguredStation>& update);
+    // 'age' >= 0 marks the results as restored from the cache, that
+    // many seconds old; they stay stale until a real scan reports them
+    void     update(const WifiScanList& update, int age = -1);
+    void     update(const WifiConfigList& update);
     int      rowCount(const QModelIndex& parent = QModelIndex()) const;
     QVariant data(const QModelIndex& index, int role=Qt::DisplayRole) const;
 
 private:
-    Station * findBySsid(const QString& ssid);
+    Station * findBySsid(const QString& ssid, QList<Station *> *added);
+    void     commit(const QList<Station *>& added);
+    void     sortRows();
 
     QList<Station*> mStations;
+    QHash<QString, Station*> mIndex;   // By SSID
 };
 
+struct AccessPointGroup;
+
+/*
+  Scan results as a two level tree: one top level row per SSID with
+  one child row per BSSID.  Access points are kept for kMaxMissedScans
+  scans after they were last seen.  Child rows are populated through
+  fetchMore(), so a view only pays for the SSIDs it expands.
 
+  Each SSID has a best roaming candidate: the access point with the
+  strongest smoothed RSSI, with a bonus for 5 GHz at a usable level.
+  The connected access point, or else the previous choice, is only
+  displaced by one that scores kRoamDelta dB better.
+
+  On a top level row the per-AP roles describe the best candidate.
+ */
+
+class AccessPointModel : public QAbstractItemModel
+{
+    Q_OBJECT
+public:
+    enum AccessPointRoles { SsidRole = Qt::UserRole+1, BssidRole, FrequencyRole, BandRole,
+			    RssiRole, SignalLevelRole, LastSeenRole, BestRole, CurrentRole,
+			    AccessPointCountRole };
+    AccessPointModel(QObject *parent=0);
+    ~AccessPointModel();
+
+    void     update(const WifiScanList& update, qint64 when);   // ms since the epoch
+    void     setCurrentBssid(const QString& bssid);
+
+    QModelIndex index(int row, int column, const QModelIndex& parent = QModelIndex()) const;
+    QModelIndex parent(const QModelIndex& child) const;
+    int      rowCount(const QModelIndex& parent = QModelIndex()) const;
+    int      columnCount(const QModelIndex& parent = QModelIndex()) const;
+    bool     hasChildren(const QModelIndex& parent = QModelIndex()) const;
+    bool     canFetchMore(const QModelIndex& parent) const;
+    void     fetchMore(const QModelIndex& parent);
+    QVariant data(const QModelIndex& index, int role=Qt::DisplayRole) const;
+
+private:
+    AccessPointGroup *groupAt(const QModelIndex& index) const;
+    bool     chooseBest(AccessPointGroup *group);
+    void     groupChanged(AccessPointGroup *group, bool children);
+
+    QList<AccessPointGroup *> mGroups;
+    QHash<QString, AccessPointGroup *> mIndex;   // By SSID
+    QString  mCurrentBssid;
+};
+
+class Wifi;
+class WifiCache;
+
+/*
+  Where Wifi sends its requests.  The default backend talks to the
+  klaatu wifi service over binder; others (see FakeWifiBackend) feed
+  Wifi through the same set* entry points the binder client uses.  A
+  host build has no binder backend and Wifi stays idle unless one is
+  set.
+ */
+
+class WifiBackend
+{
+public:
+    virtual ~WifiBackend() {}
+
+    virtual void registerClient() = 0;   // Begin delivering callbacks to Wifi
+    virtual void setEnabled(bool enabled) = 0;
+    virtual void enableRssiPolling(bool enable) = 0;
+    virtual void startScan(bool active) = 0;
+    virtual void addOrUpdateNetwork(const WifiConfigRecord& config) = 0;   // ssid, pre_shared_key, key_mgmt
+    virtual void removeNetwork(int network_id) = 0;
+    virtual void selectNetwork(int network_id) = 0;
+    virtual void reconnect() = 0;
+    virtual void disconnect() = 0;
+    virtual void reassociate() = 0;
+};
+
+/*
+  Decides when to scan.  Scans back off exponentially while nothing
+  needs them, stop while the screen is off or the driver is down, and
+  run at a fixed fast rate while the settings page is showing or the
+  link is getting weak.  Every scan, scheduled or requested, is at
+  least kMinScanInterval after the previous one.
+ */
+
+class WifiScanScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    enum Mode { PAUSED, FOREGROUND, DEGRADED, DISCONNECTED, CONNECTED };
+
+    WifiScanScheduler(Wifi *wifi);
+
+    Mode     mode() const { return mMode; }
+    int      interval() const { return mMode == PAUSED ? -1 : mInterval; }
+    bool     foreground() const { return mForeground; }
+    void     setForeground(bool);
+
+    void     requestScan(bool active);
+    void     scanResultsArrived();
+
+signals:
+    void     intervalChanged();
+    void     resumed();          // Left PAUSED
+
+public slots:
+    void     reevaluate();
+
+private slots:
+    void     timeout();
+    void     deferredScan();
+
+private:
+    void     setInterval(int interval);
+
+    Wifi         *mWifi;
+    Mode          mMode;
+    int           mInterval;     // ms until the next scheduled scan
+    bool          mForeground;
+    QTimer        mTimer;
+    QTimer        mDeferTimer;
+    bool          mDeferredActive;
+    bool          mHeldRequest;  // Requested while PAUSED
+    QElapsedTimer mLastScan;
+};
 
 /*
   Master object (singleton)
@@ -92,6 +307,12 @@ class Wifi : public QObject
     Q_PROPERTY(QObject *stationModel READ stationModel NOTIFY stationModelChanged)
     Q_PROPERTY(QObject *configuredModel READ configuredModel NOTIFY configuredModelChanged)
     Q_PROPERTY(QObject *combinedModel READ combinedModel NOTIFY combinedModelChanged)
+    Q_PROPERTY(QObject *accessPointModel READ accessPointModel NOTIFY accessPointModelChanged)
+    Q_PROPERTY(bool scanForeground READ scanForeground WRITE setScanForeground NOTIFY scanForegroundChanged)
+    Q_PROPERTY(int scanInterval READ scanInterval NOTIFY scanIntervalChanged)
+    Q_PROPERTY(bool scanCached READ scanCached NOTIFY scanCachedChanged)
+    Q_PROPERTY(int rssiInterval READ rssiInterval WRITE setRssiInterval NOTIFY rssiIntervalChanged)
+    Q_PROPERTY(int signalLevelInterval READ signalLevelInterval WRITE setSignalLevelInterval NOTIFY signalLevelIntervalChanged)
 
 public:
     enum DriverState { DISABLED, DISABLING, ENABLED, ENABLING, UNKNOWN };
@@ -114,12 +335,17 @@ public:
     enum KeyMgmt { KEYMGMT_NONE, KEYMGMT_WPA2, KEYMGMT_WPA, KEYMGMT_WEP };
 
     static Wifi *instance();
+    static KeyMgmt keyMgmtFromFlags(const char *flags);   // "[WPA2-PSK-CCMP]", "WPA-PSK", ...
+    static void setBackend(WifiBackend *backend);   // Call before instance(); takes ownership
+    static void setCacheFile(const QString& path);  // Call before instance()
     ~Wifi();
 
+    WifiBackend *backend() const { return mBackend; }
+
     // These functions are used to control the Wifi state machine
     Q_INVOKABLE void setEnabled(bool enabled);
     Q_INVOKABLE void enableRssiPolling(bool enable);
-    Q_INVOKABLE void startScan(bool active=false);
+    Q_INVOKABLE void startScan(bool active=false);   // Rate limited; see WifiScanScheduler
     Q_INVOKABLE void addOrUpdateNetwork(const QString& ssid, const QString& password=QString());
     Q_INVOKABLE void removeNetwork(int network_id);
     Q_INVOKABLE void selectNetwork(int network_id);
@@ -127,7 +353,7 @@ public:
     Q_INVOKABLE void disconnect();
     Q_INVOKABLE void reassociate();
 
-    // Standard accessor functions
+    // Standard accessor functions; GUI thread only
     bool         active() const;
     DriverState  driverState() const;
     DisplayState displayState() const;
@@ -143,14 +369,30 @@ public:
     QObject *stationModel() const { return mStationModel; }
     QObject *configuredModel() const { return mConfiguredModel; }
     QObject *combinedModel() const { return mCombinedModel; }
+    QObject *accessPointModel() const { return mAccessPointModel; }
+
+    // Set while a page that shows scan results is visible
+    bool     scanForeground() const { return mScanScheduler->foreground(); }
+    void     setScanForeground(bool);
+    int      scanInterval() const { return mScanScheduler->interval(); }   // ms, -1 while paused
+    bool     scanCached() const { return mScanCached; }   // Models show cached results
+
+    // Minimum time in ms between rssiChanged / signalLevelChanged signals
+    int      rssiInterval() const { return mRssiLimiter->interval(); }
+    void     setRssiInterval(int);
+    int      signalLevelInterval() const { return mSignalLevelLimiter->interval(); }
+    void     setSignalLevelInterval(int);
+
+    // Counts and timings of the updates applied on the GUI thread
+    Q_INVOKABLE QVariantMap updateStats() const;
+    Q_INVOKABLE void        resetUpdateStats();
 
-    // Used internally by the wifi client
-    void setState(android::WifiState);
-    void setScanResults(const android::Vector<android::ScannedStation>&);
-    void setConfiguredStations(const android::Vector<android::ConfiguredStation>&);
-    void setRssiLocked(int rssi);
-    void setLinkSpeedLocked(int link_speed);
-    void setInformation(const android::WifiInformation& info);
+    // Used internally by the wifi client.  These are called on a binder
+    // thread; the data is applied on the GUI thread.
+    void setState(DriverState);
+    void setScanResults(const WifiScanList&);
+    void setConfiguredStations(const WifiConfigList&);
+    void setInformation(const WifiInfoRecord& info);
 
 signals:
     void activeChanged();
@@ -167,27 +409,48 @@ signals:
     void stationModelChanged();
     void configuredModelChanged();
     void combinedModelChanged();
+    void accessPointModelChanged();
+    void scanForegroundChanged();
+    void scanIntervalChanged();
+    void scanCachedChanged();
+    void rssiIntervalChanged();
+    void signalLevelIntervalChanged();
+
+private slots:
+    void applyPending();
+    void applyHeldScan();
 
 private:
     Wifi();
+    void postPendingLocked(int flag);
+    void applyState(DriverState);
+    void applyScan(const WifiScanList&);
+    void restoreCache();
+    void saveCache();
+
+    // Connection state, replaced as a whole on the GUI thread, which is
+    // the only thread that may call the getters (see the getters)
+    struct Connection {
+	Connection();
+	DisplayState displayState;  // Complete "displayable" state
+	int          networkId;
+	QString      bssid, ssid, ipaddr, macaddr;
+	int          rssi, signalLevel, linkSpeed;
+	bool         active;        // Check this one variable if you need networking
+    };
+
+    void applyConnection(Connection *c);
 		   
 private:
-    // Check this one variable if you need networking
-    bool                       mActive;
-
     // Basic enable/disable
-    DriverState                mDriverState;  // Interface enabled / disabled
+    QAtomicInt                 mDriverState;  // Interface enabled / disabled
 
     // Information from WPA Supplicant
-    DisplayState               mDisplayState;  // Complete "displayable" state
-    int                        mNetworkId;
-    QString                    mBssid;
-    QString                    mSsid;
-    QString                    mIPAddress;
-    QString                    mMacAddress;
-    int                        mRssi;
-    int                        mSignalLevel;
-    int                        mLinkSpeed;
+    QSharedPointer<const Connection> mConnection;  // GUI thread only
+    QAtomicPointer<Connection> mIncoming;       // Built by the binder thread
+    RssiFilter                 mRssiFilter;     // GUI thread
+    EmitRateLimiter           *mRssiLimiter;
+    EmitRateLimiter           *mSignalLevelLimiter;
 
     // List of scanned Wifi base stations
     ScannedStationModel       *mStationModel;
@@ -197,6 +460,35 @@ private:
 
     // Display-suitable combination model
     CombinedModel             *mCombinedModel;
+
+    // Per-BSSID detail under each SSID
+    AccessPointModel          *mAccessPointModel;
+
+    static WifiBackend        *sBackend;
+    WifiBackend               *mBackend;
+
+    WifiScanScheduler         *mScanScheduler;
+    WifiScanList               mHeldScan;       // Results that arrived while paused
+    bool                       mScanHeld;
+
+    static QString             sCacheFile;
+    WifiCache                 *mCache;          // 0 without a cache file
+    qint64                     mScanTime;       // ms since the epoch of the shown results
+    bool                       mScanCached;
+
+    // Latest data from the binder thread, waiting for applyPending()
+    enum { PENDING_STATE = 0x1, PENDING_SCAN = 0x2, PENDING_CONFIG = 0x4, PENDING_INFO = 0x8 };
+    QMutex                     mPendingLock;
+    bool                       mPendingPosted;
+    int                        mPendingFlags;
+    DriverState                mPendingState;
+    WifiScanList               mPendingScan;
+    WifiConfigList             mPendingConfig;
+
+    struct UpdateStats {
+	int    updates, scans, stations;
+	qint64 totalNs, maxNs;
+    } mStats;
 };
 
 #endif // _KLAATU_WIFI_H
@@ -0,0 +1,132 @@
+/*
+  Built-in wifi benchmark drivers.  These only need the wifi code, so
+  they also build on a host (see klaatu-wifi-host.pro).
+ */
+
+#include "benchmark.h"
+#include "allocstats.h"
+#include "fakewifi.h"
+#include "framegovernor.h"
+#include "wifi.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QQmlContext>
+#include <QQuickView>
+#include <QTimer>
+
+/*
+  Each round every station's RSSI wanders by a few dB and about one
+  station in twenty drops out or comes back, which is enough to
+  reorder rows on most rounds.  A fixed LCG keeps runs comparable.
+ */
+
+static unsigned int nextRandom(unsigned int *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7fff;
+}
+
+int Benchmark::wifiModel(int rounds)
+{
+    if (rounds <= 0)
+	rounds = 100;
+
+    static const int kSizes[] = { 10, 100, 1000 };
+    for (unsigned int size = 0 ; size < sizeof(kSizes) / sizeof(kSizes[0]) ; size++) {
+	int count = kSizes[size];
+	unsigned int seed = 1;
+
+	WifiScanList stations(count);
+	for (int i = 0 ; i < count ; i++) {
+	    WifiScanRecord& r(stations[i]);
+	    r.bssid = QString().sprintf("02:00:00:00:%02x:%02x", (i >> 8) & 0xff, i & 0xff);
+	    r.ssid = QStringLiteral("Station %1").arg(i);
+	    r.flags = QStringLiteral("[WPA2-PSK-CCMP][ESS]");
+	    r.frequency = (i & 1) ? 5180 : 2437;
+	    r.rssi = -40 - (int) nextRandom(&seed) % 50;
+	    r.key_mgmt = Wifi::KEYMGMT_WPA2;
+	}
+
+	CombinedModel model;
+	model.update(stations);
+
+	qint64 totalNs = 0, maxNs = 0;
+	int allocations = AllocStats::count();
+	for (int round = 0 ; round < rounds ; round++) {
+	    WifiScanList scan;
+	    scan.reserve(count);
+	    for (int i = 0 ; i < count ; i++) {
+		WifiScanRecord& r(stations[i]);
+		r.rssi = qBound(-95, r.rssi + (int) nextRandom(&seed) % 9 - 4, -30);
+		if (nextRandom(&seed) % 20)
+		    scan.append(r);
+	    }
+
+	    QElapsedTimer timer;
+	    timer.start();
+	    model.update(scan);
+	    qint64 elapsed = timer.nsecsElapsed();
+	    totalNs += elapsed;
+	    if (elapsed > maxNs)
+		maxNs = elapsed;
+	}
+	allocations = AllocStats::count() - allocations;
+
+	qDebug("Wifi model benchmark: %4d stations, %d rounds, update() mean %.1f us, max %.1f us",
+	       count, rounds, totalNs / 1000.0 / rounds, maxNs / 1000.0);
+	if (AllocStats::isEnabled())
+	    qDebug("  %.1f allocations per round, scan list included",
+		   double(allocations) / rounds);
+    }
+    return 0;
+}
+
+/*
+  The view runs unthrottled so the frame count shows what the updates
+  cost the scene graph.
+ */
+
+int Benchmark::wifiView(const QString& script, const QString& qml, int seconds)
+{
+    if (seconds <= 0)
+	seconds = 30;
+    Wifi::setBackend(new FakeWifiBackend(script));
+    Wifi *wifi = Wifi::instance();
+
+    QQuickView view;
+    view.setResizeMode(QQuickView::SizeRootObjectToView);
+    FrameGovernor *governor = FrameGovernor::instance();
+    governor->setEnabled(false);
+    governor->setWindow(&view);
+    view.rootContext()->setContextProperty(QStringLiteral("wifi"), wifi);
+    view.setSource(QUrl::fromLocalFile(qml));
+    if (view.status() == QQuickView::Error)
+	return 1;
+    view.show();
+
+    int allocations = AllocStats::count();
+    QEventLoop loop;
+    QTimer::singleShot(seconds * 1000, &loop, SLOT(quit()));
+    loop.exec();
+    allocations = AllocStats::count() - allocations;
+
+    QVariantMap stats = wifi->updateStats();
+    QVariantMap frames = governor->statistics();
+    int updates = stats.value(QStringLiteral("updates")).toInt();
+    qDebug("Wifi view benchmark: %d updates (%d scans, %d stations) in %d s",
+	   updates, stats.value(QStringLiteral("scans")).toInt(),
+	   stats.value(QStringLiteral("stations")).toInt(), seconds);
+    qDebug("  update mean %.1f us, max %.1f us",
+	   stats.value(QStringLiteral("meanUs")).toDouble(),
+	   stats.value(QStringLiteral("maxUs")).toDouble());
+    qDebug("  %d frames rendered, %d damaged, %.1f fps",
+	   frames.value(QStringLiteral("framesRendered")).toInt(),
+	   frames.value(QStringLiteral("framesDamaged")).toInt(),
+	   frames.value(QStringLiteral("framesRendered")).toInt() / double(seconds));
+    if (AllocStats::isEnabled())
+	qDebug("  %d allocations, %.1f per update", allocations,
+	       updates ? double(allocations) / updates : 0.0);
+    return 0;
+}
@@ -0,0 +1,237 @@
+/*
+  Wifi scan cache
+ */
+
+#include "wificache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <QDebug>
+#include <QFile>
+#include <QMutex>
+#include <QRunnable>
+#include <QThreadPool>
+
+const int kSaveDelay = 30000;   // ms from the first unsaved change to the write
+
+// --------------------------------------------------------------------------------
+
+/*
+  File layout: a Header, the scan entries, the config entries and then
+  the string data, UTF-8 without terminators.  Strings are referred to
+  by offset and length within the string data.  Fields are in host
+  byte order; the file never leaves the device.
+ */
+
+struct Header {
+    quint32 magic;
+    quint16 version;
+    quint16 reserved;
+    qint64  scanTime;       // ms since the epoch
+    quint32 scanCount;
+    quint32 configCount;
+    quint32 stringSize;
+    quint32 reserved2;
+};
+
+struct StringRef {
+    quint32 offset;
+    quint32 length;
+};
+
+struct ScanEntry {
+    StringRef bssid, ssid, flags;
+    qint32    frequency, rssi, key_mgmt;
+};
+
+struct ConfigEntry {
+    StringRef ssid;
+    qint32    network_id, status, key_mgmt;
+};
+
+static const quint32 kMagic = 0x4357424b;   // "KBWC"
+static const quint16 kVersion = 1;
+
+static StringRef addString(QByteArray *strings, const QString& str)
+{
+    QByteArray utf8 = str.toUtf8();
+    StringRef ref;
+    ref.offset = strings->size();
+    ref.length = utf8.size();
+    strings->append(utf8);
+    return ref;
+}
+
+static bool getString(const char *strings, quint32 size, const StringRef& ref, QString *str)
+{
+    if (ref.offset > size || ref.length > size - ref.offset)
+	return false;
+    *str = QString::fromUtf8(strings + ref.offset, ref.length);
+    return true;
+}
+
+// --------------------------------------------------------------------------------
+
+static QMutex sWriteLock;   // One writer at a time per process
+
+class WifiCacheTask : public QRunnable
+{
+public:
+    WifiCacheTask(const QString& path, const WifiScanList& scan, qint64 scanTime,
+		  const WifiConfigList& config)
+	: mPath(path), mScan(scan), mScanTime(scanTime), mConfig(config) {}
+
+    void run() {
+	QByteArray strings;
+	QByteArray entries;
+	for (int i = 0 ; i < mScan.size() ; i++) {
+	    const WifiScanRecord& record(mScan.at(i));
+	    ScanEntry entry;
+	    entry.bssid     = addString(&strings, record.bssid);
+	    entry.ssid      = addString(&strings, record.ssid);
+	    entry.flags     = addString(&strings, record.flags);
+	    entry.frequency = record.frequency;
+	    entry.rssi      = record.rssi;
+	    entry.key_mgmt  = record.key_mgmt;
+	    entries.append((const char *) &entry, sizeof(entry));
+	}
+	for (int i = 0 ; i < mConfig.size() ; i++) {
+	    const WifiConfigRecord& record(mConfig.at(i));
+	    ConfigEntry entry;
+	    entry.ssid       = addString(&strings, record.ssid);
+	    entry.network_id = record.network_id;
+	    entry.status     = record.status;
+	    entry.key_mgmt   = record.key_mgmt;
+	    entries.append((const char *) &entry, sizeof(entry));
+	}
+
+	Header header;
+	memset(&header, 0, sizeof(header));
+	header.magic       = kMagic;
+	header.version     = kVersion;
+	header.scanTime    = mScanTime;
+	header.scanCount   = mScan.size();
+	header.configCount = mConfig.size();
+	header.stringSize  = strings.size();
+
+	QMutexLocker _l(&sWriteLock);
+	QString tmpPath = mPath + QStringLiteral(".tmp");
+	QFile file(tmpPath);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+	    qWarning() << "Unable to write wifi cache" << tmpPath;
+	    return;
+	}
+	file.setPermissions(QFile::ReadOwner | QFile::WriteOwner);
+	bool ok = (file.write((const char *) &header, sizeof(header)) == sizeof(header) &&
+		   file.write(entries) == entries.size() &&
+		   file.write(strings) == strings.size() &&
+		   file.flush() && fsync(file.handle()) == 0);
+	file.close();
+	if (!ok || ::rename(QFile::encodeName(tmpPath).constData(),
+			    QFile::encodeName(mPath).constData()) != 0) {
+	    qWarning() << "Unable to write wifi cache" << mPath;
+	    QFile::remove(tmpPath);
+	}
+    }
+
+private:
+    QString        mPath;
+    WifiScanList   mScan;
+    qint64         mScanTime;
+    WifiConfigList mConfig;
+};
+
+// --------------------------------------------------------------------------------
+
+WifiCache::WifiCache(const QString& path, QObject *parent)
+    : QObject(parent)
+    , mPath(path)
+    , mScanTime(0)
+{
+    mTimer.setSingleShot(true);
+    connect(&mTimer, SIGNAL(timeout()), SLOT(write()));
+}
+
+WifiCache::~WifiCache()
+{
+    if (mTimer.isActive()) {
+	mTimer.stop();
+	WifiCacheTask(mPath, mScan, mScanTime, mConfig).run();
+    }
+}
+
+bool WifiCache::load(WifiScanList *scan, qint64 *scanTime, WifiConfigList *config)
+{
+    QFile file(mPath);
+    if (!file.open(QIODevice::ReadOnly))
+	return false;
+    qint64 size = file.size();
+    if (size < qint64(sizeof(Header)))
+	return false;
+    const uchar *data = file.map(0, size);
+    if (!data)
+	return false;
+
+    Header header;
+    memcpy(&header, data, sizeof(header));
+    qint64 stringStart = sizeof(Header) + qint64(header.scanCount) * sizeof(ScanEntry)
+	+ qint64(header.configCount) * sizeof(ConfigEntry);
+    bool valid = (header.magic == kMagic && header.version == kVersion &&
+		  stringStart + header.stringSize == size);
+
+    const char *strings = (const char *) data + stringStart;
+    const uchar *p = data + sizeof(Header);
+    WifiScanList scanList(valid ? header.scanCount : 0);
+    for (int i = 0 ; valid && i < scanList.size() ; i++, p += sizeof(ScanEntry)) {
+	ScanEntry entry;
+	memcpy(&entry, p, sizeof(entry));
+	WifiScanRecord& record(scanList[i]);
+	valid = (getString(strings, header.stringSize, entry.bssid, &record.bssid) &&
+		 getString(strings, header.stringSize, entry.ssid, &record.ssid) &&
+		 getString(strings, header.stringSize, entry.flags, &record.flags));
+	record.frequency = entry.frequency;
+	record.rssi      = entry.rssi;
+	record.key_mgmt  = entry.key_mgmt;
+    }
+    WifiConfigList configList(valid ? header.configCount : 0);
+    for (int i = 0 ; valid && i < configList.size() ; i++, p += sizeof(ConfigEntry)) {
+	ConfigEntry entry;
+	memcpy(&entry, p, sizeof(entry));
+	WifiConfigRecord& record(configList[i]);
+	valid = getString(strings, header.stringSize, entry.ssid, &record.ssid);
+	record.network_id = entry.network_id;
+	record.status     = entry.status;
+	record.key_mgmt   = entry.key_mgmt;
+    }
+    file.unmap(const_cast<uchar *>(data));
+
+    if (!valid) {
+	qWarning() << "Ignoring damaged wifi cache" << mPath;
+	return false;
+    }
+    *scan = scanList;
+    *scanTime = header.scanTime;
+    *config = configList;
+    return true;
+}
+
+void WifiCache::save(const WifiScanList& scan, qint64 scanTime, const WifiConfigList& config)
+{
+    mScan = scan;
+    mScanTime = scanTime;
+    mConfig = config;
+    if (!mTimer.isActive())
+	mTimer.start(kSaveDelay);
+}
+
+/*
+  The task gets its own copies of the lists; the records are implicitly
+  shared, so this is cheap on the GUI thread.
+ */
+
+void WifiCache::write()
+{
+    QThreadPool::globalInstance()->start(new WifiCacheTask(mPath, mScan, mScanTime, mConfig));
+}
@@ -0,0 +1,46 @@
+/*
+  Wifi scan cache
+ */
+
+#ifndef _WIFI_CACHE_H
+#define _WIFI_CACHE_H
+
+#include <QObject>
+#include <QTimer>
+
+#include "wifi.h"
+
+/*
+  Keeps the last scan results and configured networks in a small file
+  so the wifi models have something to show straight after a restart.
+  The file is read once through a memory map.  Saves are coalesced and
+  written by a thread pool task to a temporary file that is renamed
+  into place, so a crash never leaves a half-written cache.
+  Pre-shared keys are not stored.
+ */
+
+class WifiCache : public QObject
+{
+    Q_OBJECT
+public:
+    WifiCache(const QString& path, QObject *parent = 0);
+    ~WifiCache();
+
+    // False if there is no usable cache.  'scanTime' is ms since the epoch.
+    bool         load(WifiScanList *scan, qint64 *scanTime, WifiConfigList *config);
+
+    // Remember the latest data; written at most once per kSaveDelay
+    void         save(const WifiScanList& scan, qint64 scanTime, const WifiConfigList& config);
+
+private slots:
+    void         write();
+
+private:
+    QString        mPath;
+    QTimer         mTimer;
+    WifiScanList   mScan;
+    qint64         mScanTime;
+    WifiConfigList mConfig;
+};
+
+#endif // _WIFI_CACHE_H
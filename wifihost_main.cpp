@@ -0,0 +1,71 @@
+/*
+  Klaatu_wifi_host - Wifi model benchmarks on a plain Linux host
+ */
+
+#include <stdlib.h>
+
+#include <QDebug>
+#include <QGuiApplication>
+#include <QStringList>
+
+#include "benchmark.h"
+
+QString progname;
+
+static void usage(int code=0)
+{
+    qWarning("Usage: %s [ARGS] SCRIPT QMLFILE\n"
+	     "       %s --model-benchmark N\n"
+	     "\n"
+	     "Valid args:\n"
+	     "   --seconds N             Run the view for N seconds (default 30)\n"
+	     "   --model-benchmark N     Time N scan rounds through the wifi model and exit\n"
+	     "\n"
+	     "SCRIPT is a FakeWifiBackend script (see fakewifi.h)\n"
+	     "QMLFILE is shown with the Wifi object as 'wifi', e.g. wifilist.qml\n",
+	     qPrintable(progname), qPrintable(progname));
+    exit(code);
+}
+
+int main(int argc, char **argv)
+{
+    QGuiApplication app(argc, argv);
+    app.setApplicationName("Klaatu_WifiHost");
+    app.setOrganizationName("Klaatu");
+    app.setOrganizationDomain("klaatu.com");
+
+    int         seconds = 30;
+    int         modelBenchmark = 0;
+    QStringList args = QGuiApplication::arguments();
+    progname = args.takeFirst();
+
+    while (args.size()) {
+	QString arg = args.at(0);
+	if (!arg.startsWith('-'))
+	    break;
+	args.removeFirst();
+	if (arg == QStringLiteral("-help"))
+	    usage();
+	else if (arg == QStringLiteral("--seconds")) {
+	    if (!args.size())
+		usage();
+	    seconds = args.takeFirst().toInt();
+	}
+	else if (arg == QStringLiteral("--model-benchmark")) {
+	    if (!args.size())
+		usage();
+	    modelBenchmark = args.takeFirst().toInt();
+	}
+	else {
+	    qWarning("Unexpected argument '%s'", qPrintable(arg));
+	    usage(1);
+	}
+    }
+
+    if (modelBenchmark)
+	return Benchmark::wifiModel(modelBenchmark);
+
+    if (args.size() != 2)
+	usage(1);
+    return Benchmark::wifiView(args.at(0), args.at(1), seconds);
+}
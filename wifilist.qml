@@ -0,0 +1,34 @@
+import QtQuick 2.0
+
+// A scan list like the settings page's, for klaatu_wifi_host
+
+Rectangle {
+    width: 480
+    height: 800
+    color: "black"
+
+    ListView {
+        anchors.fill: parent
+        model: wifi.combinedModel
+        delegate: Item {
+            width: ListView.view.width
+            height: 48
+            Text {
+                anchors.left: parent.left
+                anchors.leftMargin: 8
+                anchors.verticalCenter: parent.verticalCenter
+                color: "white"
+                text: ssid + "  " + note
+            }
+            Text {
+                anchors.right: parent.right
+                anchors.rightMargin: 8
+                anchors.verticalCenter: parent.verticalCenter
+                color: stale ? "gray" : "white"
+                text: signalLevel + " bars (" + rssi + " dBm)"
+            }
+        }
+        move: Transition { NumberAnimation { property: "y"; duration: 200 } }
+        moveDisplaced: Transition { NumberAnimation { property: "y"; duration: 200 } }
+    }
+}